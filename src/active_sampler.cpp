@@ -0,0 +1,113 @@
+#include "active_sampler.h"
+
+#include <algorithm>
+
+using LiteMath::BBox3f;
+
+float3 ActiveSamplerSnapshot::SamplePoint(const BBox3f& a_box, RandomGen& gen) const
+{
+  if (cdf.empty())
+    return sampleUniformBBox(a_box, gen);
+
+  const float    u      = randomFloat(gen);
+  const uint32_t cellId = std::min(uint32_t(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), uint32_t(cdf.size() - 1));
+  const uint32_t x      = cellId % gridSize;
+  const uint32_t y      = (cellId / gridSize) % gridSize;
+  const uint32_t z      = cellId / (gridSize * gridSize);
+
+  const float  cellSize = 1.f / float(gridSize);
+  const float3 local    = float3((float(x) + randomFloat(gen)) * cellSize,
+                                 (float(y) + randomFloat(gen)) * cellSize,
+                                 (float(z) + randomFloat(gen)) * cellSize);
+  return a_box.boxMin + (a_box.boxMax - a_box.boxMin) * local;
+}
+
+void ActiveRaySampler::Init(uint32_t a_gridSize, float a_uniformShare, float a_hitShare)
+{
+  m_gridSize     = a_gridSize;
+  m_uniformShare = clip(0.f, 1.f, a_uniformShare);
+  m_hitShare     = clip(0.f, 1.f, a_hitShare);
+  m_cells.assign(size_t(a_gridSize) * a_gridSize * a_gridSize, Cell());
+}
+
+uint32_t ActiveRaySampler::CellId(float3 a_pos) const
+{
+  const float    scale = float(m_gridSize);
+  const uint32_t x     = uint32_t(clip(0.f, scale - 1.f, a_pos.x * scale));
+  const uint32_t y     = uint32_t(clip(0.f, scale - 1.f, a_pos.y * scale));
+  const uint32_t z     = uint32_t(clip(0.f, scale - 1.f, a_pos.z * scale));
+  return (z * m_gridSize + y) * m_gridSize + x;
+}
+
+void ActiveRaySampler::Record(float3 a_point1, float3 a_point2, bool a_hit, float a_error)
+{
+  // both points of a ray are drawn from the distribution, so each of them gets a half of the ray
+  //
+  for (const float3& pos : {a_point1, a_point2})
+  {
+    Cell& cell = m_cells[CellId(pos)];
+    cell.rays   += 0.5f;
+    cell.hits   += a_hit ? 0.5f : 0.f;
+    cell.errors += 0.5f * a_error;
+  }
+}
+
+void ActiveRaySampler::Decay(float a_factor)
+{
+  for (auto& cell : m_cells)
+  {
+    cell.rays   *= a_factor;
+    cell.hits   *= a_factor;
+    cell.errors *= a_factor;
+  }
+}
+
+ActiveSamplerSnapshot ActiveRaySampler::MakeSnapshot() const
+{
+  ActiveSamplerSnapshot snapshot;
+  snapshot.gridSize = m_gridSize;
+
+  // (1) mean error and hit rate per cell; cells without rays get the global means, so they are not starved
+  //
+  float totalRays = 0.f, totalHits = 0.f, totalErrors = 0.f;
+  for (const auto& cell : m_cells)
+  {
+    totalRays   += cell.rays;
+    totalHits   += cell.hits;
+    totalErrors += cell.errors;
+  }
+  if (totalRays <= 0.f)
+    return snapshot; // no statistics yet, empty cdf is uniform sampling
+
+  const float meanError = totalErrors / totalRays;
+  const float meanHits  = totalHits   / totalRays;
+
+  std::vector<float> errors(m_cells.size()), hitRates(m_cells.size());
+  float errorSum = 0.f, hitRateSum = 0.f;
+  for (size_t cellId = 0; cellId < m_cells.size(); cellId++)
+  {
+    const Cell& cell = m_cells[cellId];
+    errors  [cellId] = cell.rays > 0.f ? cell.errors / cell.rays : meanError;
+    hitRates[cellId] = cell.rays > 0.f ? cell.hits   / cell.rays : meanHits;
+    errorSum   += errors[cellId];
+    hitRateSum += hitRates[cellId];
+  }
+
+  // (2) mix with uniform density and build cdf
+  //
+  const float uniform = 1.f / float(m_cells.size());
+  snapshot.cdf.resize(m_cells.size());
+  float sum = 0.f;
+  for (size_t cellId = 0; cellId < m_cells.size(); cellId++)
+  {
+    const float errorShare = errorSum   > 0.f ? errors  [cellId] / errorSum   : uniform;
+    const float hitShare   = hitRateSum > 0.f ? hitRates[cellId] / hitRateSum : uniform;
+    sum += m_uniformShare * uniform + (1.f - m_uniformShare) * ((1.f - m_hitShare) * errorShare + m_hitShare * hitShare);
+    snapshot.cdf[cellId] = sum;
+  }
+  for (auto& value : snapshot.cdf)
+    value /= sum;
+  snapshot.cdf.back() = 1.f;
+
+  return snapshot;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "LiteMath.h"
+#include "utils.h"
+
+#include <vector>
+#include <cstdint>
+
+/**
+\brief Frozen sampling distribution of ActiveRaySampler: CDF over cells of a regular grid in normalized [0,1]^3 coordinates. 
+       It does not change while rays are generated from it, so generated points depend only on the snapshot and the random stream.
+*/
+struct ActiveSamplerSnapshot
+{
+  uint32_t           gridSize = 0;
+  std::vector<float> cdf;       ///< gridSize^3 entries, the last one is 1
+
+  float3 SamplePoint(const LiteMath::BBox3f& a_box, RandomGen& gen) const; ///< point of a_box
+};
+
+/**
+\brief Coarse spatial histogram of network error and hit rate of training rays. 
+       Rays are recorded into the cells of the two points they were sampled through, the sampling density of a cell is 
+         uniformShare/cells + (1 - uniformShare)*((1 - hitShare)*errorShare(cell) + hitShare*hitRateShare(cell)),
+       so a_hitShare moves rays from high error regions to regions where rays hit the scene.
+*/
+class ActiveRaySampler
+{
+public:
+  void Init(uint32_t a_gridSize, float a_uniformShare, float a_hitShare);
+  bool Empty() const { return m_cells.empty(); }
+
+  void Record(float3 a_point1, float3 a_point2, bool a_hit, float a_error); ///< sampled points normalized to the dataset box
+  void Decay(float a_factor);                                            ///< older statistics are outdated by training
+
+  ActiveSamplerSnapshot MakeSnapshot() const;
+
+private:
+  struct Cell
+  {
+    float rays   = 0.f;
+    float hits   = 0.f;
+    float errors = 0.f;
+  };
+
+  uint32_t CellId(float3 a_pos) const;
+
+  std::vector<Cell> m_cells;
+  uint32_t          m_gridSize     = 0;
+  float             m_uniformShare = 0.25f;
+  float             m_hitShare     = 0.25f;
+};
@@ -4,7 +4,7 @@
 #include <cassert>
 #include <cfloat>
 
-#include "BVH2CommonRT.h"
+#include "bvh_tree.h"
 #include "utils.h"
 
 void BVH2CommonRT::IntersectAllPrimitivesInLeaf(const float3 ray_pos, const float3 ray_dir,
@@ -16,16 +16,8 @@ void BVH2CommonRT::IntersectAllPrimitivesInLeaf(const float3 ray_pos, const floa
 
   for (uint32_t triId = a_start; triId < a_start + a_count; triId++)
   {
-    const uint32_t A = m_indices[a_geomOffsets.x + triId*3 + 0];
-    const uint32_t B = m_indices[a_geomOffsets.x + triId*3 + 1];
-    const uint32_t C = m_indices[a_geomOffsets.x + triId*3 + 2];
-
-    const float3 A_pos = to_float3(m_vertPos[a_geomOffsets.y + A]);
-    const float3 B_pos = to_float3(m_vertPos[a_geomOffsets.y + B]);
-    const float3 C_pos = to_float3(m_vertPos[a_geomOffsets.y + C]);
-
-    const float3 edge1 = B_pos - A_pos;
-    const float3 edge2 = C_pos - A_pos;
+    float3 A_pos, edge1, edge2;
+    FetchTriangle(a_geomOffsets, triId, &A_pos, &edge1, &edge2);
     const float3 pvec = cross(ray_dir, edge2);
     const float3 tvec = ray_pos - A_pos;
     const float3 qvec = cross(tvec, edge1);
@@ -51,6 +43,10 @@ void BVH2CommonRT::BVH2TraverseC32(const float3 ray_pos, const float3 ray_dir, f
                                    uint32_t instId, uint32_t geomId, uint32_t stack[STACK_SIZE], 
                                    CRT_Hit *pHit)
 {
+  #ifdef ENABLE_METRICS
+  ThreadTraverseStats& stats = LocalStats();
+  #endif
+
   const uint32_t bvhOffset = m_bvhOffsets[geomId];
 
   int top = 0;
@@ -67,17 +63,17 @@ void BVH2CommonRT::BVH2TraverseC32(const float3 ray_pos, const float3 ray_dir, f
     if ((leftNodeOffset & LEAF_BIT) == 0)
     {
       #ifdef ENABLE_METRICS
-      m_stats.NC  += 2;
-      m_stats.BLB += 2*sizeof(BVHNode);
+      stats.NC  += 2;
+      stats.BLB += 2*sizeof(BVHNode);
       if (leftNodeOffsetOld != leftNodeOffset) {
         for (int i = 0; i < TREELET_ARR_SIZE; i++) {
           if (std::abs(double(leftNodeOffset) - double(leftNodeOffsetOld)) * double(sizeof(BVHNode)) >= (double)treelet_sizes[i])
-            m_stats.LJC[i]++;
+            stats.LJC[i]++;
           const uint32_t oldCacheLineId = uint32_t(leftNodeOffsetOld * sizeof(BVHNode)) / uint32_t(treelet_sizes[i]);
           const uint32_t newCacheLineId = uint32_t(leftNodeOffset * sizeof(BVHNode)) / uint32_t(treelet_sizes[i]);
           if (oldCacheLineId != newCacheLineId){
-            m_stats.CMC[i]++;
-            m_stats.WSS[i].insert(newCacheLineId);
+            stats.CMC[i]++;
+            stats.MarkLine(i, newCacheLineId);
           }
         }
         leftNodeOffsetOld = leftNodeOffset;
@@ -108,8 +104,8 @@ void BVH2CommonRT::BVH2TraverseC32(const float3 ray_pos, const float3 ray_dir, f
         stack[top]     = (tm0.x <= tm1.x) ? node1.leftOffset : node0.leftOffset; // GPU style branch
         top++;
         #ifdef ENABLE_METRICS
-        m_stats.SOC++;
-        m_stats.SBL+=sizeof(uint32_t); 
+        stats.SOC++;
+        stats.SBL+=sizeof(uint32_t); 
         #endif
       }
     } 
@@ -120,10 +116,10 @@ void BVH2CommonRT::BVH2TraverseC32(const float3 ray_pos, const float3 ray_dir, f
       IntersectAllPrimitivesInLeaf(ray_pos, ray_dir, tNear, instId, geomId, start, count, pHit);
       needStackPop = true;
       #ifdef ENABLE_METRICS
-      m_stats.LC++;
-      m_stats.LC2++;
-      m_stats.TC+=count;
-      m_stats.BLB+=count*(3*sizeof(uint32_t) + 3*sizeof(float4));
+      stats.LC++;
+      stats.LC2++;
+      stats.TC+=count;
+      stats.BLB+=count*TriangleFetchBytes();
       #endif
     }
 
@@ -134,181 +130,704 @@ void BVH2CommonRT::BVH2TraverseC32(const float3 ray_pos, const float3 ray_dir, f
       top--;
       leftNodeOffset = stack[std::max(top,0)];
       #ifdef ENABLE_METRICS
-      m_stats.SOC++;
-      m_stats.SBL+=sizeof(uint32_t); 
+      stats.SOC++;
+      stats.SBL+=sizeof(uint32_t); 
       #endif
     }
   } // end while (top >= 0)
 }
              
-uint32_t BVH2CommonRT::LBVH2Traverse(float4 posAndNear, float4 dirAndFar, uint32_t stack[STACK_SIZE],
-                                     BoxHit out_hits[LBVH_MAXHITS])
+void BVH2CommonRT::BVH4TraverseC32(const float3 ray_pos, const float3 ray_dir, float tNear,
+                                   uint32_t instId, uint32_t geomId, CRT_Hit *pHit)
 {
-  if((m_nodesTLAS[0].leftOffset & LEAF_BIT) != 0) // if root is leaf
+  #ifdef ENABLE_METRICS
+  ThreadTraverseStats& stats = LocalStats();
+  #endif
+
+  const uint32_t bvhOffset = m_bvh4Offsets[geomId];
+  const float3 rayDirInv   = SafeInverse(ray_dir);
+
+  const simd::vfloat4 posX   = simd::set4(ray_pos.x);
+  const simd::vfloat4 posY   = simd::set4(ray_pos.y);
+  const simd::vfloat4 posZ   = simd::set4(ray_pos.z);
+  const simd::vfloat4 invX   = simd::set4(rayDirInv.x);
+  const simd::vfloat4 invY   = simd::set4(rayDirInv.y);
+  const simd::vfloat4 invZ   = simd::set4(rayDirInv.z);
+  const simd::vfloat4 tNear4 = simd::set4(tNear);
+
+  // every node pushes up to 3 siblings while the tree is half as deep as BVH2
+  //
+  uint32_t stackNode  [2*STACK_SIZE];
+  float    stackTEnter[2*STACK_SIZE];
+  int top = 0;
+
+  stackNode  [top] = 0;
+  stackTEnter[top] = tNear;
+  top++;
+
+  while (top > 0)
   {
-    out_hits[0] = make_BoxHit(EXTRACT_START(m_nodesTLAS[0].leftOffset), 1e37f);
-    return 1;
-  }  
-  
-  const float3 rayDirInv = SafeInverse(to_float3(dirAndFar));
-  const float  tNear     = posAndNear.w;
-  const float  tFar      = dirAndFar.w;
+    top--;
+    const uint32_t nodeRef = stackNode[top];
+    if (stackTEnter[top] > pHit->t) // closer hit was found after this node had been pushed
+      continue;
 
-  int   topRes  = 0;
-  int   top     = 0;
-  
-  uint32_t leftNodeOffset  = m_nodesTLAS[0].leftOffset;  // assume we intersect root and the root is never leaf
-  uint32_t rightNodeOffset = m_nodesTLAS[0].escapeIndex;
-  
-  // while-while traversal
+    if ((nodeRef & LEAF_BIT) != 0)
+    {
+      const uint32_t start = EXTRACT_START(nodeRef);
+      const uint32_t count = EXTRACT_COUNT(nodeRef);
+      IntersectAllPrimitivesInLeaf(ray_pos, ray_dir, tNear, instId, geomId, start, count, pHit);
+      #ifdef ENABLE_METRICS
+      stats.LC++;
+      stats.LC2++;
+      stats.TC+=count;
+      stats.BLB+=count*TriangleFetchBytes();
+      #endif
+      continue;
+    }
+
+    const BVH4Node& node = m_allNodes4[bvhOffset + nodeRef];
+    #ifdef ENABLE_METRICS
+    stats.NC  += 4;
+    stats.BLB += sizeof(BVH4Node);
+    #endif
+
+    // one slab test for all 4 children
+    //
+    const simd::vfloat4 t1x = (simd::load4(node.boxMinX) - posX) * invX;
+    const simd::vfloat4 t2x = (simd::load4(node.boxMaxX) - posX) * invX;
+    const simd::vfloat4 t1y = (simd::load4(node.boxMinY) - posY) * invY;
+    const simd::vfloat4 t2y = (simd::load4(node.boxMaxY) - posY) * invY;
+    const simd::vfloat4 t1z = (simd::load4(node.boxMinZ) - posZ) * invZ;
+    const simd::vfloat4 t2z = (simd::load4(node.boxMaxZ) - posZ) * invZ;
 
-  while(top >= 0) 
+    const simd::vfloat4 tMin = simd::vmax(simd::vmax(simd::vmin(t1x, t2x), simd::vmin(t1y, t2y)), simd::vmin(t1z, t2z));
+    const simd::vfloat4 tMax = simd::vmin(simd::vmin(simd::vmax(t1x, t2x), simd::vmax(t1y, t2y)), simd::vmax(t1z, t2z));
+
+    const uint32_t hitMask = simd::bits((tMin <= tMax) & (tMax >= tNear4) & (tMin <= simd::set4(pHit->t)));
+
+    float tEnter[4];
+    simd::store4(tEnter, tMin);
+
+    // sort hit children from far to near, so the nearest one is popped first
+    //
+    uint32_t hitChild[4];
+    float    hitT[4];
+    uint32_t hitsNum = 0;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+      if (((hitMask >> i) & 1u) == 0 || node.child[i] == 0xFFFFFFFF)
+        continue;
+      uint32_t j = hitsNum++;
+      while (j > 0 && hitT[j-1] < tEnter[i])
+      {
+        hitT[j]     = hitT[j-1];
+        hitChild[j] = hitChild[j-1];
+        j--;
+      }
+      hitT[j]     = tEnter[i];
+      hitChild[j] = node.child[i];
+    }
+
+    for (uint32_t i = 0; i < hitsNum; i++)
+    {
+      stackNode  [top] = hitChild[i];
+      stackTEnter[top] = hitT[i];
+      top++;
+    }
+    #ifdef ENABLE_METRICS
+    stats.SOC += hitsNum;
+    stats.SBL += hitsNum*sizeof(uint32_t);
+    #endif
+  }
+}
+
+void BVH2CommonRT::BVH2TraverseQ8(const float3 ray_pos, const float3 ray_dir, float tNear,
+                                  uint32_t instId, uint32_t geomId, CRT_Hit *pHit)
+{
+  #ifdef ENABLE_METRICS
+  ThreadTraverseStats& stats = LocalStats();
+  #endif
+
+  const uint32_t bvhOffset = m_bvhOffsets[geomId];
+  const float3   rayDirInv = SafeInverse(ray_dir);
+
+  // children are decoded against the box of their parent, so the decoded box goes to the stack together with the offset;
+  // the root pair is quantized against the box of the geom
+  //
+  uint32_t stackNode  [STACK_SIZE];
+  float3   stackBoxMin[STACK_SIZE];
+  float3   stackBoxMax[STACK_SIZE];
+
+  int top = 0;
+  uint32_t leftNodeOffset = 0;
+  float3   frameMin       = to_float3(m_geomBoxes[geomId].boxMin);
+  float3   frameMax       = to_float3(m_geomBoxes[geomId].boxMax);
+  #ifdef ENABLE_METRICS
+  uint32_t leftNodeOffsetOld = leftNodeOffset;
+  #endif
+
+  while (top >= 0)
   {
-    while(top >= 0 && ((leftNodeOffset & LEAF_BIT) == 0)) // searching for leaf
+    bool needStackPop = false;
+    if ((leftNodeOffset & LEAF_BIT) == 0)
     {
-      const BVHNode node0 = m_nodesTLAS[leftNodeOffset];
-      const BVHNode node1 = m_nodesTLAS[rightNodeOffset];
-      
       #ifdef ENABLE_METRICS
-      m_stats.NC  += 2;
-      m_stats.BLB += 2 * sizeof(BVHNode);
+      stats.NC  += 2;
+      stats.BLB += sizeof(BVHNodePairQ);
+      if (leftNodeOffsetOld != leftNodeOffset) {
+        for (int i = 0; i < TREELET_ARR_SIZE; i++) {
+          if (std::abs(double(leftNodeOffset/2) - double(leftNodeOffsetOld/2)) * double(sizeof(BVHNodePairQ)) >= (double)treelet_sizes[i])
+            stats.LJC[i]++;
+          const uint32_t oldCacheLineId = uint32_t((leftNodeOffsetOld/2) * sizeof(BVHNodePairQ)) / uint32_t(treelet_sizes[i]);
+          const uint32_t newCacheLineId = uint32_t((leftNodeOffset/2)    * sizeof(BVHNodePairQ)) / uint32_t(treelet_sizes[i]);
+          if (oldCacheLineId != newCacheLineId){
+            stats.CMC[i]++;
+            stats.MarkLine(i, newCacheLineId);
+          }
+        }
+        leftNodeOffsetOld = leftNodeOffset;
+      }
       #endif
 
-      const float2 tm0 = RayBoxIntersection2(to_float3(posAndNear), rayDirInv, node0.boxMin, node0.boxMax);
-      const float2 tm1 = RayBoxIntersection2(to_float3(posAndNear), rayDirInv, node1.boxMin, node1.boxMax);
-      
-      const bool hitChild0 = (tm0.x <= tm0.y) && (tm0.y >= tNear) && (tm0.x <= tFar);
-      const bool hitChild1 = (tm1.x <= tm1.y) && (tm1.y >= tNear) && (tm1.x <= tFar);
-      const bool leftFirst = (tm0.x <= tm1.x);
+      const BVHNodePairQ& pair = m_allNodesQ[bvhOffset + leftNodeOffset/2];
+      const float3        step = QuantStep(frameMin, frameMax);
+
+      float3 boxMin0, boxMax0, boxMin1, boxMax1;
+      DequantizeBox(frameMin, step, pair.boxMin[0], pair.boxMax[0], &boxMin0, &boxMax0);
+      DequantizeBox(frameMin, step, pair.boxMin[1], pair.boxMax[1], &boxMin1, &boxMax1);
+
+      const float2 tm0 = RayBoxIntersection2(ray_pos, rayDirInv, boxMin0, boxMax0);
+      const float2 tm1 = RayBoxIntersection2(ray_pos, rayDirInv, boxMin1, boxMax1);
+
+      const bool hitChild0 = (tm0.x <= tm0.y) && (tm0.y >= tNear) && (tm0.x <= pHit->t);
+      const bool hitChild1 = (tm1.x <= tm1.y) && (tm1.y >= tNear) && (tm1.x <= pHit->t);
+      const bool first0    = !hitChild1 || (hitChild0 && tm0.x <= tm1.x);
+      needStackPop         = (!hitChild0 && !hitChild1);
 
       // traversal decision
       //
-      leftNodeOffset  = hitChild0 ? node0.leftOffset  : node1.leftOffset;
-      rightNodeOffset = hitChild0 ? node0.escapeIndex : node1.escapeIndex;
-
+      leftNodeOffset = first0 ? pair.leftOffset[0] : pair.leftOffset[1];
+      frameMin       = first0 ? boxMin0 : boxMin1;
+      frameMax       = first0 ? boxMax0 : boxMax1;
       if (hitChild0 && hitChild1)
       {
-        leftNodeOffset  = leftFirst ? node0.leftOffset  : node1.leftOffset;
-        rightNodeOffset = leftFirst ? node0.escapeIndex : node1.escapeIndex;
-        stack[top+2+0]  = leftFirst ? node1.leftOffset  : node0.leftOffset;
-        stack[top+2+1]  = leftFirst ? node1.escapeIndex : node0.escapeIndex;
-        top+=2;
+        stackNode  [top] = first0 ? pair.leftOffset[1] : pair.leftOffset[0];
+        stackBoxMin[top] = first0 ? boxMin1 : boxMin0;
+        stackBoxMax[top] = first0 ? boxMax1 : boxMax0;
+        top++;
         #ifdef ENABLE_METRICS
-        m_stats.SOC++;
-        m_stats.SBL+=sizeof(uint32_t); 
+        stats.SOC++;
+        stats.SBL+=sizeof(uint32_t) + 2*sizeof(float3); 
         #endif
       }
-
-      if (!hitChild0 && !hitChild1) // both miss, stack.pop()
+    }
+    else
+    {
+      if (leftNodeOffset != 0xFFFFFFFF) // leaf node, intersect triangles
       {
-        top-=2;
-        leftNodeOffset  = stack[top+2+0];
-        rightNodeOffset = stack[top+2+1];
+        const uint32_t start = EXTRACT_START(leftNodeOffset);
+        const uint32_t count = EXTRACT_COUNT(leftNodeOffset);
+        IntersectAllPrimitivesInLeaf(ray_pos, ray_dir, tNear, instId, geomId, start, count, pHit);
         #ifdef ENABLE_METRICS
-        m_stats.SOC++;
-        m_stats.SBL+=sizeof(uint32_t); 
+        stats.LC++;
+        stats.LC2++;
+        stats.TC+=count;
+        stats.BLB+=count*TriangleFetchBytes();
         #endif
       }
-    } 
+      needStackPop = true;
+    }
 
-    while((leftNodeOffset & LEAF_BIT) != 0 && leftNodeOffset != 0xFFFFFFFF && top >= 0)
+    // continue BVH traversal
+    //
+    if(needStackPop)
     {
-      out_hits[topRes]= make_BoxHit(EXTRACT_START(leftNodeOffset), 0.0f); 
-      topRes++;
-      
-      top-=2;
-      leftNodeOffset  = stack[top+2+0];
-      rightNodeOffset = stack[top+2+1];
+      top--;
+      leftNodeOffset = stackNode  [std::max(top,0)];
+      frameMin       = stackBoxMin[std::max(top,0)];
+      frameMax       = stackBoxMax[std::max(top,0)];
+      #ifdef ENABLE_METRICS
+      stats.SOC++;
+      stats.SBL+=sizeof(uint32_t) + 2*sizeof(float3); 
+      #endif
     }
+  } // end while (top >= 0)
+}
+
+uint32_t BVH2CommonRT::LBVH2Traverse(float4 posAndNear, float4 dirAndFar, uint32_t stack[STACK_SIZE],
+                                     BoxHit out_hits[LBVH_MAXHITS])
+{
+  #ifdef ENABLE_METRICS
+  ThreadTraverseStats& stats = LocalStats();
+  #endif
+
+  const float3 rayPos    = to_float3(posAndNear);
+  const float3 rayDirInv = SafeInverse(to_float3(dirAndFar));
+  const float  tNear     = posAndNear.w;
+  const float  tFar      = dirAndFar.w;
+
+  // depth first, nearer child first, so instances come out roughly near to far; every box is tested before push,
+  // the root box included (a leaf root is not hit by every ray either)
+  //
+  float stackTEnter[STACK_SIZE];
+  int   top     = 0;
+  uint32_t hitsNum = 0;
+
+  const float2 tmRoot = RayBoxIntersection2(rayPos, rayDirInv, m_nodesTLAS[0].boxMin, m_nodesTLAS[0].boxMax);
+  if (tmRoot.x <= tmRoot.y && tmRoot.y >= tNear && tmRoot.x <= tFar)
+  {
+    stack      [top] = 0;
+    stackTEnter[top] = std::max(tmRoot.x, tNear);
+    top++;
+  }
+
+  while (top > 0)
+  {
+    top--;
+    const uint32_t nodeId = stack[top];
+    const float    tEnter = stackTEnter[top];
+    const BVHNode& node   = m_nodesTLAS[nodeId];
+
+    if ((node.leftOffset & LEAF_BIT) != 0)
+    {
+      if (node.leftOffset == 0xFFFFFFFF)
+        continue;
+      const uint32_t start = EXTRACT_START(node.leftOffset);
+      const uint32_t count = EXTRACT_COUNT(node.leftOffset);
+      for (uint32_t instId = start; instId < start + count; instId++, hitsNum++) // instances over the limit are counted, but not written
+      {
+        if (hitsNum < LBVH_MAXHITS)
+          out_hits[hitsNum] = make_BoxHit(instId, tEnter);
+      }
+      continue;
+    }
+
+    const BVHNode node0 = m_nodesTLAS[node.leftOffset];
+    const BVHNode node1 = m_nodesTLAS[node.escapeIndex];
+
+    #ifdef ENABLE_METRICS
+    stats.NC  += 2;
+    stats.BLB += 2 * sizeof(BVHNode);
+    #endif
+
+    const float2 tm0 = RayBoxIntersection2(rayPos, rayDirInv, node0.boxMin, node0.boxMax);
+    const float2 tm1 = RayBoxIntersection2(rayPos, rayDirInv, node1.boxMin, node1.boxMax);
+
+    const bool hitChild0 = (tm0.x <= tm0.y) && (tm0.y >= tNear) && (tm0.x <= tFar);
+    const bool hitChild1 = (tm1.x <= tm1.y) && (tm1.y >= tNear) && (tm1.x <= tFar);
+    const bool leftFirst = (tm0.x <= tm1.x);
 
-  } // travse TLAS again
+    // the far child is pushed first, so the near one is popped next
+    //
+    if (hitChild0 && hitChild1)
+    {
+      stack      [top] = leftFirst ? node.escapeIndex : node.leftOffset;
+      stackTEnter[top] = std::max(leftFirst ? tm1.x : tm0.x, tNear);
+      top++;
+    }
+    if (hitChild0 || hitChild1)
+    {
+      const bool near0 = hitChild0 && (!hitChild1 || leftFirst);
+      stack      [top] = near0 ? node.leftOffset : node.escapeIndex;
+      stackTEnter[top] = std::max(near0 ? tm0.x : tm1.x, tNear);
+      top++;
+      #ifdef ENABLE_METRICS
+      stats.SOC++;
+      stats.SBL+=sizeof(uint32_t); 
+      #endif
+    }
+  }
   
-  return topRes;
+  return hitsNum;
 } 
 
 CRT_Hit BVH2CommonRT::RayQuery_NearestHit(float4 posAndNear, float4 dirAndFar)
 {
   #ifdef ENABLE_METRICS
-  ResetVarLC();
+  ThreadTraverseStats& stats = LocalStats();
+  stats.ResetVarLC();
   #endif
 
-  BoxHit boxMinHits[LBVH_MAXHITS];
   uint32_t stack[STACK_SIZE];
+  uint32_t stackTLAS[STACK_SIZE];
+  float    stackTEnter[STACK_SIZE];
 
-  // (1) process TLAS
-  //
-  uint32_t boxesNum = LBVH2Traverse(posAndNear, dirAndFar, stack,
-                                    boxMinHits);
-
-  // (2) process all intersected BLAS
-  //
   CRT_Hit hit;
   hit.t      = dirAndFar.w;
   hit.primId = uint32_t(-1);
   hit.instId = uint32_t(-1);
   hit.geomId = uint32_t(-1);
 
-  for (int boxId = int(boxesNum)-1; boxId >= 0; boxId--)
+  const float3 rayPos    = to_float3(posAndNear);
+  const float3 rayDirInv = SafeInverse(to_float3(dirAndFar));
+  const float  tNear     = posAndNear.w;
+
+  // TLAS is traversed near to far and the BLAS of every reached instance is processed at once, so any subtree
+  // (and any instance) entered beyond the closest hit found so far is skipped; there is no limit on instances per ray
+  //
+  int top = 0;
+  const float2 tmRoot = RayBoxIntersection2(rayPos, rayDirInv, m_nodesTLAS[0].boxMin, m_nodesTLAS[0].boxMax);
+  if (tmRoot.x <= tmRoot.y && tmRoot.y >= tNear && tmRoot.x <= hit.t)
+  {
+    stackTLAS  [top] = 0;
+    stackTEnter[top] = tmRoot.x;
+    top++;
+  }
+
+  while (top > 0)
   {
-    if (boxMinHits[boxId].tHit <= hit.t)
+    top--;
+    if (stackTEnter[top] > hit.t) // closer hit was found after this node had been pushed
+      continue;
+
+    const BVHNode& node = m_nodesTLAS[stackTLAS[top]];
+    if ((node.leftOffset & LEAF_BIT) != 0)
     {
-      const uint32_t instId = boxMinHits[boxId].id;
-      const uint32_t geomId = m_geomIdByInstId[instId];
-  
-      // transform ray with matrix to local space
-      //
-      const float3 ray_pos = matmul4x3(m_instMatricesInv[instId], to_float3(posAndNear));
-      const float3 ray_dir = matmul3x3(m_instMatricesInv[instId], to_float3(dirAndFar)); // DON'T NORMALIZE IT !!!! When we transform to local space of node, ray_dir must be unnormalized!!!
-  
-      BVH2TraverseC32(ray_pos, ray_dir, posAndNear.w, instId, geomId, stack, &hit);
+      if (node.leftOffset == 0xFFFFFFFF)
+        continue;
+      const uint32_t start = EXTRACT_START(node.leftOffset);
+      const uint32_t count = EXTRACT_COUNT(node.leftOffset);
+      for (uint32_t instId = start; instId < start + count; instId++)
+      {
+        const uint32_t geomId = m_geomIdByInstId[instId];
+
+        // transform ray with matrix to local space
+        //
+        const float3 ray_pos = matmul4x3(m_instMatricesInv[instId], to_float3(posAndNear));
+        const float3 ray_dir = matmul3x3(m_instMatricesInv[instId], to_float3(dirAndFar)); // DON'T NORMALIZE IT !!!! When we transform to local space of node, ray_dir must be unnormalized!!!
+
+        TraverseBLAS(ray_pos, ray_dir, posAndNear.w, instId, geomId, stack, &hit);
+      }
+      continue;
+    }
+
+    const BVHNode node0 = m_nodesTLAS[node.leftOffset];
+    const BVHNode node1 = m_nodesTLAS[node.escapeIndex];
+
+    #ifdef ENABLE_METRICS
+    stats.NC  += 2;
+    stats.BLB += 2 * sizeof(BVHNode);
+    #endif
+
+    const float2 tm0 = RayBoxIntersection2(rayPos, rayDirInv, node0.boxMin, node0.boxMax);
+    const float2 tm1 = RayBoxIntersection2(rayPos, rayDirInv, node1.boxMin, node1.boxMax);
+
+    const bool hitChild0 = (tm0.x <= tm0.y) && (tm0.y >= tNear) && (tm0.x <= hit.t);
+    const bool hitChild1 = (tm1.x <= tm1.y) && (tm1.y >= tNear) && (tm1.x <= hit.t);
+    const bool leftFirst = (tm0.x <= tm1.x);
+
+    // the far child is pushed first, so the near one is popped next
+    //
+    if (hitChild0 && hitChild1)
+    {
+      stackTLAS  [top] = leftFirst ? node.escapeIndex : node.leftOffset;
+      stackTEnter[top] = leftFirst ? tm1.x : tm0.x;
+      top++;
+    }
+    if (hitChild0 || hitChild1)
+    {
+      const bool near0 = hitChild0 && (!hitChild1 || leftFirst);
+      stackTLAS  [top] = near0 ? node.leftOffset : node.escapeIndex;
+      stackTEnter[top] = near0 ? tm0.x : tm1.x;
+      top++;
+      #ifdef ENABLE_METRICS
+      stats.SOC++;
+      stats.SBL+=sizeof(uint32_t); 
+      #endif
     }
   }
 
-  if (hit.primId != uint32_t(-1))
+  #ifdef ENABLE_METRICS
+  stats.raysNumber++;
+  #endif
+
+  FinalizeNearestHit(&hit);
+  return hit;
+}
+
+void BVH2CommonRT::FinalizeNearestHit(CRT_Hit *pHit)
+{
+  if (pHit->primId != uint32_t(-1))
   {
-    const uint2 a_geomOffsets = m_geomOffsets[hit.geomId];
+    const uint2 a_geomOffsets = m_geomOffsets[pHit->geomId];
+    const uint32_t normalPacked = m_primNormals[a_geomOffsets.x/3 + pHit->primId];
 
-    const uint32_t A = m_indices[a_geomOffsets.x + hit.primId*3 + 0];
-    const uint32_t B = m_indices[a_geomOffsets.x + hit.primId*3 + 1];
-    const uint32_t C = m_indices[a_geomOffsets.x + hit.primId*3 + 2];
+    pHit->coords[2] = *reinterpret_cast<const float*>(&normalPacked);
+  }
 
-    const float3 A_pos = to_float3(m_vertPos[a_geomOffsets.y + A]);
-    const float3 B_pos = to_float3(m_vertPos[a_geomOffsets.y + B]);
-    const float3 C_pos = to_float3(m_vertPos[a_geomOffsets.y + C]);
+  #ifdef REMAP_PRIM_ID
+  if(pHit->geomId < uint32_t(-1)) 
+  {
+    const uint2 geomOffsets = m_geomOffsets[pHit->geomId];
+    pHit->primId = m_primIndices[geomOffsets.x/3 + pHit->primId];
+  }
+  #endif
+}
 
-    const float3 edge1 = B_pos - A_pos;
-    const float3 edge2 = C_pos - A_pos;
+bool BVH2CommonRT::IntersectAnyPrimitiveInLeaf(const float3 ray_pos, const float3 ray_dir,
+                                               float tNear, float tFar, uint32_t geomId,
+                                               uint32_t a_start, uint32_t a_count)
+{
+  const uint2 a_geomOffsets = m_geomOffsets[geomId];
 
-    uint32_t normalPacked = packNormal(LiteMath::cross(edge1, edge2));
+  for (uint32_t triId = a_start; triId < a_start + a_count; triId++)
+  {
+    float3 A_pos, edge1, edge2;
+    FetchTriangle(a_geomOffsets, triId, &A_pos, &edge1, &edge2);
+    const float3 pvec = cross(ray_dir, edge2);
+    const float3 tvec = ray_pos - A_pos;
+    const float3 qvec = cross(tvec, edge1);
 
-    hit.coords[2] = *reinterpret_cast<float*>(&normalPacked);
+    const float invDet = 1.0f / dot(edge1, pvec);
+    const float v = dot(tvec, pvec) * invDet;
+    const float u = dot(qvec, ray_dir) * invDet;
+    const float t = dot(edge2, qvec) * invDet;
+
+    if (v >= -1e-6f && u >= -1e-6f && (u + v <= 1.0f + 1e-6f) && t > tNear && t < tFar)
+      return true;
   }
 
+  return false;
+}
 
+bool BVH2CommonRT::BVH2TraverseAnyC32(const float3 ray_pos, const float3 ray_dir, float tNear, float tFar,
+                                      uint32_t geomId, uint32_t stack[STACK_SIZE])
+{
   #ifdef ENABLE_METRICS
-  m_stats.raysNumber++;
+  ThreadTraverseStats& stats = LocalStats();
   #endif
-  
-  #ifdef REMAP_PRIM_ID
-  if(hit.geomId < uint32_t(-1)) 
+
+  const uint32_t bvhOffset = m_bvhOffsets[geomId];
+
+  int top = 0;
+  uint32_t leftNodeOffset = 0;
+
+  const float3 rayDirInv = SafeInverse(ray_dir);
+
+  while (top >= 0)
   {
-    const uint2 geomOffsets = m_geomOffsets[hit.geomId];
-    hit.primId = m_primIndices[geomOffsets.x/3 + hit.primId];
+    bool needStackPop = false;
+    if ((leftNodeOffset & LEAF_BIT) == 0)
+    {
+      #ifdef ENABLE_METRICS
+      stats.NC  += 2;
+      stats.BLB += 2*sizeof(BVHNode);
+      #endif
+
+      const BVHNode node0 = m_allNodes[bvhOffset + leftNodeOffset + 0];
+      const BVHNode node1 = m_allNodes[bvhOffset + leftNodeOffset + 1];
+
+      const float2 tm0 = RayBoxIntersection2(ray_pos, rayDirInv, node0.boxMin, node0.boxMax);
+      const float2 tm1 = RayBoxIntersection2(ray_pos, rayDirInv, node1.boxMin, node1.boxMax);
+
+      const bool hitChild0 = (tm0.x <= tm0.y) && (tm0.y >= tNear) && (tm0.x <= tFar);
+      const bool hitChild1 = (tm1.x <= tm1.y) && (tm1.y >= tNear) && (tm1.x <= tFar);
+      needStackPop         = (!hitChild0 && !hitChild1);
+
+      // any accepted triangle ends the query, so children are not sorted
+      //
+      leftNodeOffset = hitChild0 ? node0.leftOffset : node1.leftOffset;
+      if (hitChild0 && hitChild1)
+      {
+        stack[top] = node1.leftOffset;
+        top++;
+      }
+    }
+    else
+    {
+      if (leftNodeOffset != 0xFFFFFFFF)
+      {
+        const uint32_t start = EXTRACT_START(leftNodeOffset);
+        const uint32_t count = EXTRACT_COUNT(leftNodeOffset);
+        #ifdef ENABLE_METRICS
+        stats.LC++;
+        stats.TC+=count;
+        stats.BLB+=count*TriangleFetchBytes();
+        #endif
+        if (IntersectAnyPrimitiveInLeaf(ray_pos, ray_dir, tNear, tFar, geomId, start, count))
+          return true;
+      }
+      needStackPop = true;
+    }
+
+    if(needStackPop)
+    {
+      top--;
+      leftNodeOffset = stack[std::max(top,0)];
+    }
   }
+
+  return false;
+}
+
+bool BVH2CommonRT::BVH2TraverseAnyQ8(const float3 ray_pos, const float3 ray_dir, float tNear, float tFar, uint32_t geomId)
+{
+  #ifdef ENABLE_METRICS
+  ThreadTraverseStats& stats = LocalStats();
   #endif
 
-  return hit;
+  const uint32_t bvhOffset = m_bvhOffsets[geomId];
+  const float3   rayDirInv = SafeInverse(ray_dir);
+
+  // same as BVH2TraverseQ8, decoded box of a pushed child is kept on the stack
+  //
+  uint32_t stackNode  [STACK_SIZE];
+  float3   stackBoxMin[STACK_SIZE];
+  float3   stackBoxMax[STACK_SIZE];
+
+  int top = 0;
+  uint32_t leftNodeOffset = 0;
+  float3   frameMin       = to_float3(m_geomBoxes[geomId].boxMin);
+  float3   frameMax       = to_float3(m_geomBoxes[geomId].boxMax);
+
+  while (top >= 0)
+  {
+    bool needStackPop = false;
+    if ((leftNodeOffset & LEAF_BIT) == 0)
+    {
+      #ifdef ENABLE_METRICS
+      stats.NC  += 2;
+      stats.BLB += sizeof(BVHNodePairQ);
+      #endif
+
+      const BVHNodePairQ& pair = m_allNodesQ[bvhOffset + leftNodeOffset/2];
+      const float3        step = QuantStep(frameMin, frameMax);
+
+      float3 boxMin0, boxMax0, boxMin1, boxMax1;
+      DequantizeBox(frameMin, step, pair.boxMin[0], pair.boxMax[0], &boxMin0, &boxMax0);
+      DequantizeBox(frameMin, step, pair.boxMin[1], pair.boxMax[1], &boxMin1, &boxMax1);
+
+      const float2 tm0 = RayBoxIntersection2(ray_pos, rayDirInv, boxMin0, boxMax0);
+      const float2 tm1 = RayBoxIntersection2(ray_pos, rayDirInv, boxMin1, boxMax1);
+
+      const bool hitChild0 = (tm0.x <= tm0.y) && (tm0.y >= tNear) && (tm0.x <= tFar);
+      const bool hitChild1 = (tm1.x <= tm1.y) && (tm1.y >= tNear) && (tm1.x <= tFar);
+      needStackPop         = (!hitChild0 && !hitChild1);
+
+      // any accepted triangle ends the query, so children are not sorted
+      //
+      leftNodeOffset = hitChild0 ? pair.leftOffset[0] : pair.leftOffset[1];
+      frameMin       = hitChild0 ? boxMin0 : boxMin1;
+      frameMax       = hitChild0 ? boxMax0 : boxMax1;
+      if (hitChild0 && hitChild1)
+      {
+        stackNode  [top] = pair.leftOffset[1];
+        stackBoxMin[top] = boxMin1;
+        stackBoxMax[top] = boxMax1;
+        top++;
+      }
+    }
+    else
+    {
+      if (leftNodeOffset != 0xFFFFFFFF)
+      {
+        const uint32_t start = EXTRACT_START(leftNodeOffset);
+        const uint32_t count = EXTRACT_COUNT(leftNodeOffset);
+        #ifdef ENABLE_METRICS
+        stats.LC++;
+        stats.TC+=count;
+        stats.BLB+=count*TriangleFetchBytes();
+        #endif
+        if (IntersectAnyPrimitiveInLeaf(ray_pos, ray_dir, tNear, tFar, geomId, start, count))
+          return true;
+      }
+      needStackPop = true;
+    }
+
+    if(needStackPop)
+    {
+      top--;
+      leftNodeOffset = stackNode  [std::max(top,0)];
+      frameMin       = stackBoxMin[std::max(top,0)];
+      frameMax       = stackBoxMax[std::max(top,0)];
+    }
+  }
+
+  return false;
 }
 
 bool BVH2CommonRT::RayQuery_AnyHit(float4 posAndNear, float4 dirAndFar)
 {
   #ifdef ENABLE_METRICS
-  m_stats.raysNumber++;
+  ThreadTraverseStats& stats = LocalStats();
+  stats.raysNumber++;
   #endif
 
-  // (2) If any hit is found, immediately return true.
-  std::cout << "[BVH2CommonRT::RayQuery_AnyHit]: "
-            << "not implemeted!" << std::endl;
+  uint32_t stack[STACK_SIZE];
+  uint32_t stackTLAS[STACK_SIZE];
+
+  const float3 rayPos    = to_float3(posAndNear);
+  const float3 rayDirInv = SafeInverse(to_float3(dirAndFar));
+  const float  tNear     = posAndNear.w;
+  const float  tFar      = dirAndFar.w;
+
+  // TLAS is walked in any order and the BLAS of each reached instance is processed at once;
+  // the first accepted triangle ends the query
+  //
+  int top = 0;
+  stackTLAS[top++] = 0;
+
+  while (top > 0)
+  {
+    const BVHNode node = m_nodesTLAS[stackTLAS[--top]];
+    const float2  tm   = RayBoxIntersection2(rayPos, rayDirInv, node.boxMin, node.boxMax);
+    if (tm.x > tm.y || tm.y < tNear || tm.x > tFar)
+      continue;
+
+    if ((node.leftOffset & LEAF_BIT) == 0)
+    {
+      stackTLAS[top++] = node.leftOffset;
+      stackTLAS[top++] = node.escapeIndex;
+    }
+    else if (node.leftOffset != 0xFFFFFFFF)
+    {
+      const uint32_t instId = EXTRACT_START(node.leftOffset);
+      const uint32_t geomId = m_geomIdByInstId[instId];
+
+      const float3 ray_pos = matmul4x3(m_instMatricesInv[instId], to_float3(posAndNear));
+      const float3 ray_dir = matmul3x3(m_instMatricesInv[instId], to_float3(dirAndFar)); // DON'T NORMALIZE IT, see RayQuery_NearestHit
+
+      const bool hit = (m_layoutFlags & BVH_LAYOUT_COMPRESSED) ? BVH2TraverseAnyQ8(ray_pos, ray_dir, tNear, tFar, geomId) :
+                                                                 BVH2TraverseAnyC32(ray_pos, ray_dir, tNear, tFar, geomId, stack);
+      if (hit)
+        return true;
+    }
+  }
+
+  return false;
+}
+
+bool BVH2CommonRT::RayQuery_AnyInstanceBox(float4 posAndNear, float4 dirAndFar) const
+{
+  if (m_nodesTLAS.empty())
+    return false;
+
+  uint32_t stackTLAS[STACK_SIZE];
+
+  const float3 rayPos    = to_float3(posAndNear);
+  const float3 rayDirInv = SafeInverse(to_float3(dirAndFar));
+  const float  tNear     = posAndNear.w;
+  const float  tFar      = dirAndFar.w;
+
+  int top = 0;
+  stackTLAS[top++] = 0;
+
+  while (top > 0)
+  {
+    const BVHNode& node = m_nodesTLAS[stackTLAS[--top]];
+    const float2   tm   = RayBoxIntersection2(rayPos, rayDirInv, node.boxMin, node.boxMax);
+    if (tm.x > tm.y || tm.y < tNear || tm.x > tFar)
+      continue;
+
+    if ((node.leftOffset & LEAF_BIT) == 0)
+    {
+      stackTLAS[top++] = node.leftOffset;
+      stackTLAS[top++] = node.escapeIndex;
+    }
+    else if (node.leftOffset != 0xFFFFFFFF)
+      return true;
+  }
 
   return false;
 }
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <vector>
 #include <algorithm>
@@ -23,12 +25,147 @@ using LiteMath::Box4f;
 
 #include "aligned_alloc.h"
 #include "builders/cbvh.h"
+#include "simd_packet.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using cbvh2::BVHNode;
 
+/**
+\brief Optional acceleration structure layouts, built next to the cbvh2 BLAS data. Must be set before AddGeom_Triangles3f.
+*/
+enum BVHLayoutFlags
+{
+  BVH_LAYOUT_WIDE4          = 1, ///< collapse every BLAS into BVH4 with SoA child boxes, used by RayQuery_NearestHit
+  BVH_LAYOUT_LEAF_TRIANGLES = 2, ///< store leaf triangles as vertex + edges in BVH leaf order, no index->vertex gather
+  BVH_LAYOUT_TREELET_REORDER = 4, ///< reorder node pairs of every BLAS into treelets of most probably visited pairs; experimental, off by default, no measured CMC/WSS gain yet
+  BVH_LAYOUT_COMPRESSED     = 8, ///< BLAS as BVHNodePairQ and vertices as packed float3; disables WIDE4, LEAF_TRIANGLES and UpdateGeom_Triangles3f
+};
+
+/**
+\brief Compressed pair of BLAS nodes for BVH_LAYOUT_COMPRESSED, 20 bytes instead of 64. Child boxes are 8-bit coordinates 
+       in the grid of the parent box (see QuantStep), rounded outwards, so the decoded boxes are never smaller than the original ones.
+*/
+struct BVHNodePairQ
+{
+  uint8_t  boxMin[2][3];  ///< rounded down
+  uint8_t  boxMax[2][3];  ///< rounded up
+  uint32_t leftOffset[2]; ///< same as BVHNode::leftOffset, i.e. index of the first node of the children pair or a leaf
+};
+
+/// step of the 8-bit grid inside of the box [a_min, a_max]; 254 steps instead of 255, so that the last grid line is not inside of the box after rounding
+static inline float3 QuantStep(const float3 a_min, const float3 a_max) { return (a_max - a_min) * (1.0f/254.0f); }
+
+/// decode child box of BVHNodePairQ, the same expression is used at build time to check that rounding is conservative
+static inline void DequantizeBox(const float3 a_frameMin, const float3 a_step, const uint8_t a_qMin[3], const uint8_t a_qMax[3],
+                                 float3* a_boxMin, float3* a_boxMax)
+{
+  *a_boxMin = a_frameMin + float3(float(a_qMin[0]), float(a_qMin[1]), float(a_qMin[2])) * a_step;
+  *a_boxMax = a_frameMin + float3(float(a_qMax[0]), float(a_qMax[1]), float(a_qMax[2])) * a_step;
+}
+
+/**
+\brief Precomputed triangle in BVH leaf order; triangles of a leaf are contiguous in BVH2CommonRT::m_leafTris.
+*/
+struct LeafTriangle
+{
+  float4 v0;    ///< first vertex
+  float4 edge1; ///< v1 - v0
+  float4 edge2; ///< v2 - v0
+};
+
+/**
+\brief Collapsed BVH4 node. Children are kept in SoA form to test all of them with one SIMD slab test.
+       child[i] is an index of BVH4Node relative to the BLAS start or a leaf in cbvh2 leftOffset encoding;
+       0xFFFFFFFF marks an empty slot.
+*/
+struct BVH4Node
+{
+  float    boxMinX[4];
+  float    boxMinY[4];
+  float    boxMinZ[4];
+  float    boxMaxX[4];
+  float    boxMaxY[4];
+  float    boxMaxZ[4];
+  uint32_t child[4];
+  uint32_t padding[4]; ///< keep node exactly two cache lines
+};
+
+/**
+\brief Stream of rays in SoA form for batched queries; tNear/tFar play the role of posAndNear.w/dirAndFar.w.
+*/
+struct RayStreamSoA
+{
+  const float* posX;
+  const float* posY;
+  const float* posZ;
+  const float* tNear;
+  const float* dirX;
+  const float* dirY;
+  const float* dirZ;
+  const float* tFar;
+};
+
+/**
+\brief One mesh for BVH2CommonRT::AddGeomBatch_Triangles3f, same meaning as arguments of AddGeom_Triangles3f.
+*/
+struct GeomTriangles3f
+{
+  const float*    vpos3f;
+  size_t          vertNumber;
+  const uint32_t* triIndices;
+  size_t          indNumber;
+  size_t          vByteStride;
+};
+
+/**
+\brief Traversal counters of one thread for ENABLE_METRICS, merged into ISceneObject::m_stats by BVH2CommonRT::MergeThreadStats.
+       Same meaning as the fields of m_stats, but the working set is a bitmap of lines instead of std::set.
+*/
+struct ThreadTraverseStats
+{
+  uint64_t NC  = 0;
+  uint64_t LC  = 0;
+  uint64_t TC  = 0;
+  uint64_t BLB = 0;
+  uint64_t SOC = 0;
+  uint64_t SBL = 0;
+  uint64_t raysNumber = 0;
+  uint64_t LJC[TREELET_ARR_SIZE] = {};
+  uint64_t CMC[TREELET_ARR_SIZE] = {};
+
+  uint32_t              LC2 = 0;                 ///< leaves of the current ray
+  std::vector<uint32_t> LC2PerRay;               ///< leaves of finished rays, replayed through ResetVarLC at merge
+  std::vector<uint64_t> WSS[TREELET_ARR_SIZE];   ///< bit per line of treelet_sizes[i] bytes
+
+  inline void ResetVarLC() { LC2PerRay.push_back(LC2); LC2 = 0; }
+  inline void clear()      
+  { 
+    NC = LC = TC = BLB = SOC = SBL = raysNumber = 0; 
+    LC2 = 0;
+    LC2PerRay.clear();
+    for (int i = 0; i < TREELET_ARR_SIZE; i++)
+    {
+      LJC[i] = CMC[i] = 0;
+      std::fill(WSS[i].begin(), WSS[i].end(), 0);
+    }
+  }
+  inline void MarkLine(int i, uint32_t a_lineId)
+  {
+    if ((a_lineId >> 6) < WSS[i].size())
+      WSS[i][a_lineId >> 6] |= (uint64_t(1) << (a_lineId & 63));
+  }
+};
+
 struct BVH2CommonRT : public ISceneObject
 {
-  BVH2CommonRT(const char* a_builderName = "cbvh_embree2") : m_builderName(a_builderName) {}
+  BVH2CommonRT(const char* a_builderName = "cbvh_embree2", uint32_t a_layoutFlags = 0) : m_builderName(a_builderName), m_layoutFlags(a_layoutFlags) 
+  {
+    if (m_layoutFlags & BVH_LAYOUT_COMPRESSED) // these layouts are built from full precision nodes and vertices
+      m_layoutFlags &= ~uint32_t(BVH_LAYOUT_WIDE4 | BVH_LAYOUT_LEAF_TRIANGLES);
+  }
   ~BVH2CommonRT() override {}
 
   const char* Name() const override { return "BVH2Common"; }
@@ -38,6 +175,12 @@ struct BVH2CommonRT : public ISceneObject
   uint32_t AddGeom_Triangles3f(const float *a_vpos3f, size_t a_vertNumber, const uint32_t *a_triIndices, size_t a_indNumber, BuildQuality a_qualityLevel, size_t vByteStride) override;
   void     UpdateGeom_Triangles3f(uint32_t a_geomId, const float *a_vpos3f, size_t a_vertNumber, const uint32_t *a_triIndices, size_t a_indNumber, BuildQuality a_qualityLevel, size_t vByteStride) override;
 
+  /**
+  \brief Same as calling AddGeom_Triangles3f for every mesh in order, but BVHs of all meshes are built in parallel;
+         returns geom ids, which are consecutive.
+  */
+  std::vector<uint32_t> AddGeomBatch_Triangles3f(const GeomTriangles3f* a_meshes, size_t a_meshNum, BuildQuality a_qualityLevel);
+
   void ClearScene() override;
   void CommitScene(BuildQuality a_qualityLevel) override;
 
@@ -47,11 +190,119 @@ struct BVH2CommonRT : public ISceneObject
   CRT_Hit RayQuery_NearestHit(float4 posAndNear, float4 dirAndFar) override;
   bool    RayQuery_AnyHit(float4 posAndNear, float4 dirAndFar) override;
 
+  /**
+  \brief True if the ray segment overlaps a world space box of some instance; only TLAS nodes are visited.
+         A ray that misses all instance boxes can't hit anything, so it is a cheap conservative visibility test.
+  */
+  bool    RayQuery_AnyInstanceBox(float4 posAndNear, float4 dirAndFar) const;
+
+  /**
+  \brief Nearest hit for a whole ray stream; coherent packets of simd::PACKET_SIZE rays are traversed together,
+         diverging packets fall back to RayQuery_NearestHit.
+  */
+  void    RayQuery_NearestHitBatch(const RayStreamSoA& a_rays, uint32_t a_rayNum, CRT_Hit* a_outHits);
+
+  /**
+  \brief Nearest hit for a tile of rays with the common origin and tNear a_posAndNear, e.g. primary rays of 8x8 pixels.
+         TLAS is culled once for the whole tile with the interval slab test of the tile frustum, and the origin is 
+         transformed to the local space once per surviving instance.
+  */
+  void    RayQuery_NearestHitTile(float4 a_posAndNear, const float4* a_dirAndFar, uint32_t a_rayNum, CRT_Hit* a_outHits);
+
+  /**
+  \brief Key of the cache file for the scene with hash a_sceneHash; includes builder name, layout flags and format version.
+  */
+  uint64_t CacheKey(uint64_t a_sceneHash) const;
+
+  /**
+  \brief Write all built geometry and scene data to a_path; a_userData is an opaque blob stored next to it (may be empty).
+  */
+  bool SaveCache(const char* a_path, uint64_t a_sceneHash, const void* a_userData, size_t a_userDataSize) const;
+
+  /**
+  \brief Replace current geometry and scene with the content of the cache file, the scene is ready to trace after it.
+         Returns false and keeps the current state if the file is missing, corrupted or has another key.
+  */
+  bool LoadCache(const char* a_path, uint64_t a_sceneHash, std::vector<uint8_t>* a_userData);
+
+  /**
+  \brief Add counters of all threads to m_stats and clear them; call it after parallel ray queries are finished and 
+         before the stats are read, N_BVH::GetMetrics does it for every query path with ENABLE_METRICS.
+  */
+  void MergeThreadStats();
+
   uint32_t GetGeomNum() const override { return uint32_t(m_geomBoxes.size()); }
   uint32_t GetInstNum() const override { return uint32_t(m_instBoxes.size()); }
   const LiteMath::float4* GetGeomBoxes() const override { return (const LiteMath::float4*)m_geomBoxes.data(); }
 
 //protected:
+
+  /// vertex A and two edges of triangle triId, read from m_leafTris when it is built or gathered through m_indices otherwise
+  inline void FetchTriangle(const uint2 a_geomOffsets, uint32_t triId, float3* A_pos, float3* edge1, float3* edge2) const
+  {
+    if (m_layoutFlags & BVH_LAYOUT_LEAF_TRIANGLES)
+    {
+      const LeafTriangle& tri = m_leafTris[a_geomOffsets.x/3 + triId];
+      *A_pos = to_float3(tri.v0);
+      *edge1 = to_float3(tri.edge1);
+      *edge2 = to_float3(tri.edge2);
+      return;
+    }
+
+    const uint32_t A = m_indices[a_geomOffsets.x + triId*3 + 0];
+    const uint32_t B = m_indices[a_geomOffsets.x + triId*3 + 1];
+    const uint32_t C = m_indices[a_geomOffsets.x + triId*3 + 2];
+
+    if (m_layoutFlags & BVH_LAYOUT_COMPRESSED)
+    {
+      *A_pos = PackedVertex(a_geomOffsets.y + A);
+      *edge1 = PackedVertex(a_geomOffsets.y + B) - *A_pos;
+      *edge2 = PackedVertex(a_geomOffsets.y + C) - *A_pos;
+      return;
+    }
+
+    *A_pos = to_float3(m_vertPos[a_geomOffsets.y + A]);
+    *edge1 = to_float3(m_vertPos[a_geomOffsets.y + B]) - *A_pos;
+    *edge2 = to_float3(m_vertPos[a_geomOffsets.y + C]) - *A_pos;
+  }
+
+  inline float3 PackedVertex(size_t a_vertId) const { return float3(m_vertPos3f[3*a_vertId + 0], m_vertPos3f[3*a_vertId + 1], m_vertPos3f[3*a_vertId + 2]); }
+
+  /// vertices of all geoms, i.e. the offset of the next one; they are either in m_vertPos or in m_vertPos3f
+  inline size_t VertexNumber() const { return (m_layoutFlags & BVH_LAYOUT_COMPRESSED) ? m_vertPos3f.size()/3 : m_vertPos.size(); }
+
+  /// nearest hit in the BLAS of geomId for the ray in local space of instance instId, with the layout that is built
+  inline void TraverseBLAS(const float3 ray_pos, const float3 ray_dir, float tNear, uint32_t instId, uint32_t geomId, 
+                           uint32_t stack[STACK_SIZE], CRT_Hit* pHit)
+  {
+    if (m_layoutFlags & BVH_LAYOUT_WIDE4)
+      BVH4TraverseC32(ray_pos, ray_dir, tNear, instId, geomId, pHit);
+    else if (m_layoutFlags & BVH_LAYOUT_COMPRESSED)
+      BVH2TraverseQ8(ray_pos, ray_dir, tNear, instId, geomId, pHit);
+    else
+      BVH2TraverseC32(ray_pos, ray_dir, tNear, instId, geomId, stack, pHit);
+  }
+
+  /// counters of the calling thread, every OpenMP thread has its own
+  inline ThreadTraverseStats& LocalStats()
+  {
+    #ifdef _OPENMP
+    const size_t threadId = size_t(omp_get_thread_num());
+    #else
+    const size_t threadId = 0;
+    #endif
+    assert(threadId < m_threadStats.size());
+    return m_threadStats[threadId];
+  }
+
+  /// bytes read per triangle test, for ENABLE_METRICS
+  inline size_t TriangleFetchBytes() const
+  {
+    if (m_layoutFlags & BVH_LAYOUT_COMPRESSED)
+      return 3*sizeof(uint32_t) + 3*3*sizeof(float);
+    return (m_layoutFlags & BVH_LAYOUT_LEAF_TRIANGLES) ? sizeof(LeafTriangle) : 3*sizeof(uint32_t) + 3*sizeof(float4);
+  }
+
   void IntersectAllPrimitivesInLeaf(const float3 ray_pos, const float3 ray_dir,
                                     float tNear, uint32_t instId, uint32_t geomId,
                                     uint32_t a_start, uint32_t a_count,
@@ -61,12 +312,57 @@ struct BVH2CommonRT : public ISceneObject
                        uint32_t instId, uint32_t geomId, uint32_t stack[STACK_SIZE],
                        CRT_Hit *pHit);
 
+  void BVH4TraverseC32(const float3 ray_pos, const float3 ray_dir, float tNear,
+                       uint32_t instId, uint32_t geomId, CRT_Hit *pHit);
+
+  void BVH2TraverseQ8(const float3 ray_pos, const float3 ray_dir, float tNear,
+                      uint32_t instId, uint32_t geomId, CRT_Hit *pHit);
+
+  bool IntersectAnyPrimitiveInLeaf(const float3 ray_pos, const float3 ray_dir,
+                                   float tNear, float tFar, uint32_t geomId,
+                                   uint32_t a_start, uint32_t a_count);
+
+  bool BVH2TraverseAnyC32(const float3 ray_pos, const float3 ray_dir, float tNear, float tFar,
+                          uint32_t geomId, uint32_t stack[STACK_SIZE]);
+
+  bool BVH2TraverseAnyQ8(const float3 ray_pos, const float3 ray_dir, float tNear, float tFar, uint32_t geomId);
+
+  /// instances whose boxes are hit by the ray, with entry distances, roughly near to far; the returned number may be 
+  /// greater than LBVH_MAXHITS, then only first LBVH_MAXHITS are written and the caller must not rely on the list
   uint32_t LBVH2Traverse(float4 posAndNear, float4 dirAndFar, uint32_t stack[STACK_SIZE],
                          BoxHit out_hits[LBVH_MAXHITS]);
 
+  void NearestHitPacket(const RayStreamSoA& a_rays, uint32_t a_first, CRT_Hit* a_outHits);
+
+  void IntersectAllPrimitivesInLeafPacket(const RayPacket& a_packet, uint32_t a_activeMask,
+                                          uint32_t instId, uint32_t geomId,
+                                          uint32_t a_start, uint32_t a_count,
+                                          float* a_tFar, CRT_Hit* a_hits);
+
+  void BVH2TraversePacket(RayPacket& a_packet, uint32_t a_activeMask,
+                          uint32_t instId, uint32_t geomId, CRT_Hit* a_hits);
+
+  void FinalizeNearestHit(CRT_Hit* pHit);
+
   virtual size_t AppendTreeData(const std::vector<BVHNode>& a_nodes, const std::vector<uint32_t>& a_indices, 
                                 const uint32_t *a_triIndices, size_t a_indNumber);
 
+  size_t AppendWideTreeData(const std::vector<BVHNode>& a_nodes);
+  void   AppendVertices(const std::vector<float4>& a_vertPos);
+
+  void ComputePrimNormals(uint2 a_geomOffsets, size_t a_triNumber);
+  void ResetStats();
+  void AccumulateLayoutCost(const float a_cmc[2][TREELET_ARR_SIZE], const float a_wss[2][TREELET_ARR_SIZE]);
+  void PrintLayoutCost() const;
+
+  static constexpr uint32_t TREELET_REORDER_BYTES = 4096; ///< one page; inside a treelet the most probable pairs come first and share cache lines
+  void UpdateLeafTriangles(uint2 a_geomOffsets, size_t a_triNumber);
+
+  Box4f RefitBLASPair(uint32_t a_bvhOffset, uint32_t a_pairOffset, uint2 a_geomOffsets);
+
+  Box4f RefitTLASNode(uint32_t a_nodeId, float* a_areaSum);
+  float RefitTLAS();
+
   std::vector<Box4f> m_geomBoxes;
   std::vector<Box4f> m_instBoxes;
 
@@ -74,15 +370,37 @@ struct BVH2CommonRT : public ISceneObject
   std::vector<float4x4> m_instMatricesFwd; ///< instance matrices
 
   std::vector<float4>   m_vertPos;
+  std::vector<float>    m_vertPos3f; ///< xyz of every vertex instead of m_vertPos, only with BVH_LAYOUT_COMPRESSED
   std::vector<uint32_t> m_indices;
   std::vector<uint32_t> m_primIndices;
 
+  std::vector<LeafTriangle, aligned<LeafTriangle, 64> > m_leafTris; ///< only with BVH_LAYOUT_LEAF_TRIANGLES, indexed as m_primIndices
+  std::vector<uint32_t> m_primNormals; ///< octahedral codes of geometric normals (see packNormal), indexed as m_primIndices
+
   std::vector<BVHNode>                         m_nodesTLAS;
   std::vector<BVHNode, aligned<BVHNode, 64> >  m_allNodes;
-  std::vector<uint32_t>                        m_bvhOffsets;
+  std::vector<uint32_t>                        m_bvhOffsets; ///< node offsets in m_allNodes or pair offsets in m_allNodesQ
+
+  std::vector<BVHNodePairQ, aligned<BVHNodePairQ, 64> > m_allNodesQ; ///< BLAS pairs instead of m_allNodes, only with BVH_LAYOUT_COMPRESSED
+
+  std::vector<BVH4Node, aligned<BVH4Node, 64> > m_allNodes4;  ///< collapsed BLAS, only with BVH_LAYOUT_WIDE4
+  std::vector<uint32_t>                         m_bvh4Offsets;
 
   std::vector<uint2>    m_geomOffsets;
   std::vector<uint32_t> m_geomIdByInstId;
 
+  /// expected cache line misses and working set per ray for every treelet_sizes entry, summed over BLASes; 
+  /// [0] is the builder layout, [1] is the layout after BVH_LAYOUT_TREELET_REORDER 
+  float m_layoutCMC[2][TREELET_ARR_SIZE] = {};
+  float m_layoutWSS[2][TREELET_ARR_SIZE] = {};
+
+  std::vector<ThreadTraverseStats> m_threadStats; ///< indexed by OpenMP thread id, see LocalStats
+  std::vector<uint64_t>            m_wssMerged[TREELET_ARR_SIZE]; ///< lines already inserted into m_stats.WSS
+
+  bool  m_tlasTopologyChanged = true; ///< instances were added or removed since the last TLAS build, refit is not possible
+  float m_tlasBuildCost        = 0.0f; ///< SAH cost of the TLAS right after the last full build
+  float m_tlasRebuildThreshold = 1.5f; ///< rebuild TLAS instead of refit when its SAH cost grows more than this factor
+
   std::string m_builderName;
+  uint32_t    m_layoutFlags = 0; ///< BVHLayoutFlags
 };
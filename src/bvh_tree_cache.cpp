@@ -0,0 +1,269 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bvh_tree.h"
+#include "utils.h"
+
+// Cache file layout: CacheHeader, then sections in CacheSectionId order, every section starts at 64 byte boundary.
+// Sections are raw copies of the vectors of BVH2CommonRT, so a file is only valid for the same build of the program;
+// CACHE_VERSION must be increased with any change of the layout or of the stored structs.
+//
+static constexpr char     CACHE_MAGIC[8]    = {'B','V','H','2','C','R','T','C'};
+static constexpr uint32_t CACHE_VERSION     = 2;
+static constexpr uint64_t CACHE_ALIGNMENT   = 64;
+
+enum CacheSectionId
+{
+  CACHE_ALL_NODES = 0,
+  CACHE_NODES_TLAS,
+  CACHE_ALL_NODES4,
+  CACHE_ALL_NODES_Q,
+  CACHE_BVH_OFFSETS,
+  CACHE_BVH4_OFFSETS,
+  CACHE_GEOM_OFFSETS,
+  CACHE_GEOM_BOXES,
+  CACHE_VERT_POS,
+  CACHE_VERT_POS_3F,
+  CACHE_INDICES,
+  CACHE_PRIM_INDICES,
+  CACHE_LEAF_TRIS,
+  CACHE_PRIM_NORMALS,
+  CACHE_INST_BOXES,
+  CACHE_INST_MATRICES_FWD,
+  CACHE_INST_MATRICES_INV,
+  CACHE_GEOM_ID_BY_INST,
+  CACHE_USER_DATA,
+  CACHE_SECTIONS_NUM
+};
+
+struct CacheSection
+{
+  uint64_t offset; ///< from the beginning of the file
+  uint64_t size;   ///< in bytes
+};
+
+struct CacheHeader
+{
+  char         magic[8];
+  uint32_t     version;
+  uint32_t     layoutFlags;
+  uint64_t     key;
+  float        tlasBuildCost;
+  uint32_t     sectionsNum;
+  CacheSection sections[CACHE_SECTIONS_NUM];
+};
+
+// read-only mapping of the whole file, unmapped in destructor
+//
+struct MappedFile
+{
+  MappedFile(const char* a_path)
+  {
+    const int fd = open(a_path, O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void* ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED)
+      {
+        data = static_cast<const uint8_t*>(ptr);
+        size = size_t(st.st_size);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() { if (data != nullptr) munmap(const_cast<uint8_t*>(data), size); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data = nullptr;
+  size_t         size = 0;
+};
+
+uint64_t BVH2CommonRT::CacheKey(uint64_t a_sceneHash) const
+{
+  uint64_t key = hashFNV1a(&a_sceneHash, sizeof(a_sceneHash));
+  key = hashFNV1a(m_builderName.data(), m_builderName.size(), key);
+  key = hashFNV1a(&m_layoutFlags, sizeof(m_layoutFlags), key);
+  key = hashFNV1a(&CACHE_VERSION, sizeof(CACHE_VERSION), key);
+  return key;
+}
+
+template<typename Vector>
+static void AddSection(CacheHeader& a_header, CacheSectionId a_id, const Vector& a_data, uint64_t* a_fileSize)
+{
+  a_header.sections[a_id].offset = *a_fileSize;
+  a_header.sections[a_id].size   = a_data.size()*sizeof(typename Vector::value_type);
+  (*a_fileSize) += (a_header.sections[a_id].size + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+}
+
+template<typename Vector>
+static bool ReadSection(const MappedFile& a_file, const CacheHeader& a_header, CacheSectionId a_id, Vector* a_out)
+{
+  typedef typename Vector::value_type T;
+  const CacheSection& section = a_header.sections[a_id];
+  if (section.offset > a_file.size || section.size > a_file.size - section.offset || section.size % sizeof(T) != 0)
+    return false;
+
+  const T* begin = reinterpret_cast<const T*>(a_file.data + section.offset);
+  a_out->assign(begin, begin + section.size/sizeof(T));
+  return true;
+}
+
+bool BVH2CommonRT::SaveCache(const char* a_path, uint64_t a_sceneHash, const void* a_userData, size_t a_userDataSize) const
+{
+  const std::vector<uint8_t> userData(static_cast<const uint8_t*>(a_userData), static_cast<const uint8_t*>(a_userData) + a_userDataSize);
+
+  // (1) layout of sections
+  //
+  CacheHeader header = {};
+  std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version       = CACHE_VERSION;
+  header.layoutFlags   = m_layoutFlags;
+  header.key           = CacheKey(a_sceneHash);
+  header.tlasBuildCost = m_tlasBuildCost;
+  header.sectionsNum   = CACHE_SECTIONS_NUM;
+
+  uint64_t fileSize = (sizeof(CacheHeader) + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+  AddSection(header, CACHE_ALL_NODES,         m_allNodes,        &fileSize);
+  AddSection(header, CACHE_NODES_TLAS,        m_nodesTLAS,       &fileSize);
+  AddSection(header, CACHE_ALL_NODES4,        m_allNodes4,       &fileSize);
+  AddSection(header, CACHE_ALL_NODES_Q,       m_allNodesQ,       &fileSize);
+  AddSection(header, CACHE_BVH_OFFSETS,       m_bvhOffsets,      &fileSize);
+  AddSection(header, CACHE_BVH4_OFFSETS,      m_bvh4Offsets,     &fileSize);
+  AddSection(header, CACHE_GEOM_OFFSETS,      m_geomOffsets,     &fileSize);
+  AddSection(header, CACHE_GEOM_BOXES,        m_geomBoxes,       &fileSize);
+  AddSection(header, CACHE_VERT_POS,          m_vertPos,         &fileSize);
+  AddSection(header, CACHE_VERT_POS_3F,       m_vertPos3f,       &fileSize);
+  AddSection(header, CACHE_INDICES,           m_indices,         &fileSize);
+  AddSection(header, CACHE_PRIM_INDICES,      m_primIndices,     &fileSize);
+  AddSection(header, CACHE_LEAF_TRIS,         m_leafTris,        &fileSize);
+  AddSection(header, CACHE_PRIM_NORMALS,      m_primNormals,     &fileSize);
+  AddSection(header, CACHE_INST_BOXES,        m_instBoxes,       &fileSize);
+  AddSection(header, CACHE_INST_MATRICES_FWD, m_instMatricesFwd, &fileSize);
+  AddSection(header, CACHE_INST_MATRICES_INV, m_instMatricesInv, &fileSize);
+  AddSection(header, CACHE_GEOM_ID_BY_INST,   m_geomIdByInstId,  &fileSize);
+  AddSection(header, CACHE_USER_DATA,         userData,          &fileSize);
+
+  // (2) write header and sections with zero padding between them
+  //
+  std::ofstream fout(a_path, std::ios::binary | std::ios::trunc);
+  if (!fout.is_open())
+  {
+    std::cout << "[BVH2CommonRT::SaveCache]: can't open file '" << a_path << "'" << std::endl;
+    return false;
+  }
+
+  const char zeros[CACHE_ALIGNMENT] = {};
+  auto writeAt = [&](uint64_t a_offset, const void* a_data, uint64_t a_size) {
+    fout.write(zeros, std::streamsize(a_offset - uint64_t(fout.tellp())));
+    fout.write(static_cast<const char*>(a_data), std::streamsize(a_size));
+  };
+
+  fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeAt(header.sections[CACHE_ALL_NODES].offset,         m_allNodes.data(),        header.sections[CACHE_ALL_NODES].size);
+  writeAt(header.sections[CACHE_NODES_TLAS].offset,        m_nodesTLAS.data(),       header.sections[CACHE_NODES_TLAS].size);
+  writeAt(header.sections[CACHE_ALL_NODES4].offset,        m_allNodes4.data(),       header.sections[CACHE_ALL_NODES4].size);
+  writeAt(header.sections[CACHE_ALL_NODES_Q].offset,       m_allNodesQ.data(),       header.sections[CACHE_ALL_NODES_Q].size);
+  writeAt(header.sections[CACHE_BVH_OFFSETS].offset,       m_bvhOffsets.data(),      header.sections[CACHE_BVH_OFFSETS].size);
+  writeAt(header.sections[CACHE_BVH4_OFFSETS].offset,      m_bvh4Offsets.data(),     header.sections[CACHE_BVH4_OFFSETS].size);
+  writeAt(header.sections[CACHE_GEOM_OFFSETS].offset,      m_geomOffsets.data(),     header.sections[CACHE_GEOM_OFFSETS].size);
+  writeAt(header.sections[CACHE_GEOM_BOXES].offset,        m_geomBoxes.data(),       header.sections[CACHE_GEOM_BOXES].size);
+  writeAt(header.sections[CACHE_VERT_POS].offset,          m_vertPos.data(),         header.sections[CACHE_VERT_POS].size);
+  writeAt(header.sections[CACHE_VERT_POS_3F].offset,       m_vertPos3f.data(),       header.sections[CACHE_VERT_POS_3F].size);
+  writeAt(header.sections[CACHE_INDICES].offset,           m_indices.data(),         header.sections[CACHE_INDICES].size);
+  writeAt(header.sections[CACHE_PRIM_INDICES].offset,      m_primIndices.data(),     header.sections[CACHE_PRIM_INDICES].size);
+  writeAt(header.sections[CACHE_LEAF_TRIS].offset,         m_leafTris.data(),        header.sections[CACHE_LEAF_TRIS].size);
+  writeAt(header.sections[CACHE_PRIM_NORMALS].offset,      m_primNormals.data(),     header.sections[CACHE_PRIM_NORMALS].size);
+  writeAt(header.sections[CACHE_INST_BOXES].offset,        m_instBoxes.data(),       header.sections[CACHE_INST_BOXES].size);
+  writeAt(header.sections[CACHE_INST_MATRICES_FWD].offset, m_instMatricesFwd.data(), header.sections[CACHE_INST_MATRICES_FWD].size);
+  writeAt(header.sections[CACHE_INST_MATRICES_INV].offset, m_instMatricesInv.data(), header.sections[CACHE_INST_MATRICES_INV].size);
+  writeAt(header.sections[CACHE_GEOM_ID_BY_INST].offset,   m_geomIdByInstId.data(),  header.sections[CACHE_GEOM_ID_BY_INST].size);
+  writeAt(header.sections[CACHE_USER_DATA].offset,         userData.data(),          header.sections[CACHE_USER_DATA].size);
+  writeAt(fileSize, nullptr, 0);
+
+  return fout.good();
+}
+
+bool BVH2CommonRT::LoadCache(const char* a_path, uint64_t a_sceneHash, std::vector<uint8_t>* a_userData)
+{
+  MappedFile file(a_path);
+  if (file.data == nullptr || file.size < sizeof(CacheHeader))
+    return false;
+
+  CacheHeader header;
+  std::memcpy(&header, file.data, sizeof(CacheHeader));
+  if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION ||
+      header.sectionsNum != CACHE_SECTIONS_NUM || header.layoutFlags != m_layoutFlags || header.key != CacheKey(a_sceneHash))
+  {
+    std::cout << "[BVH2CommonRT::LoadCache]: '" << a_path << "' is outdated or belongs to other scene" << std::endl;
+    return false;
+  }
+
+  // sections are copied to temporary copy of the object, so that a broken file does not leave half of the scene loaded
+  //
+  BVH2CommonRT loaded(m_builderName.c_str(), m_layoutFlags);
+  std::vector<uint8_t> userData;
+  const bool ok = ReadSection(file, header, CACHE_ALL_NODES,         &loaded.m_allNodes)        &&
+                  ReadSection(file, header, CACHE_NODES_TLAS,        &loaded.m_nodesTLAS)       &&
+                  ReadSection(file, header, CACHE_ALL_NODES4,        &loaded.m_allNodes4)       &&
+                  ReadSection(file, header, CACHE_ALL_NODES_Q,       &loaded.m_allNodesQ)       &&
+                  ReadSection(file, header, CACHE_BVH_OFFSETS,       &loaded.m_bvhOffsets)      &&
+                  ReadSection(file, header, CACHE_BVH4_OFFSETS,      &loaded.m_bvh4Offsets)     &&
+                  ReadSection(file, header, CACHE_GEOM_OFFSETS,      &loaded.m_geomOffsets)     &&
+                  ReadSection(file, header, CACHE_GEOM_BOXES,        &loaded.m_geomBoxes)       &&
+                  ReadSection(file, header, CACHE_VERT_POS,          &loaded.m_vertPos)         &&
+                  ReadSection(file, header, CACHE_VERT_POS_3F,       &loaded.m_vertPos3f)       &&
+                  ReadSection(file, header, CACHE_INDICES,           &loaded.m_indices)         &&
+                  ReadSection(file, header, CACHE_PRIM_INDICES,      &loaded.m_primIndices)     &&
+                  ReadSection(file, header, CACHE_LEAF_TRIS,         &loaded.m_leafTris)        &&
+                  ReadSection(file, header, CACHE_PRIM_NORMALS,      &loaded.m_primNormals)     &&
+                  ReadSection(file, header, CACHE_INST_BOXES,        &loaded.m_instBoxes)       &&
+                  ReadSection(file, header, CACHE_INST_MATRICES_FWD, &loaded.m_instMatricesFwd) &&
+                  ReadSection(file, header, CACHE_INST_MATRICES_INV, &loaded.m_instMatricesInv) &&
+                  ReadSection(file, header, CACHE_GEOM_ID_BY_INST,   &loaded.m_geomIdByInstId)  &&
+                  ReadSection(file, header, CACHE_USER_DATA,         &userData);
+  if (!ok)
+  {
+    std::cout << "[BVH2CommonRT::LoadCache]: '" << a_path << "' is corrupted" << std::endl;
+    return false;
+  }
+
+  m_allNodes        = std::move(loaded.m_allNodes);
+  m_nodesTLAS       = std::move(loaded.m_nodesTLAS);
+  m_allNodes4       = std::move(loaded.m_allNodes4);
+  m_allNodesQ       = std::move(loaded.m_allNodesQ);
+  m_bvhOffsets      = std::move(loaded.m_bvhOffsets);
+  m_bvh4Offsets     = std::move(loaded.m_bvh4Offsets);
+  m_geomOffsets     = std::move(loaded.m_geomOffsets);
+  m_geomBoxes       = std::move(loaded.m_geomBoxes);
+  m_vertPos         = std::move(loaded.m_vertPos);
+  m_vertPos3f       = std::move(loaded.m_vertPos3f);
+  m_indices         = std::move(loaded.m_indices);
+  m_primIndices     = std::move(loaded.m_primIndices);
+  m_leafTris        = std::move(loaded.m_leafTris);
+  m_primNormals     = std::move(loaded.m_primNormals);
+  m_instBoxes       = std::move(loaded.m_instBoxes);
+  m_instMatricesFwd = std::move(loaded.m_instMatricesFwd);
+  m_instMatricesInv = std::move(loaded.m_instMatricesInv);
+  m_geomIdByInstId  = std::move(loaded.m_geomIdByInstId);
+
+  m_tlasBuildCost       = header.tlasBuildCost;
+  m_tlasTopologyChanged = m_nodesTLAS.empty();
+  ResetStats();
+
+  if (a_userData != nullptr)
+    (*a_userData) = std::move(userData);
+  return true;
+}
@@ -3,8 +3,10 @@
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
+#include <cmath>
 
-#include "BVH2CommonRT.h"
+#include "bvh_tree.h"
+#include "utils.h"
 
 #include "builders/cbvh_core.h"
 #include "aligned_alloc.h"
@@ -24,11 +26,15 @@ void BVH2CommonRT::ClearGeom()
   m_primIndices.reserve(std::max<size_t>(100000, m_primIndices.capacity()));
 
   m_vertPos.resize(0);
+  m_vertPos3f.resize(0);
   m_indices.resize(0);
   m_primIndices.resize(0);
+  m_leafTris.resize(0);
+  m_primNormals.resize(0);
 
   m_allNodes.reserve(std::max<size_t>(100000, m_allNodes.capacity()));
   m_allNodes.resize(0);
+  m_allNodesQ.resize(0);
 
   m_geomOffsets.reserve(std::max(reserveSize, m_geomOffsets.capacity()));
   m_geomOffsets.resize(0);
@@ -39,16 +45,100 @@ void BVH2CommonRT::ClearGeom()
   m_bvhOffsets.reserve(std::max<size_t>(reserveSize, m_bvhOffsets.capacity()));
   m_bvhOffsets.resize(0);
 
+  m_allNodes4.resize(0);
+  m_bvh4Offsets.reserve(std::max<size_t>(reserveSize, m_bvh4Offsets.capacity()));
+  m_bvh4Offsets.resize(0);
+
+  std::fill(&m_layoutCMC[0][0], &m_layoutCMC[0][0] + 2*TREELET_ARR_SIZE, 0.0f);
+  std::fill(&m_layoutWSS[0][0], &m_layoutWSS[0][0] + 2*TREELET_ARR_SIZE, 0.0f);
+
   ClearScene();
 }
 
+// 8-bit box of a_node in the grid of its parent box (the frame), rounded outwards. Decoded coordinates must be strictly 
+// outside of the original box unless they hit the frame border, which keeps the test conservative even if traversal 
+// rounds DequantizeBox differently (e.g. with fused multiply-add).
+//
+static void QuantizeBox(const float3 a_frameMin, const float3 a_step, const BVHNode& a_node, uint8_t a_qMin[3], uint8_t a_qMax[3])
+{
+  const float frameMin[3] = {a_frameMin.x, a_frameMin.y, a_frameMin.z};
+  const float step[3]     = {a_step.x, a_step.y, a_step.z};
+  const float boxMin[3]   = {a_node.boxMin.x, a_node.boxMin.y, a_node.boxMin.z};
+  const float boxMax[3]   = {a_node.boxMax.x, a_node.boxMax.y, a_node.boxMax.z};
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    const float scaledMin = (step[axis] > 0.0f) ? (boxMin[axis] - frameMin[axis]) / step[axis] : 0.0f;
+    const float scaledMax = (step[axis] > 0.0f) ? (boxMax[axis] - frameMin[axis]) / step[axis] : 0.0f;
+    int qMin = int(std::min(std::max(std::floor(scaledMin), 0.0f), 255.0f));
+    int qMax = int(std::min(std::max(std::ceil (scaledMax), 0.0f), 255.0f));
+    while (qMin > 0   && !(frameMin[axis] + float(qMin)*step[axis] < boxMin[axis]))
+      qMin--;
+    while (qMax < 255 && !(frameMin[axis] + float(qMax)*step[axis] > boxMax[axis]))
+      qMax++;
+    a_qMin[axis] = uint8_t(qMin);
+    a_qMax[axis] = uint8_t(qMax);
+  }
+}
+
+// Pairs keep their places (pair i of a_nodes becomes a_out[i]), children of the pair at a_pairOffset are quantized
+// against the decoded box of their parent, exactly as traversal sees it.
+//
+static void QuantizePair(const std::vector<BVHNode>& a_nodes, uint32_t a_pairOffset, const float3 a_frameMin, const float3 a_frameMax, 
+                         std::vector<BVHNodePairQ>& a_out)
+{
+  BVHNodePairQ& pair = a_out[a_pairOffset/2];
+  const float3  step = QuantStep(a_frameMin, a_frameMax);
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    const BVHNode& node = a_nodes[a_pairOffset + i];
+    pair.leftOffset[i]  = node.leftOffset;
+    // empty leaf; the slab test of RayBoxIntersection2 takes min/max of both planes, so the inverted box is hit like 
+    // the whole parent frame, and traversal skips the leaf only by its leftOffset == 0xFFFFFFFF
+    //
+    if (node.leftOffset == 0xFFFFFFFF)
+    {
+      for (int axis = 0; axis < 3; axis++)
+      {
+        pair.boxMin[i][axis] = 255;
+        pair.boxMax[i][axis] = 0;
+      }
+    }
+    else
+      QuantizeBox(a_frameMin, step, node, pair.boxMin[i], pair.boxMax[i]);
+  }
+
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    if ((pair.leftOffset[i] & LEAF_BIT) != 0)
+      continue;
+    float3 childMin, childMax;
+    DequantizeBox(a_frameMin, step, pair.boxMin[i], pair.boxMax[i], &childMin, &childMax);
+    QuantizePair(a_nodes, pair.leftOffset[i], childMin, childMax, a_out);
+  }
+}
+
+static void QuantizeBLAS(const std::vector<BVHNode>& a_nodes, const Box4f& a_geomBox, std::vector<BVHNodePairQ>& a_out)
+{
+  a_out.resize(a_nodes.size()/2);
+  QuantizePair(a_nodes, 0, to_float3(a_geomBox.boxMin), to_float3(a_geomBox.boxMax), a_out);
+}
+
 size_t BVH2CommonRT::AppendTreeData(const std::vector<cbvh::BVHNode>& a_nodes, const std::vector<uint32_t>& a_indices, 
                                     const uint32_t *a_triIndices, size_t a_indNumber)
 {
-  const size_t oldSize = m_allNodes.size();
-  size_t oldIndexSize  = m_indices.size();
+  const bool compressed = (m_layoutFlags & BVH_LAYOUT_COMPRESSED) != 0;
+  const size_t oldSize  = compressed ? m_allNodesQ.size() : m_allNodes.size();
+  size_t oldIndexSize   = m_indices.size();
 
-  m_allNodes.insert(m_allNodes.end(), a_nodes.begin(), a_nodes.end());
+  if (compressed) // the root pair is quantized against the box of the geom, which is the last one added
+  {
+    std::vector<BVHNodePairQ> pairs;
+    QuantizeBLAS(a_nodes, m_geomBoxes.back(), pairs);
+    m_allNodesQ.insert(m_allNodesQ.end(), pairs.begin(), pairs.end());
+  }
+  else
+    m_allNodes.insert(m_allNodes.end(), a_nodes.begin(), a_nodes.end());
   m_primIndices.insert(m_primIndices.end(), a_indices.begin(), a_indices.end());
 
   m_indices.resize(oldIndexSize + a_indices.size()*3);
@@ -60,46 +150,579 @@ size_t BVH2CommonRT::AppendTreeData(const std::vector<cbvh::BVHNode>& a_nodes, c
     m_indices[oldIndexSize + 3*i+2] = a_triIndices[triId*3+2];
   }
 
+  // precomputed triangles follow the same BVH leaf order, so triangles of every leaf are contiguous
+  //
+  if (m_layoutFlags & BVH_LAYOUT_LEAF_TRIANGLES)
+  {
+    m_leafTris.resize(m_leafTris.size() + a_indices.size());
+    UpdateLeafTriangles(m_geomOffsets.back(), a_indices.size());
+  }
+
+  return oldSize;
+}
+
+void BVH2CommonRT::UpdateLeafTriangles(uint2 a_geomOffsets, size_t a_triNumber)
+{
+  const size_t trisOffset = a_geomOffsets.x/3;
+  for(size_t i=0;i<a_triNumber;i++)
+  {
+    const float4 A_pos = m_vertPos[a_geomOffsets.y + m_indices[a_geomOffsets.x + 3*i+0]];
+    const float4 B_pos = m_vertPos[a_geomOffsets.y + m_indices[a_geomOffsets.x + 3*i+1]];
+    const float4 C_pos = m_vertPos[a_geomOffsets.y + m_indices[a_geomOffsets.x + 3*i+2]];
+    m_leafTris[trisOffset + i].v0    = A_pos;
+    m_leafTris[trisOffset + i].edge1 = B_pos - A_pos;
+    m_leafTris[trisOffset + i].edge2 = C_pos - A_pos;
+  }
+}
+
+// Wide node for a parent whose two children are the pair at a_pairOffset. Every inner node of the pair is replaced
+// by its own children, so one BVH4 level covers two cbvh2 levels. The result depends on topology only: refitted
+// trees collapse into the same number of nodes.
+//
+static uint32_t CollapsePairToBVH4(const std::vector<BVHNode>& a_nodes, uint32_t a_pairOffset, std::vector<BVH4Node>& a_out)
+{
+  const uint32_t nodeId = uint32_t(a_out.size());
+  a_out.push_back(BVH4Node{});
+
+  BVHNode  slots[4];
+  uint32_t slotsNum = 0;
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    const BVHNode& node = a_nodes[a_pairOffset + i];
+    if ((node.leftOffset & LEAF_BIT) != 0)
+      slots[slotsNum++] = node;
+    else
+    {
+      slots[slotsNum++] = a_nodes[node.leftOffset + 0];
+      slots[slotsNum++] = a_nodes[node.leftOffset + 1];
+    }
+  }
+
+  uint32_t children[4] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+  for (uint32_t i = 0; i < slotsNum; i++)
+  {
+    if ((slots[i].leftOffset & LEAF_BIT) != 0)
+      children[i] = slots[i].leftOffset;
+    else
+      children[i] = CollapsePairToBVH4(a_nodes, slots[i].leftOffset, a_out);
+  }
+
+  BVH4Node& wide = a_out[nodeId]; // a_out may have been reallocated by recursion
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    const bool valid = (i < slotsNum);
+    wide.boxMinX[i] = valid ? slots[i].boxMin.x : 0.0f;
+    wide.boxMinY[i] = valid ? slots[i].boxMin.y : 0.0f;
+    wide.boxMinZ[i] = valid ? slots[i].boxMin.z : 0.0f;
+    wide.boxMaxX[i] = valid ? slots[i].boxMax.x : 0.0f;
+    wide.boxMaxY[i] = valid ? slots[i].boxMax.y : 0.0f;
+    wide.boxMaxZ[i] = valid ? slots[i].boxMax.z : 0.0f;
+    wide.child[i]   = children[i];
+    wide.padding[i] = 0;
+  }
+
+  return nodeId;
+}
+
+// surface area of BLAS and TLAS node boxes, the SAH probability of a ray to visit them
+//
+static inline float BoxSurfaceArea(const float3 a_boxMin, const float3 a_boxMax)
+{
+  const float sizeX = std::max(a_boxMax.x - a_boxMin.x, 0.0f);
+  const float sizeY = std::max(a_boxMax.y - a_boxMin.y, 0.0f);
+  const float sizeZ = std::max(a_boxMax.z - a_boxMin.z, 0.0f);
+  return 2.0f*(sizeX*sizeY + sizeX*sizeZ + sizeY*sizeZ);
+}
+
+// Analytic version of CMC and WSS from ENABLE_METRICS: a ray visits a node pair with probability proportional 
+// to the surface area of the parent node (root pair is always visited). CMC is the expected number of parent->child 
+// steps that change the line of treelet_sizes[i] bytes, WSS is the sum over lines of their highest visit probability.
+//
+static void LayoutCacheCost(const std::vector<BVHNode>& a_nodes, float a_cmc[TREELET_ARR_SIZE], float a_wss[TREELET_ARR_SIZE])
+{
+  const float rootArea = std::max(std::max(BoxSurfaceArea(a_nodes[0].boxMin, a_nodes[0].boxMax), BoxSurfaceArea(a_nodes[1].boxMin, a_nodes[1].boxMax)), 1e-30f);
+  for (int i = 0; i < TREELET_ARR_SIZE; i++)
+  {
+    std::vector<float> lineProb((a_nodes.size()*sizeof(BVHNode) + treelet_sizes[i] - 1) / treelet_sizes[i] + 1, 0.0f);
+    lineProb[0] = 1.0f;
+    a_cmc[i] = 0.0f;
+    for (size_t nodeId = 0; nodeId < a_nodes.size(); nodeId++)
+    {
+      const BVHNode& node = a_nodes[nodeId];
+      if ((node.leftOffset & LEAF_BIT) != 0)
+        continue;
+      const float    prob       = std::min(BoxSurfaceArea(node.boxMin, node.boxMax) / rootArea, 1.0f);
+      const uint32_t parentLine = uint32_t(nodeId*sizeof(BVHNode)) / uint32_t(treelet_sizes[i]);
+      const uint32_t childLine  = uint32_t(node.leftOffset*sizeof(BVHNode)) / uint32_t(treelet_sizes[i]);
+      if (parentLine != childLine)
+        a_cmc[i] += prob;
+      lineProb[childLine] = std::max(lineProb[childLine], prob);
+    }
+    a_wss[i] = 0.0f;
+    for (float prob : lineProb)
+      a_wss[i] += prob;
+  }
+}
+
+// Greedy treelet clustering: a treelet grows from its root pair by taking the candidate pair with the largest parent
+// area (i.e. the most probably visited one) until it fills a_treeletBytes; pairs left in the candidate list become 
+// roots of next treelets. Treelets are placed one after another, so a ray descending from the root mostly stays 
+// within one page and within a few neighbour cache lines. Child offsets and escape indices are rewritten.
+//
+static void ReorderTreelets(std::vector<BVHNode>& a_nodes, uint32_t a_treeletBytes)
+{
+  const uint32_t pairsNum        = uint32_t(a_nodes.size()/2);
+  const uint32_t pairsPerTreelet = std::max<uint32_t>(a_treeletBytes / uint32_t(2*sizeof(BVHNode)), 1);
+
+  std::vector<uint32_t> newPairId(pairsNum, 0xFFFFFFFF);
+  uint32_t              newPairsNum = 0;
+
+  std::vector<uint32_t> treeletRoots = {0};
+  std::vector<std::pair<float, uint32_t> > candidates;
+  while (!treeletRoots.empty())
+  {
+    candidates.clear();
+    candidates.push_back({FLT_MAX, treeletRoots.back()});
+    treeletRoots.pop_back();
+
+    uint32_t treeletSize = 0;
+    while (!candidates.empty() && treeletSize < pairsPerTreelet)
+    {
+      std::pop_heap(candidates.begin(), candidates.end());
+      const uint32_t pairId = candidates.back().second;
+      candidates.pop_back();
+
+      newPairId[pairId] = newPairsNum++;
+      treeletSize++;
+
+      for (uint32_t i = 0; i < 2; i++)
+      {
+        const BVHNode& node = a_nodes[pairId*2 + i];
+        if ((node.leftOffset & LEAF_BIT) != 0)
+          continue;
+        candidates.push_back({BoxSurfaceArea(node.boxMin, node.boxMax), node.leftOffset/2});
+        std::push_heap(candidates.begin(), candidates.end());
+      }
+    }
+
+    // the most probable of remaining candidates is processed first (it is at the back of the stack)
+    std::sort(candidates.begin(), candidates.end());
+    for (const auto& candidate : candidates)
+      treeletRoots.push_back(candidate.second);
+  }
+
+  for (uint32_t pairId = 0; pairId < pairsNum; pairId++) // unreachable pairs, if any, keep their relative order
+    if (newPairId[pairId] == 0xFFFFFFFF)
+      newPairId[pairId] = newPairsNum++;
+
+  auto remapNode = [&](uint32_t a_nodeId) { return newPairId[a_nodeId/2]*2 + a_nodeId%2; };
+
+  std::vector<BVHNode> reordered(a_nodes.size());
+  for (uint32_t nodeId = 0; nodeId < pairsNum*2; nodeId++)
+  {
+    BVHNode node = a_nodes[nodeId];
+    if ((node.leftOffset & LEAF_BIT) == 0)
+      node.leftOffset = remapNode(node.leftOffset);
+    if (node.escapeIndex < pairsNum*2)
+      node.escapeIndex = remapNode(node.escapeIndex);
+    reordered[remapNode(nodeId)] = node;
+  }
+  a_nodes = std::move(reordered);
+}
+
+size_t BVH2CommonRT::AppendWideTreeData(const std::vector<BVHNode>& a_nodes)
+{
+  const size_t oldSize = m_allNodes4.size();
+
+  std::vector<BVH4Node> wideNodes;
+  wideNodes.reserve(a_nodes.size()/2 + 1);
+  CollapsePairToBVH4(a_nodes, 0, wideNodes);
+
+  m_allNodes4.insert(m_allNodes4.end(), wideNodes.begin(), wideNodes.end());
   return oldSize;
 }
 
+void BVH2CommonRT::AppendVertices(const std::vector<float4>& a_vertPos)
+{
+  if ((m_layoutFlags & BVH_LAYOUT_COMPRESSED) == 0)
+  {
+    m_vertPos.insert(m_vertPos.end(), a_vertPos.begin(), a_vertPos.end());
+    return;
+  }
+
+  const size_t oldSize = m_vertPos3f.size();
+  m_vertPos3f.resize(oldSize + a_vertPos.size()*3);
+  for (size_t i = 0; i < a_vertPos.size(); i++)
+  {
+    m_vertPos3f[oldSize + 3*i + 0] = a_vertPos[i].x;
+    m_vertPos3f[oldSize + 3*i + 1] = a_vertPos[i].y;
+    m_vertPos3f[oldSize + 3*i + 2] = a_vertPos[i].z;
+  }
+}
+
+static Box4f TransformBox(const Box4f& box, const float4x4 &a_matrix)
+{
+  // mult mesh bounding box vertices with matrix to form new bouding box for instance
+  float4 boxVertices[8]{
+      a_matrix * float4{box.boxMin.x, box.boxMin.y, box.boxMin.z, 1.0f},
+
+      a_matrix * float4{box.boxMax.x, box.boxMin.y, box.boxMin.z, 1.0f},
+      a_matrix * float4{box.boxMin.x, box.boxMax.y, box.boxMin.z, 1.0f},
+      a_matrix * float4{box.boxMin.x, box.boxMin.y, box.boxMax.z, 1.0f},
+
+      a_matrix * float4{box.boxMax.x, box.boxMax.y, box.boxMin.z, 1.0f},
+      a_matrix * float4{box.boxMax.x, box.boxMin.y, box.boxMax.z, 1.0f},
+      a_matrix * float4{box.boxMin.x, box.boxMax.y, box.boxMax.z, 1.0f},
+
+      a_matrix * float4{box.boxMax.x, box.boxMax.y, box.boxMax.z, 1.0f},
+  };
+
+  Box4f newBox;
+  for (size_t i = 0; i < 8; i++)
+    newBox.include(boxVertices[i]);
+
+  return newBox;
+}
+
 uint32_t BVH2CommonRT::AddGeom_Triangles3f(const float *a_vpos3f, size_t a_vertNumber, const uint32_t *a_triIndices, size_t a_indNumber, BuildQuality a_qualityLevel, size_t vByteStride)
 {
   const size_t vStride = vByteStride / 4;
   assert(vByteStride % 4 == 0);
 
   const uint32_t currGeomId = uint32_t(m_geomOffsets.size());
-  const size_t oldSizeVert  = m_vertPos.size();
+  const size_t oldSizeVert  = VertexNumber();
   const size_t oldSizeInd   = m_indices.size();
 
   m_geomOffsets.push_back(uint2(oldSizeInd, oldSizeVert));
-  m_vertPos.resize(oldSizeVert + a_vertNumber);
 
+  std::vector<float4> vertPos(a_vertNumber);
   Box4f bbox;
   for (size_t i = 0; i < a_vertNumber; i++)
   {
     const float4 v = float4(a_vpos3f[i * vStride + 0], a_vpos3f[i * vStride + 1], a_vpos3f[i * vStride + 2], 1.0f);
-    m_vertPos[oldSizeVert + i] = v;
+    vertPos[i] = v;
     bbox.include(v);
   }
 
+  AppendVertices(vertPos);
   m_geomBoxes.push_back(bbox);
 
   // Build BVH for each geom and append it to big buffer
   //
   auto presets = cbvh2::BuilderPresetsFromString(m_builderName.c_str());
   //cbvh2::BuilderPresets presets = {cbvh2::BVH2_LEFT_OFFSET, cbvh2::BVH_CONSTRUCT_FAST, 1};
-  auto bvhData = cbvh2::BuildBVH((const float*)(m_vertPos.data() + oldSizeVert), a_vertNumber, 16, a_triIndices, a_indNumber, presets);
+  auto bvhData = cbvh2::BuildBVH((const float*)vertPos.data(), a_vertNumber, 16, a_triIndices, a_indNumber, presets);
+
+  if (m_layoutFlags & BVH_LAYOUT_TREELET_REORDER)
+  {
+    float cmc[2][TREELET_ARR_SIZE], wss[2][TREELET_ARR_SIZE];
+    LayoutCacheCost(bvhData.nodes, cmc[0], wss[0]);
+    ReorderTreelets(bvhData.nodes, TREELET_REORDER_BYTES);
+    LayoutCacheCost(bvhData.nodes, cmc[1], wss[1]);
+    AccumulateLayoutCost(cmc, wss);
+  }
 
   const size_t oldBvhSize = AppendTreeData(bvhData.nodes, bvhData.indices, a_triIndices, a_indNumber);
   m_bvhOffsets.push_back(uint32_t(oldBvhSize));
 
+  m_primNormals.resize(m_primIndices.size());
+  ComputePrimNormals(m_geomOffsets.back(), bvhData.indices.size()); // BVH leaves may reference a triangle more than once
+
+  if (m_layoutFlags & BVH_LAYOUT_WIDE4)
+    m_bvh4Offsets.push_back(uint32_t(AppendWideTreeData(bvhData.nodes)));
+  else
+    m_bvh4Offsets.push_back(uint32_t(m_allNodes4.size()));
+
   return currGeomId;
 }
 
+// mesh data and its BVH, built independently of the shared buffers
+//
+struct PreparedGeom
+{
+  std::vector<float4>   vertPos;
+  Box4f                 box;
+  std::vector<BVHNode>  nodes;       ///< empty with BVH_LAYOUT_COMPRESSED
+  std::vector<BVHNodePairQ> nodesQ;  ///< only with BVH_LAYOUT_COMPRESSED
+  std::vector<uint32_t> primIndices;
+  std::vector<BVH4Node> wideNodes;
+  float                 layoutCMC[2][TREELET_ARR_SIZE];
+  float                 layoutWSS[2][TREELET_ARR_SIZE];
+};
+
+static void PrepareGeom(const GeomTriangles3f& a_mesh, cbvh2::BuilderPresets a_presets, uint32_t a_layoutFlags, PreparedGeom* a_out)
+{
+  const size_t vStride = a_mesh.vByteStride / 4;
+  assert(a_mesh.vByteStride % 4 == 0);
+
+  a_out->vertPos.resize(a_mesh.vertNumber);
+  for (size_t i = 0; i < a_mesh.vertNumber; i++)
+  {
+    const float4 v = float4(a_mesh.vpos3f[i * vStride + 0], a_mesh.vpos3f[i * vStride + 1], a_mesh.vpos3f[i * vStride + 2], 1.0f);
+    a_out->vertPos[i] = v;
+    a_out->box.include(v);
+  }
+
+  auto bvhData = cbvh2::BuildBVH((const float*)a_out->vertPos.data(), a_mesh.vertNumber, 16, a_mesh.triIndices, a_mesh.indNumber, a_presets);
+  a_out->nodes       = std::move(bvhData.nodes);
+  a_out->primIndices = std::move(bvhData.indices);
+
+  if (a_layoutFlags & BVH_LAYOUT_TREELET_REORDER)
+  {
+    LayoutCacheCost(a_out->nodes, a_out->layoutCMC[0], a_out->layoutWSS[0]);
+    ReorderTreelets(a_out->nodes, BVH2CommonRT::TREELET_REORDER_BYTES);
+    LayoutCacheCost(a_out->nodes, a_out->layoutCMC[1], a_out->layoutWSS[1]);
+  }
+
+  if (a_layoutFlags & BVH_LAYOUT_WIDE4)
+  {
+    a_out->wideNodes.reserve(a_out->nodes.size()/2 + 1);
+    CollapsePairToBVH4(a_out->nodes, 0, a_out->wideNodes);
+  }
+
+  if (a_layoutFlags & BVH_LAYOUT_COMPRESSED)
+  {
+    QuantizeBLAS(a_out->nodes, a_out->box, a_out->nodesQ);
+    a_out->nodes = std::vector<BVHNode>();
+  }
+}
+
+std::vector<uint32_t> BVH2CommonRT::AddGeomBatch_Triangles3f(const GeomTriangles3f* a_meshes, size_t a_meshNum, BuildQuality a_qualityLevel)
+{
+  const auto presets = cbvh2::BuilderPresetsFromString(m_builderName.c_str());
+
+  // (1) build BVH of every mesh into its private buffers
+  //
+  std::vector<PreparedGeom> prepared(a_meshNum);
+  #pragma omp parallel for schedule(dynamic)
+  for (int meshId = 0; meshId < int(a_meshNum); meshId++)
+    PrepareGeom(a_meshes[meshId], presets, m_layoutFlags, &prepared[meshId]);
+
+  // (2) offsets of every mesh in the shared buffers, same as serial AddGeom_Triangles3f would give
+  //
+  const bool     compressed  = (m_layoutFlags & BVH_LAYOUT_COMPRESSED) != 0;
+  const uint32_t firstGeomId = uint32_t(m_geomOffsets.size());
+  std::vector<uint32_t> geomIds(a_meshNum);
+  for (size_t meshId = 0; meshId < a_meshNum; meshId++)
+  {
+    geomIds[meshId] = firstGeomId + uint32_t(meshId);
+    m_geomOffsets.push_back(uint2(uint32_t(m_indices.size()), uint32_t(VertexNumber())));
+    m_bvhOffsets.push_back(uint32_t(compressed ? m_allNodesQ.size() : m_allNodes.size()));
+    m_bvh4Offsets.push_back(uint32_t(m_allNodes4.size()));
+    m_geomBoxes.push_back(prepared[meshId].box);
+    if (m_layoutFlags & BVH_LAYOUT_TREELET_REORDER)
+      AccumulateLayoutCost(prepared[meshId].layoutCMC, prepared[meshId].layoutWSS);
+
+    if (compressed)
+      m_vertPos3f.resize(m_vertPos3f.size() + prepared[meshId].vertPos.size()*3);
+    else
+      m_vertPos.resize  (m_vertPos.size()     + prepared[meshId].vertPos.size());
+    m_indices.resize    (m_indices.size()     + prepared[meshId].primIndices.size()*3);
+    m_primIndices.resize(m_primIndices.size() + prepared[meshId].primIndices.size());
+    m_allNodes.resize   (m_allNodes.size()    + prepared[meshId].nodes.size());
+    m_allNodesQ.resize  (m_allNodesQ.size()   + prepared[meshId].nodesQ.size());
+    m_allNodes4.resize  (m_allNodes4.size()   + prepared[meshId].wideNodes.size());
+  }
+  m_primNormals.resize(m_primIndices.size());
+  if (m_layoutFlags & BVH_LAYOUT_LEAF_TRIANGLES)
+    m_leafTris.resize(m_primIndices.size());
+
+  // (3) copy meshes to their slices; slices do not overlap, so meshes are stitched in parallel too
+  //
+  #pragma omp parallel for schedule(dynamic)
+  for (int meshId = 0; meshId < int(a_meshNum); meshId++)
+  {
+    const PreparedGeom&    geom        = prepared[meshId];
+    const GeomTriangles3f& mesh        = a_meshes[meshId];
+    const uint32_t         geomId      = firstGeomId + uint32_t(meshId);
+    const uint2            geomOffsets = m_geomOffsets[geomId];
+
+    if (compressed)
+    {
+      for (size_t i = 0; i < geom.vertPos.size(); i++)
+      {
+        m_vertPos3f[3*(geomOffsets.y + i) + 0] = geom.vertPos[i].x;
+        m_vertPos3f[3*(geomOffsets.y + i) + 1] = geom.vertPos[i].y;
+        m_vertPos3f[3*(geomOffsets.y + i) + 2] = geom.vertPos[i].z;
+      }
+      std::copy(geom.nodesQ.begin(), geom.nodesQ.end(), m_allNodesQ.begin() + m_bvhOffsets[geomId]);
+    }
+    else
+    {
+      std::copy(geom.vertPos.begin(), geom.vertPos.end(), m_vertPos.begin()  + geomOffsets.y);
+      std::copy(geom.nodes.begin(),   geom.nodes.end(),   m_allNodes.begin() + m_bvhOffsets[geomId]);
+    }
+    std::copy(geom.wideNodes.begin(),   geom.wideNodes.end(),   m_allNodes4.begin()   + m_bvh4Offsets[geomId]);
+    std::copy(geom.primIndices.begin(), geom.primIndices.end(), m_primIndices.begin() + geomOffsets.x/3);
+
+    for(size_t i=0;i<geom.primIndices.size();i++)
+    {
+      const uint32_t triId = geom.primIndices[i];
+      m_indices[geomOffsets.x + 3*i+0] = mesh.triIndices[triId*3+0];
+      m_indices[geomOffsets.x + 3*i+1] = mesh.triIndices[triId*3+1];
+      m_indices[geomOffsets.x + 3*i+2] = mesh.triIndices[triId*3+2];
+    }
+
+    if (m_layoutFlags & BVH_LAYOUT_LEAF_TRIANGLES)
+      UpdateLeafTriangles(geomOffsets, geom.primIndices.size());
+
+    ComputePrimNormals(geomOffsets, geom.primIndices.size());
+  }
+
+  return geomIds;
+}
+
+void BVH2CommonRT::AccumulateLayoutCost(const float a_cmc[2][TREELET_ARR_SIZE], const float a_wss[2][TREELET_ARR_SIZE])
+{
+  for (int layout = 0; layout < 2; layout++)
+  {
+    for (int i = 0; i < TREELET_ARR_SIZE; i++)
+    {
+      m_layoutCMC[layout][i] += a_cmc[layout][i];
+      m_layoutWSS[layout][i] += a_wss[layout][i];
+    }
+  }
+}
+
+void BVH2CommonRT::PrintLayoutCost() const
+{
+  for (int i = 0; i < TREELET_ARR_SIZE; i++)
+  {
+    std::cout << "[BVH2CommonRT]: treelet reorder, line " << treelet_sizes[i] << " B: CMC " << m_layoutCMC[0][i] << " -> " << m_layoutCMC[1][i]
+              << ", WSS " << m_layoutWSS[0][i] << " -> " << m_layoutWSS[1][i] << std::endl;
+  }
+}
+
+void BVH2CommonRT::ComputePrimNormals(uint2 a_geomOffsets, size_t a_triNumber)
+{
+  constexpr size_t CHUNK_SIZE = 256;
+  float normX[CHUNK_SIZE], normY[CHUNK_SIZE], normZ[CHUNK_SIZE];
+
+  for (size_t chunkStart = 0; chunkStart < a_triNumber; chunkStart += CHUNK_SIZE)
+  {
+    const size_t chunkSize = std::min(CHUNK_SIZE, a_triNumber - chunkStart);
+    for (size_t i = 0; i < chunkSize; i++)
+    {
+      float3 A_pos, edge1, edge2;
+      FetchTriangle(a_geomOffsets, uint32_t(chunkStart + i), &A_pos, &edge1, &edge2);
+      const float3 normal = LiteMath::cross(edge1, edge2);
+      normX[i] = normal.x;
+      normY[i] = normal.y;
+      normZ[i] = normal.z;
+    }
+    packNormals(normX, normY, normZ, chunkSize, m_primNormals.data() + a_geomOffsets.x/3 + chunkStart);
+  }
+}
+
+// refit boxes of the pair at a_pairOffset and its subtree from current triangles; returns union of the pair boxes
+//
+Box4f BVH2CommonRT::RefitBLASPair(uint32_t a_bvhOffset, uint32_t a_pairOffset, uint2 a_geomOffsets)
+{
+  Box4f pairBox;
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    BVHNode& node = m_allNodes[a_bvhOffset + a_pairOffset + i];
+
+    Box4f box;
+    if ((node.leftOffset & LEAF_BIT) == 0)
+      box = RefitBLASPair(a_bvhOffset, node.leftOffset, a_geomOffsets);
+    else if (node.leftOffset != 0xFFFFFFFF)
+    {
+      const uint32_t start = EXTRACT_START(node.leftOffset);
+      const uint32_t count = EXTRACT_COUNT(node.leftOffset);
+      for (uint32_t triId = start; triId < start + count; triId++)
+      {
+        float3 A_pos, edge1, edge2;
+        FetchTriangle(a_geomOffsets, triId, &A_pos, &edge1, &edge2);
+        box.include(to_float4(A_pos,         1.0f));
+        box.include(to_float4(A_pos + edge1, 1.0f));
+        box.include(to_float4(A_pos + edge2, 1.0f));
+      }
+    }
+    else 
+      continue; // empty leaf keeps its (degenerate) box
+
+    node.boxMin = to_float3(box.boxMin);
+    node.boxMax = to_float3(box.boxMax);
+    pairBox.include(box);
+  }
+  return pairBox;
+}
+
 void BVH2CommonRT::UpdateGeom_Triangles3f(uint32_t a_geomId, const float *a_vpos3f, size_t a_vertNumber, const uint32_t *a_triIndices, size_t a_indNumber, BuildQuality a_qualityLevel, size_t vByteStride)
 {
-  std::cout << "[BVH2CommonRT::UpdateGeom_Triangles3f]: " << "not implemeted!" << std::endl;
+  const size_t vStride = vByteStride / 4;
+  assert(vByteStride % 4 == 0);
+
+  if (a_geomId >= m_geomOffsets.size())
+  {
+    std::cout << "[BVH2CommonRT::UpdateGeom_Triangles3f]: " << "bad geom id " << a_geomId << std::endl;
+    return;
+  }
+
+  if (m_layoutFlags & BVH_LAYOUT_COMPRESSED)
+  {
+    std::cout << "[BVH2CommonRT::UpdateGeom_Triangles3f]: " << "refit of compressed BLAS is not supported, geom " << a_geomId << " is not updated" << std::endl;
+    return;
+  }
+
+  // (1) only vertex positions may change, the topology (and thus the BVH topology) is kept from AddGeom_Triangles3f
+  //
+  const bool     lastGeom      = (a_geomId + 1 == m_geomOffsets.size());
+  const uint2    geomOffsets   = m_geomOffsets[a_geomId];
+  const size_t   oldVertNumber = (lastGeom ? m_vertPos.size()  : m_geomOffsets[a_geomId + 1].y) - geomOffsets.y;
+  const size_t   oldIndNumber  = (lastGeom ? m_indices.size()  : m_geomOffsets[a_geomId + 1].x) - geomOffsets.x;
+  const uint32_t bvhOffset     = m_bvhOffsets[a_geomId];
+  const size_t   nodesNumber   = (lastGeom ? m_allNodes.size() : m_bvhOffsets[a_geomId + 1]) - bvhOffset;
+
+  if (a_vertNumber != oldVertNumber || a_indNumber != oldIndNumber)
+  {
+    std::cout << "[BVH2CommonRT::UpdateGeom_Triangles3f]: " << "topology change is not supported, geom " << a_geomId << " is not updated" << std::endl;
+    return;
+  }
+
+  // (2) overwrite vertices and everything derived from them in place
+  //
+  Box4f bbox;
+  for (size_t i = 0; i < a_vertNumber; i++)
+  {
+    const float4 v = float4(a_vpos3f[i * vStride + 0], a_vpos3f[i * vStride + 1], a_vpos3f[i * vStride + 2], 1.0f);
+    m_vertPos[geomOffsets.y + i] = v;
+    bbox.include(v);
+  }
+  m_geomBoxes[a_geomId] = bbox;
+
+  // primitives are stored in BVH leaf order, one per 3 indices, as in AppendTreeData
+  //
+  const size_t primNumber = oldIndNumber/3;
+  if (m_layoutFlags & BVH_LAYOUT_LEAF_TRIANGLES)
+    UpdateLeafTriangles(geomOffsets, primNumber);
+
+  ComputePrimNormals(geomOffsets, primNumber);
+
+  // (3) refit BLAS; wide nodes depend on topology only, so collapsing the refitted tree overwrites the same range
+  //
+  RefitBLASPair(bvhOffset, 0, geomOffsets);
+
+  if (m_layoutFlags & BVH_LAYOUT_WIDE4)
+  {
+    const std::vector<BVHNode> nodes(m_allNodes.begin() + bvhOffset, m_allNodes.begin() + bvhOffset + nodesNumber);
+    std::vector<BVH4Node> wideNodes;
+    wideNodes.reserve(nodes.size()/2 + 1);
+    CollapsePairToBVH4(nodes, 0, wideNodes);
+    std::copy(wideNodes.begin(), wideNodes.end(), m_allNodes4.begin() + m_bvh4Offsets[a_geomId]);
+  }
+
+  // (4) refit boxes of instances of this geom and the TLAS over them
+  //
+  for (size_t instId = 0; instId < m_instBoxes.size(); instId++)
+  {
+    if (m_geomIdByInstId[instId] == a_geomId)
+      m_instBoxes[instId] = TransformBox(bbox, m_instMatricesFwd[instId]);
+  }
+
+  if (!m_tlasTopologyChanged && !m_nodesTLAS.empty())
+    RefitTLAS();
 }
 
 void BVH2CommonRT::ClearScene()
@@ -113,43 +736,148 @@ void BVH2CommonRT::ClearScene()
   m_instMatricesInv.resize(0);
   m_instMatricesFwd.resize(0);
   m_geomIdByInstId.resize(0);
+
+  m_tlasTopologyChanged = true;
 }
 
-void BVH2CommonRT::CommitScene(BuildQuality a_qualityLevel)
+// recompute boxes of the TLAS subtree from m_instBoxes, accumulate surface areas of all nodes for the SAH cost
+//
+Box4f BVH2CommonRT::RefitTLASNode(uint32_t a_nodeId, float* a_areaSum)
 {
-  //cbvh2::BuilderPresets presets = {cbvh2::BVH2_LEFT_RIGHT, cbvh2::BVH_CONSTRUCT_FAST, 1};
-  cbvh2::BuilderPresets presets = {cbvh2::BVH2_LEFT_RIGHT, cbvh2::BVH_CONSTRUCT_MEDIUM, 1};
-  m_nodesTLAS = cbvh2::BuildBVH((const cbvh::BVHNode*)m_instBoxes.data(), m_instBoxes.size(), presets);
+  BVHNode& node = m_nodesTLAS[a_nodeId];
 
-  // reset stats
-  //  
-  m_stats.clear();
-  m_stats.bvhTotalSize  = m_allNodes.size()*sizeof(BVHNode) + m_nodesTLAS.size()*sizeof(BVHNode);
-  m_stats.geomTotalSize = m_vertPos.size()*sizeof(float4)   + m_indices.size()*sizeof(uint32_t);
+  Box4f box;
+  if ((node.leftOffset & LEAF_BIT) == 0)
+  {
+    box.include(RefitTLASNode(node.leftOffset,  a_areaSum));
+    box.include(RefitTLASNode(node.escapeIndex, a_areaSum));
+  }
+  else if (node.leftOffset != 0xFFFFFFFF)
+  {
+    const uint32_t start = EXTRACT_START(node.leftOffset);
+    const uint32_t count = EXTRACT_COUNT(node.leftOffset);
+    for (uint32_t instId = start; instId < start + count; instId++)
+      box.include(m_instBoxes[instId]);
+  }
+
+  node.boxMin = to_float3(box.boxMin);
+  node.boxMax = to_float3(box.boxMax);
+  (*a_areaSum) += BoxSurfaceArea(node.boxMin, node.boxMax);
+  return box;
 }
 
-uint32_t BVH2CommonRT::AddInstance(uint32_t a_geomId, const float4x4 &a_matrix)
+// bottom-up refit of the whole TLAS, returns its SAH cost (sum of node areas relative to the root)
+//
+float BVH2CommonRT::RefitTLAS()
 {
-  const auto &box = m_geomBoxes[a_geomId];
+  float areaSum = 0.0f;
+  const Box4f rootBox  = RefitTLASNode(0, &areaSum);
+  const float rootArea = BoxSurfaceArea(to_float3(rootBox.boxMin), to_float3(rootBox.boxMax));
+  return (rootArea > 0.0f) ? areaSum / rootArea : 0.0f;
+}
 
-  // (1) mult mesh bounding box vertices with matrix to form new bouding box for instance
-  float4 boxVertices[8]{
-      a_matrix * float4{box.boxMin.x, box.boxMin.y, box.boxMin.z, 1.0f},
+void BVH2CommonRT::CommitScene(BuildQuality a_qualityLevel)
+{
+  // (1) if only instance transforms have changed, refit the existing TLAS; 
+  //     rebuild it when the refitted tree became too much worse than the built one
+  //
+  bool needRebuild = m_tlasTopologyChanged || m_nodesTLAS.empty();
+  if (!needRebuild)
+  {
+    const float refitCost = RefitTLAS();
+    needRebuild = (refitCost > m_tlasBuildCost * m_tlasRebuildThreshold);
+  }
 
-      a_matrix * float4{box.boxMax.x, box.boxMin.y, box.boxMin.z, 1.0f},
-      a_matrix * float4{box.boxMin.x, box.boxMax.y, box.boxMin.z, 1.0f},
-      a_matrix * float4{box.boxMin.x, box.boxMin.y, box.boxMax.z, 1.0f},
+  // (2) full build
+  //
+  if (needRebuild)
+  {
+    //cbvh2::BuilderPresets presets = {cbvh2::BVH2_LEFT_RIGHT, cbvh2::BVH_CONSTRUCT_FAST, 1};
+    cbvh2::BuilderPresets presets = {cbvh2::BVH2_LEFT_RIGHT, cbvh2::BVH_CONSTRUCT_MEDIUM, 1};
+    m_nodesTLAS = cbvh2::BuildBVH((const cbvh::BVHNode*)m_instBoxes.data(), m_instBoxes.size(), presets);
+    m_tlasBuildCost = m_nodesTLAS.empty() ? 0.0f : RefitTLAS();
+    m_tlasTopologyChanged = false;
+
+    if (m_layoutFlags & BVH_LAYOUT_TREELET_REORDER)
+      PrintLayoutCost();
+  }
 
-      a_matrix * float4{box.boxMax.x, box.boxMax.y, box.boxMin.z, 1.0f},
-      a_matrix * float4{box.boxMax.x, box.boxMin.y, box.boxMax.z, 1.0f},
-      a_matrix * float4{box.boxMin.x, box.boxMax.y, box.boxMax.z, 1.0f},
+  ResetStats();
+}
 
-      a_matrix * float4{box.boxMax.x, box.boxMax.y, box.boxMax.z, 1.0f},
-  };
+void BVH2CommonRT::ResetStats()
+{
+  m_stats.clear();
+  const size_t blasBytes = m_allNodes.size()*sizeof(BVHNode) + m_allNodesQ.size()*sizeof(BVHNodePairQ);
+  m_stats.bvhTotalSize  = blasBytes + m_nodesTLAS.size()*sizeof(BVHNode) + m_allNodes4.size()*sizeof(BVH4Node);
+  m_stats.geomTotalSize = m_vertPos.size()*sizeof(float4) + m_vertPos3f.size()*sizeof(float) + m_indices.size()*sizeof(uint32_t) + 
+                          m_leafTris.size()*sizeof(LeafTriangle) + m_primNormals.size()*sizeof(uint32_t);
 
-  Box4f newBox;
-  for (size_t i = 0; i < 8; i++)
-    newBox.include(boxVertices[i]);
+  // line ids are offsets inside of a single BLAS, so the biggest possible id is bounded by all nodes together
+  //
+  #ifdef _OPENMP
+  const size_t threadsNum = size_t(std::max(omp_get_max_threads(), omp_get_num_procs()));
+  #else
+  const size_t threadsNum = 1;
+  #endif
+  m_threadStats.assign(threadsNum, ThreadTraverseStats());
+  #ifdef ENABLE_METRICS
+  for (int i = 0; i < TREELET_ARR_SIZE; i++)
+  {
+    const size_t linesNum = blasBytes / treelet_sizes[i] + 1;
+    m_wssMerged[i].assign((linesNum + 63) / 64, 0);
+    for (auto& stats : m_threadStats)
+      stats.WSS[i].assign((linesNum + 63) / 64, 0);
+  }
+  #endif
+}
+
+void BVH2CommonRT::MergeThreadStats()
+{
+  for (auto& stats : m_threadStats)
+  {
+    m_stats.NC  += stats.NC;
+    m_stats.LC  += stats.LC;
+    m_stats.TC  += stats.TC;
+    m_stats.BLB += stats.BLB;
+    m_stats.SOC += stats.SOC;
+    m_stats.SBL += stats.SBL;
+    m_stats.raysNumber += stats.raysNumber;
+
+    // leaf count variance is gathered per ray by ResetVarLC, so replay it for every finished ray of the thread
+    //
+    for (uint32_t rayLC : stats.LC2PerRay)
+    {
+      m_stats.LC2 = rayLC;
+      ResetVarLC();
+    }
+    m_stats.LC2 += stats.LC2;
+
+    for (int i = 0; i < TREELET_ARR_SIZE; i++)
+    {
+      m_stats.LJC[i] += stats.LJC[i];
+      m_stats.CMC[i] += stats.CMC[i];
+
+      // only lines not seen before go to the std::set, so its cost is bounded by the working set itself
+      //
+      for (size_t wordId = 0; wordId < stats.WSS[i].size(); wordId++)
+      {
+        uint64_t newLines = stats.WSS[i][wordId] & ~m_wssMerged[i][wordId];
+        m_wssMerged[i][wordId] |= newLines;
+        for (; newLines != 0; newLines &= (newLines - 1))
+          m_stats.WSS[i].insert(uint32_t(wordId*64 + __builtin_ctzll(newLines)));
+      }
+    }
+
+    stats.clear();
+  }
+}
+
+uint32_t BVH2CommonRT::AddInstance(uint32_t a_geomId, const float4x4 &a_matrix)
+{
+  // (1) bounding box of instance
+  //
+  const Box4f newBox = TransformBox(m_geomBoxes[a_geomId], a_matrix);
 
   // (2) append bounding box and matrices
   //
@@ -160,13 +888,23 @@ uint32_t BVH2CommonRT::AddInstance(uint32_t a_geomId, const float4x4 &a_matrix)
   m_instMatricesInv.push_back(inverse4x4(a_matrix));
   m_geomIdByInstId.push_back(a_geomId);
 
+  m_tlasTopologyChanged = true;
   return oldSize;
 }
 
 void BVH2CommonRT::UpdateInstance(uint32_t a_instanceId, const float4x4 &a_matrix)
 {
-  std::cout << "[BVH2CommonRT::UpdateInstance]: "
-            << "not implemeted!" << std::endl;
+  if (a_instanceId >= m_instBoxes.size())
+  {
+    std::cout << "[BVH2CommonRT::UpdateInstance]: " << "bad instance id " << a_instanceId << std::endl;
+    return;
+  }
+
+  // only box and matrices are changed here, TLAS is refitted at next CommitScene
+  //
+  m_instBoxes      [a_instanceId] = TransformBox(m_geomBoxes[m_geomIdByInstId[a_instanceId]], a_matrix);
+  m_instMatricesFwd[a_instanceId] = a_matrix;
+  m_instMatricesInv[a_instanceId] = inverse4x4(a_matrix);
 }
 
 ISceneObject *MakeBVH2CommonRT(const char *a_implName, const char* a_buildName) { return new BVH2CommonRT(a_buildName); }
\ No newline at end of file
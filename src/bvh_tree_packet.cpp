@@ -0,0 +1,463 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+
+#include "bvh_tree.h"
+
+using simd::vfloat;
+using simd::PACKET_SIZE;
+
+static inline float4 StreamPosAndNear(const RayStreamSoA& a_rays, uint32_t a_rayId)
+{
+  return float4(a_rays.posX[a_rayId], a_rays.posY[a_rayId], a_rays.posZ[a_rayId], a_rays.tNear[a_rayId]);
+}
+
+static inline float4 StreamDirAndFar(const RayStreamSoA& a_rays, uint32_t a_rayId)
+{
+  return float4(a_rays.dirX[a_rayId], a_rays.dirY[a_rayId], a_rays.dirZ[a_rayId], a_rays.tFar[a_rayId]);
+}
+
+// rays of a packet must agree in the sign of every direction component,
+// otherwise their near-to-far orders differ and most lanes idle during traversal
+//
+static inline bool IsPacketCoherent(const RayStreamSoA& a_rays, uint32_t a_first)
+{
+  const vfloat zero = simd::set1(0.0f);
+  const uint32_t signX = simd::bits(simd::load(a_rays.dirX + a_first) < zero);
+  const uint32_t signY = simd::bits(simd::load(a_rays.dirY + a_first) < zero);
+  const uint32_t signZ = simd::bits(simd::load(a_rays.dirZ + a_first) < zero);
+  return (signX == 0 || signX == simd::FULL_MASK) &&
+         (signY == 0 || signY == simd::FULL_MASK) &&
+         (signZ == 0 || signZ == simd::FULL_MASK);
+}
+
+// slab test of the whole packet against single box; returns mask of lanes that hit it
+// and the smallest entry distance among them to decide the near child
+//
+static inline uint32_t PacketBoxTest(const RayPacket& a_packet, const BVHNode& a_node, uint32_t a_activeMask, float* a_tEnter)
+{
+  const vfloat orgX = simd::load(a_packet.orgX);
+  const vfloat orgY = simd::load(a_packet.orgY);
+  const vfloat orgZ = simd::load(a_packet.orgZ);
+  const vfloat invX = simd::load(a_packet.invX);
+  const vfloat invY = simd::load(a_packet.invY);
+  const vfloat invZ = simd::load(a_packet.invZ);
+
+  const vfloat t1x = (simd::set1(a_node.boxMin.x) - orgX) * invX;
+  const vfloat t2x = (simd::set1(a_node.boxMax.x) - orgX) * invX;
+  const vfloat t1y = (simd::set1(a_node.boxMin.y) - orgY) * invY;
+  const vfloat t2y = (simd::set1(a_node.boxMax.y) - orgY) * invY;
+  const vfloat t1z = (simd::set1(a_node.boxMin.z) - orgZ) * invZ;
+  const vfloat t2z = (simd::set1(a_node.boxMax.z) - orgZ) * invZ;
+
+  const vfloat tMin = simd::vmax(simd::vmax(simd::vmin(t1x, t2x), simd::vmin(t1y, t2y)), simd::vmin(t1z, t2z));
+  const vfloat tMax = simd::vmin(simd::vmin(simd::vmax(t1x, t2x), simd::vmax(t1y, t2y)), simd::vmax(t1z, t2z));
+
+  const uint32_t hitMask = a_activeMask & simd::bits((tMin <= tMax) & (tMax >= simd::load(a_packet.tNear)) & (tMin <= simd::load(a_packet.tFar)));
+
+  alignas(32) float tMinLanes[PACKET_SIZE];
+  simd::store(tMinLanes, tMin);
+
+  float tEnter = FLT_MAX;
+  for (uint32_t lanes = hitMask; lanes != 0; lanes &= (lanes - 1))
+    tEnter = std::min(tEnter, tMinLanes[simd::lowestLane(lanes)]);
+
+  *a_tEnter = tEnter;
+  return hitMask;
+}
+
+void BVH2CommonRT::IntersectAllPrimitivesInLeafPacket(const RayPacket& a_packet, uint32_t a_activeMask,
+                                                      uint32_t instId, uint32_t geomId,
+                                                      uint32_t a_start, uint32_t a_count,
+                                                      float* a_tFar, CRT_Hit* a_hits)
+{
+  const uint2 a_geomOffsets = m_geomOffsets[geomId];
+
+  const vfloat orgX  = simd::load(a_packet.orgX);
+  const vfloat orgY  = simd::load(a_packet.orgY);
+  const vfloat orgZ  = simd::load(a_packet.orgZ);
+  const vfloat dirX  = simd::load(a_packet.dirX);
+  const vfloat dirY  = simd::load(a_packet.dirY);
+  const vfloat dirZ  = simd::load(a_packet.dirZ);
+  const vfloat tNear = simd::load(a_packet.tNear);
+
+  for (uint32_t triId = a_start; triId < a_start + a_count; triId++)
+  {
+    float3 A_pos, edge1, edge2;
+    FetchTriangle(a_geomOffsets, triId, &A_pos, &edge1, &edge2);
+
+    const vfloat e1x = simd::set1(edge1.x), e1y = simd::set1(edge1.y), e1z = simd::set1(edge1.z);
+    const vfloat e2x = simd::set1(edge2.x), e2y = simd::set1(edge2.y), e2z = simd::set1(edge2.z);
+
+    // same math as in IntersectAllPrimitivesInLeaf, one ray per lane
+    //
+    const vfloat pvecX = dirY*e2z - dirZ*e2y;
+    const vfloat pvecY = dirZ*e2x - dirX*e2z;
+    const vfloat pvecZ = dirX*e2y - dirY*e2x;
+
+    const vfloat tvecX = orgX - simd::set1(A_pos.x);
+    const vfloat tvecY = orgY - simd::set1(A_pos.y);
+    const vfloat tvecZ = orgZ - simd::set1(A_pos.z);
+
+    const vfloat qvecX = tvecY*e1z - tvecZ*e1y;
+    const vfloat qvecY = tvecZ*e1x - tvecX*e1z;
+    const vfloat qvecZ = tvecX*e1y - tvecY*e1x;
+
+    const vfloat invDet = simd::set1(1.0f) / (e1x*pvecX + e1y*pvecY + e1z*pvecZ);
+    const vfloat v      = (tvecX*pvecX + tvecY*pvecY + tvecZ*pvecZ) * invDet;
+    const vfloat u      = (qvecX*dirX  + qvecY*dirY  + qvecZ*dirZ ) * invDet;
+    const vfloat t      = (e2x*qvecX   + e2y*qvecY   + e2z*qvecZ  ) * invDet;
+
+    const uint32_t accepted = a_activeMask & simd::bits((v >= simd::set1(-1e-6f)) & (u >= simd::set1(-1e-6f)) &
+                                                        ((u + v) <= simd::set1(1.0f + 1e-6f)) &
+                                                        (t > tNear) & (t < simd::load(a_tFar)));
+    if (accepted == 0)
+      continue;
+
+    alignas(32) float tLanes[PACKET_SIZE], uLanes[PACKET_SIZE], vLanes[PACKET_SIZE];
+    simd::store(tLanes, t);
+    simd::store(uLanes, u);
+    simd::store(vLanes, v);
+
+    for (uint32_t lanes = accepted; lanes != 0; lanes &= (lanes - 1))
+    {
+      const uint32_t lane = simd::lowestLane(lanes);
+      a_tFar[lane]           = tLanes[lane];
+      a_hits[lane].t         = tLanes[lane];
+      a_hits[lane].primId    = triId;
+      a_hits[lane].instId    = instId;
+      a_hits[lane].geomId    = geomId;
+      a_hits[lane].coords[0] = uLanes[lane];
+      a_hits[lane].coords[1] = vLanes[lane];
+    }
+  }
+}
+
+void BVH2CommonRT::BVH2TraversePacket(RayPacket& a_packet, uint32_t a_activeMask,
+                                      uint32_t instId, uint32_t geomId, CRT_Hit* a_hits)
+{
+  const uint32_t bvhOffset = m_bvhOffsets[geomId];
+
+  uint32_t stackOffset[STACK_SIZE];
+  uint32_t stackMask  [STACK_SIZE];
+  int top = 0;
+
+  uint32_t leftNodeOffset = 0;
+  uint32_t activeMask     = a_activeMask;
+
+  while (true)
+  {
+    bool needStackPop = false;
+    if ((leftNodeOffset & LEAF_BIT) == 0)
+    {
+      const BVHNode node0 = m_allNodes[bvhOffset + leftNodeOffset + 0];
+      const BVHNode node1 = m_allNodes[bvhOffset + leftNodeOffset + 1];
+
+      float tEnter0, tEnter1;
+      const uint32_t hitMask0 = PacketBoxTest(a_packet, node0, activeMask, &tEnter0);
+      const uint32_t hitMask1 = PacketBoxTest(a_packet, node1, activeMask, &tEnter1);
+      needStackPop = (hitMask0 == 0 && hitMask1 == 0);
+
+      // traversal decision, only lanes that hit a child go down into it
+      //
+      leftNodeOffset = (hitMask0 != 0) ? node0.leftOffset : node1.leftOffset;
+      activeMask     = (hitMask0 != 0) ? hitMask0 : hitMask1;
+      if (hitMask0 != 0 && hitMask1 != 0)
+      {
+        const bool leftFirst = (tEnter0 <= tEnter1);
+        leftNodeOffset   = leftFirst ? node0.leftOffset : node1.leftOffset;
+        activeMask       = leftFirst ? hitMask0 : hitMask1;
+        stackOffset[top] = leftFirst ? node1.leftOffset : node0.leftOffset;
+        stackMask  [top] = leftFirst ? hitMask1 : hitMask0;
+        top++;
+      }
+    }
+    else
+    {
+      if (leftNodeOffset != 0xFFFFFFFF)
+        IntersectAllPrimitivesInLeafPacket(a_packet, activeMask, instId, geomId,
+                                           EXTRACT_START(leftNodeOffset), EXTRACT_COUNT(leftNodeOffset),
+                                           a_packet.tFar, a_hits);
+      needStackPop = true;
+    }
+
+    if (needStackPop)
+    {
+      if (top == 0)
+        break;
+      top--;
+      leftNodeOffset = stackOffset[top];
+      activeMask     = stackMask[top];
+    }
+  }
+}
+
+void BVH2CommonRT::NearestHitPacket(const RayStreamSoA& a_rays, uint32_t a_first, CRT_Hit* a_outHits)
+{
+  BoxHit   boxMinHits[LBVH_MAXHITS];
+  uint32_t stack[STACK_SIZE];
+
+  // (1) process TLAS for each ray, gather union of intersected instances, lanes that reached them and the nearest entry;
+  //     a lane that reached more than LBVH_MAXHITS instances is traced alone on the scalar path, which has no limit
+  //
+  uint32_t instIds  [LBVH_MAXHITS*PACKET_SIZE];
+  uint32_t instMasks[LBVH_MAXHITS*PACKET_SIZE];
+  float    instEnter[LBVH_MAXHITS*PACKET_SIZE];
+  uint32_t instNum      = 0;
+  uint32_t overflowMask = 0;
+
+  float4 posAndNear[PACKET_SIZE];
+  float4 dirAndFar [PACKET_SIZE];
+
+  for (uint32_t lane = 0; lane < PACKET_SIZE; lane++)
+  {
+    posAndNear[lane] = StreamPosAndNear(a_rays, a_first + lane);
+    dirAndFar [lane] = StreamDirAndFar (a_rays, a_first + lane);
+
+    a_outHits[lane].t      = dirAndFar[lane].w;
+    a_outHits[lane].primId = uint32_t(-1);
+    a_outHits[lane].instId = uint32_t(-1);
+    a_outHits[lane].geomId = uint32_t(-1);
+
+    const uint32_t boxesNum = LBVH2Traverse(posAndNear[lane], dirAndFar[lane], stack, boxMinHits);
+    if (boxesNum > LBVH_MAXHITS)
+    {
+      overflowMask |= (1u << lane);
+      continue;
+    }
+
+    for (uint32_t boxId = 0; boxId < boxesNum; boxId++)
+    {
+      uint32_t slot = 0;
+      while (slot < instNum && instIds[slot] != boxMinHits[boxId].id)
+        slot++;
+      if (slot == instNum)
+      {
+        instIds  [instNum] = boxMinHits[boxId].id;
+        instMasks[instNum] = 0;
+        instEnter[instNum] = boxMinHits[boxId].tHit;
+        instNum++;
+      }
+      instMasks[slot] |= (1u << lane);
+      instEnter[slot]  = std::min(instEnter[slot], boxMinHits[boxId].tHit);
+    }
+  }
+
+  // instances are processed near to far by the nearest entry of any lane, so closer hits cull farther instances
+  //
+  uint32_t order[LBVH_MAXHITS*PACKET_SIZE];
+  for (uint32_t slot = 0; slot < instNum; slot++)
+    order[slot] = slot;
+  std::sort(order, order + instNum, [&](uint32_t a, uint32_t b) { return instEnter[a] < instEnter[b]; });
+
+  // (2) process all intersected BLAS with the lanes that reached them
+  //
+  RayPacket packet;
+  for (uint32_t orderId = 0; orderId < instNum; orderId++)
+  {
+    const uint32_t slot   = order[orderId];
+    const uint32_t instId = instIds[slot];
+    const uint32_t geomId = m_geomIdByInstId[instId];
+
+    uint32_t mask = 0; // lanes that already have a hit before the instance is entered do not need it
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++)
+    {
+      if (((instMasks[slot] >> lane) & 1u) != 0 && instEnter[slot] <= a_outHits[lane].t)
+        mask |= (1u << lane);
+    }
+    if (mask == 0)
+      continue;
+
+    if (simd::popcount(mask) == 1) // packet has diverged, single ray is cheaper on the scalar path
+    {
+      const uint32_t lane  = simd::lowestLane(mask);
+      const float3 ray_pos = matmul4x3(m_instMatricesInv[instId], to_float3(posAndNear[lane]));
+      const float3 ray_dir = matmul3x3(m_instMatricesInv[instId], to_float3(dirAndFar[lane]));
+      BVH2TraverseC32(ray_pos, ray_dir, posAndNear[lane].w, instId, geomId, stack, a_outHits + lane);
+      continue;
+    }
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++)
+    {
+      const float3 ray_pos = matmul4x3(m_instMatricesInv[instId], to_float3(posAndNear[lane]));
+      const float3 ray_dir = matmul3x3(m_instMatricesInv[instId], to_float3(dirAndFar[lane])); // DON'T NORMALIZE IT, see RayQuery_NearestHit
+      const float3 ray_inv = SafeInverse(ray_dir);
+
+      packet.orgX[lane]  = ray_pos.x;
+      packet.orgY[lane]  = ray_pos.y;
+      packet.orgZ[lane]  = ray_pos.z;
+      packet.dirX[lane]  = ray_dir.x;
+      packet.dirY[lane]  = ray_dir.y;
+      packet.dirZ[lane]  = ray_dir.z;
+      packet.invX[lane]  = ray_inv.x;
+      packet.invY[lane]  = ray_inv.y;
+      packet.invZ[lane]  = ray_inv.z;
+      packet.tNear[lane] = posAndNear[lane].w;
+      packet.tFar [lane] = a_outHits[lane].t;
+    }
+
+    BVH2TraversePacket(packet, mask, instId, geomId, a_outHits);
+  }
+
+  for (uint32_t lane = 0; lane < PACKET_SIZE; lane++)
+  {
+    if (((overflowMask >> lane) & 1u) != 0)
+      a_outHits[lane] = RayQuery_NearestHit(posAndNear[lane], dirAndFar[lane]);
+    else
+      FinalizeNearestHit(a_outHits + lane);
+  }
+}
+
+void BVH2CommonRT::RayQuery_NearestHitBatch(const RayStreamSoA& a_rays, uint32_t a_rayNum, CRT_Hit* a_outHits)
+{
+  uint32_t rayId = 0;
+
+  #ifndef ENABLE_METRICS // traversal metrics are gathered on the scalar path only
+  const bool packetsEnabled = (m_layoutFlags & BVH_LAYOUT_COMPRESSED) == 0; // packet traversal reads full precision nodes
+  for (; packetsEnabled && rayId + PACKET_SIZE <= a_rayNum; rayId += PACKET_SIZE)
+  {
+    if (IsPacketCoherent(a_rays, rayId))
+      NearestHitPacket(a_rays, rayId, a_outHits + rayId);
+    else
+    {
+      for (uint32_t lane = 0; lane < PACKET_SIZE; lane++)
+        a_outHits[rayId + lane] = RayQuery_NearestHit(StreamPosAndNear(a_rays, rayId + lane), StreamDirAndFar(a_rays, rayId + lane));
+    }
+  }
+  #endif
+
+  for (; rayId < a_rayNum; rayId++) // incomplete last packet
+    a_outHits[rayId] = RayQuery_NearestHit(StreamPosAndNear(a_rays, rayId), StreamDirAndFar(a_rays, rayId));
+}
+
+void BVH2CommonRT::RayQuery_NearestHitTile(float4 a_posAndNear, const float4* a_dirAndFar, uint32_t a_rayNum, CRT_Hit* a_outHits)
+{
+  #ifdef ENABLE_METRICS
+  ThreadTraverseStats& stats = LocalStats();
+  #endif
+
+  const float3 origin = to_float3(a_posAndNear);
+  const float  tNear  = a_posAndNear.w;
+
+  // (1) bounds of inverse directions and of tFar over the tile
+  //
+  float invMin[3] = { FLT_MAX,  FLT_MAX,  FLT_MAX};
+  float invMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  float tFarMax   = tNear;
+  for (uint32_t rayId = 0; rayId < a_rayNum; rayId++)
+  {
+    const float3 rayDirInv = SafeInverse(to_float3(a_dirAndFar[rayId]));
+    const float  inv[3]    = {rayDirInv.x, rayDirInv.y, rayDirInv.z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+      invMin[axis] = std::min(invMin[axis], inv[axis]);
+      invMax[axis] = std::max(invMax[axis], inv[axis]);
+    }
+    tFarMax = std::max(tFarMax, a_dirAndFar[rayId].w);
+  }
+
+  // lower bound of the entry distance over all rays of the tile, FLT_MAX if none of them can hit the box;
+  // for a fixed plane t = dist*inv is monotonic in inv, so its bounds are reached at invMin or invMax;
+  // an axis where directions change sign gives no bounds
+  //
+  auto tileEntry = [&](const float3 a_boxMin, const float3 a_boxMax)
+  {
+    const float distMin[3] = {a_boxMin.x - origin.x, a_boxMin.y - origin.y, a_boxMin.z - origin.z};
+    const float distMax[3] = {a_boxMax.x - origin.x, a_boxMax.y - origin.y, a_boxMax.z - origin.z};
+    float tEnter = tNear;
+    float tExit  = tFarMax;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      if (invMin[axis] < 0.0f && invMax[axis] > 0.0f)
+        continue;
+      const bool  positive  = (invMin[axis] >= 0.0f);
+      const float distEnter = positive ? distMin[axis] : distMax[axis];
+      const float distExit  = positive ? distMax[axis] : distMin[axis];
+      tEnter = std::max(tEnter, std::min(distEnter*invMin[axis], distEnter*invMax[axis]));
+      tExit  = std::min(tExit,  std::max(distExit *invMin[axis], distExit *invMax[axis]));
+    }
+    return (tEnter <= tExit) ? tEnter : FLT_MAX;
+  };
+
+  // (2) TLAS is traversed once for the whole tile, surviving instances are sorted by their entry bound
+  //
+  std::vector<std::pair<float, uint32_t> > tileInstances;
+  tileInstances.reserve(64);
+
+  uint32_t stackTLAS[STACK_SIZE];
+  int top = 0;
+  if (tileEntry(m_nodesTLAS[0].boxMin, m_nodesTLAS[0].boxMax) != FLT_MAX)
+    stackTLAS[top++] = 0;
+
+  while (top > 0)
+  {
+    const BVHNode& node = m_nodesTLAS[stackTLAS[--top]];
+    if ((node.leftOffset & LEAF_BIT) != 0)
+    {
+      if (node.leftOffset == 0xFFFFFFFF)
+        continue;
+      const uint32_t start = EXTRACT_START(node.leftOffset);
+      const uint32_t count = EXTRACT_COUNT(node.leftOffset);
+      for (uint32_t instId = start; instId < start + count; instId++)
+        tileInstances.push_back({tileEntry(to_float3(m_instBoxes[instId].boxMin), to_float3(m_instBoxes[instId].boxMax)), instId});
+      continue;
+    }
+
+    #ifdef ENABLE_METRICS
+    stats.NC  += 2;
+    stats.BLB += 2 * sizeof(BVHNode);
+    #endif
+    const BVHNode& node0 = m_nodesTLAS[node.leftOffset];
+    const BVHNode& node1 = m_nodesTLAS[node.escapeIndex];
+    if (tileEntry(node0.boxMin, node0.boxMax) != FLT_MAX)
+      stackTLAS[top++] = node.leftOffset;
+    if (tileEntry(node1.boxMin, node1.boxMax) != FLT_MAX)
+      stackTLAS[top++] = node.escapeIndex;
+  }
+  std::sort(tileInstances.begin(), tileInstances.end());
+
+  // (3) origin in local space of every surviving instance
+  //
+  std::vector<float3> localPos(tileInstances.size());
+  for (size_t i = 0; i < tileInstances.size(); i++)
+    localPos[i] = matmul4x3(m_instMatricesInv[tileInstances[i].second], origin);
+
+  // (4) every ray visits surviving instances near to far until the entry bound is beyond its closest hit
+  //
+  uint32_t stack[STACK_SIZE];
+  for (uint32_t rayId = 0; rayId < a_rayNum; rayId++)
+  {
+    #ifdef ENABLE_METRICS
+    stats.ResetVarLC();
+    #endif
+
+    CRT_Hit hit;
+    hit.t      = a_dirAndFar[rayId].w;
+    hit.primId = uint32_t(-1);
+    hit.instId = uint32_t(-1);
+    hit.geomId = uint32_t(-1);
+
+    const float3 rayDir    = to_float3(a_dirAndFar[rayId]);
+    const float3 rayDirInv = SafeInverse(rayDir);
+
+    for (size_t i = 0; i < tileInstances.size() && tileInstances[i].first <= hit.t; i++)
+    {
+      const uint32_t instId = tileInstances[i].second;
+      const float2   tm     = RayBoxIntersection2(origin, rayDirInv, to_float3(m_instBoxes[instId].boxMin), to_float3(m_instBoxes[instId].boxMax));
+      if (tm.x > tm.y || tm.y < tNear || tm.x > hit.t)
+        continue;
+
+      const float3 ray_dir = matmul3x3(m_instMatricesInv[instId], rayDir); // DON'T NORMALIZE IT, see RayQuery_NearestHit
+      TraverseBLAS(localPos[i], ray_dir, tNear, instId, m_geomIdByInstId[instId], stack, &hit);
+    }
+
+    #ifdef ENABLE_METRICS
+    stats.raysNumber++;
+    #endif
+
+    FinalizeNearestHit(&hit);
+    a_outHits[rayId] = hit;
+  }
+}
@@ -0,0 +1,161 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataset_shard.h"
+
+// Shard layout: DatasetShardHeader, input array, output array; arrays start at 64 byte boundary and are sized 
+// for the capacity given to DatasetShardWriter::Open, pointsNum of them are valid.
+// SHARD_VERSION must be increased with any change of the layout or of the dataset itself.
+//
+static constexpr char     SHARD_MAGIC[8]  = {'N','B','V','H','D','S','E','T'};
+static constexpr uint32_t SHARD_VERSION   = 2;
+static constexpr uint64_t SHARD_ALIGNMENT = 64;
+
+static inline uint64_t AlignUp(uint64_t a_size) { return (a_size + SHARD_ALIGNMENT - 1) / SHARD_ALIGNMENT * SHARD_ALIGNMENT; }
+
+static inline uint64_t InputFloatsPerPoint (const DatasetShardHeader& a_header) { return uint64_t(a_header.raysPerPoint) * (a_header.compact != 0 ? 6 : a_header.samplesPerRay * 3); }
+static inline uint64_t OutputFloatsPerPoint(const DatasetShardHeader& a_header) { return uint64_t(a_header.raysPerPoint) * a_header.outputSize; }
+
+static bool WriteAt(int a_fd, uint64_t a_offset, const void* a_data, uint64_t a_size)
+{
+  const uint8_t* bytes = static_cast<const uint8_t*>(a_data);
+  while (a_size > 0)
+  {
+    const ssize_t written = pwrite(a_fd, bytes, size_t(a_size), off_t(a_offset));
+    if (written <= 0)
+      return false;
+    bytes    += written;
+    a_offset += uint64_t(written);
+    a_size   -= uint64_t(written);
+  }
+  return true;
+}
+
+DatasetShardHeader MakeDatasetShardHeader()
+{
+  DatasetShardHeader header = {};
+  std::memcpy(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+  header.version = SHARD_VERSION;
+  return header;
+}
+
+std::string DatasetShardPath(const std::string& a_dir, uint64_t a_sceneHash, uint64_t a_seed, uint64_t a_shardId)
+{
+  std::stringstream strout;
+  strout << a_dir << "/" << std::hex << a_sceneHash << "_" << a_seed << "_" << std::dec << a_shardId << ".nbvhds";
+  return strout.str();
+}
+
+DatasetShardWriter::~DatasetShardWriter()
+{
+  if (m_fd >= 0) // not closed, the file is incomplete
+  {
+    close(m_fd);
+    std::remove((m_path + ".tmp").c_str());
+  }
+}
+
+bool DatasetShardWriter::Open(const char* a_path, const DatasetShardHeader& a_header, uint64_t a_capacity)
+{
+  m_path     = a_path;
+  m_capacity = a_capacity;
+  m_header   = a_header;
+  m_header.pointsNum    = 0;
+  m_header.inputOffset  = AlignUp(sizeof(DatasetShardHeader));
+  m_header.outputOffset = m_header.inputOffset + AlignUp(a_capacity * InputFloatsPerPoint(m_header) * sizeof(float));
+
+  m_fd = open((m_path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0)
+  {
+    std::cout << "[DatasetShardWriter::Open]: can't create '" << a_path << ".tmp'" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool DatasetShardWriter::Append(const float* a_input, const float* a_output, uint64_t a_pointsNum)
+{
+  if (m_fd < 0 || m_header.pointsNum + a_pointsNum > m_capacity)
+    return false;
+
+  const uint64_t inputFloats  = InputFloatsPerPoint(m_header);
+  const uint64_t outputFloats = OutputFloatsPerPoint(m_header);
+  const bool ok = WriteAt(m_fd, m_header.inputOffset  + m_header.pointsNum*inputFloats*sizeof(float),  a_input,  a_pointsNum*inputFloats*sizeof(float)) &&
+                  WriteAt(m_fd, m_header.outputOffset + m_header.pointsNum*outputFloats*sizeof(float), a_output, a_pointsNum*outputFloats*sizeof(float));
+  if (ok)
+    m_header.pointsNum += a_pointsNum;
+  return ok;
+}
+
+bool DatasetShardWriter::Close()
+{
+  if (m_fd < 0)
+    return false;
+
+  // the output array is sized for the capacity, so the file is extended to its end even if the shard is not full
+  //
+  const uint64_t fileSize = m_header.outputOffset + m_capacity * OutputFloatsPerPoint(m_header) * sizeof(float);
+  const bool ok = WriteAt(m_fd, 0, &m_header, sizeof(m_header)) && ftruncate(m_fd, off_t(fileSize)) == 0;
+  close(m_fd);
+  m_fd = -1;
+
+  const std::string tmpPath = m_path + ".tmp";
+  if (!ok || std::rename(tmpPath.c_str(), m_path.c_str()) != 0)
+  {
+    std::cout << "[DatasetShardWriter::Close]: can't write '" << m_path.c_str() << "'" << std::endl;
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DatasetShardReader::Open(const char* a_path)
+{
+  Close();
+
+  const int fd = open(a_path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(DatasetShardHeader))
+  {
+    void* ptr = mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (ptr != MAP_FAILED)
+    {
+      m_data = static_cast<uint8_t*>(ptr);
+      m_size = size_t(st.st_size);
+    }
+  }
+  close(fd);
+  if (m_data == nullptr)
+    return false;
+
+  const DatasetShardHeader& header = Header();
+  const bool valid = std::memcmp(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) == 0 && header.version == SHARD_VERSION &&
+                     header.inputOffset  % SHARD_ALIGNMENT == 0 && header.inputOffset >= sizeof(DatasetShardHeader) &&
+                     header.outputOffset % SHARD_ALIGNMENT == 0 && header.outputOffset >= header.inputOffset && header.outputOffset <= m_size &&
+                     header.pointsNum * InputFloatsPerPoint(header)  * sizeof(float) <= header.outputOffset - header.inputOffset &&
+                     header.pointsNum * OutputFloatsPerPoint(header) * sizeof(float) <= m_size - header.outputOffset;
+  if (!valid)
+  {
+    std::cout << "[DatasetShardReader::Open]: '" << a_path << "' is corrupted" << std::endl;
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void DatasetShardReader::Close()
+{
+  if (m_data != nullptr)
+    munmap(m_data, m_size);
+  m_data = nullptr;
+  m_size = 0;
+}
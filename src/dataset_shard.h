@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/**
+\brief Header of a dataset shard file. A shard is a run of consecutive points of N_BVH::GenRayBBoxDataset together with
+       everything needed to check that it fits the scene and the network. Input and output arrays follow the header, 
+       each of them starts at 64 byte boundary.
+*/
+struct DatasetShardHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t samplesPerRay;
+  uint32_t raysPerPoint;
+  uint32_t outputSize;
+  uint32_t compact;      ///< input holds 2 chord ends (6 floats) per ray instead of samplesPerRay positions
+  uint32_t reserved;
+  uint64_t sceneHash;
+  uint64_t seed;
+  uint64_t firstPoint;   ///< index of the first point in the whole dataset, i.e. of its random stream
+  uint64_t pointsNum;
+  float    bboxMin[4];   ///< dataset box, sample positions are normalized to it
+  float    bboxMax[4];
+  uint64_t inputOffset;  ///< pointsNum*raysPerPoint*samplesPerRay*3 floats
+  uint64_t outputOffset; ///< pointsNum*raysPerPoint*outputSize floats
+};
+
+/**
+\brief Writes one shard incrementally. The file is created as a_path + ".tmp" and renamed on Close, 
+       so a shard that exists under its name is always complete.
+*/
+class DatasetShardWriter
+{
+public:
+  DatasetShardWriter() = default;
+  ~DatasetShardWriter();
+
+  DatasetShardWriter(const DatasetShardWriter&) = delete;
+  DatasetShardWriter& operator=(const DatasetShardWriter&) = delete;
+
+  /// a_header gives scene and network fields, offsets and pointsNum are set by the writer; a_capacity is the max number of points
+  bool Open(const char* a_path, const DatasetShardHeader& a_header, uint64_t a_capacity);
+  bool Append(const float* a_input, const float* a_output, uint64_t a_pointsNum);
+  bool Close();
+
+private:
+  int                m_fd       = -1;
+  uint64_t           m_capacity = 0;
+  DatasetShardHeader m_header   = {};
+  std::string        m_path;
+};
+
+/**
+\brief Read-only view of a shard. The file is mapped copy-on-write, so arrays can be passed as non-const pointers 
+       without a copy; pages are copied only if somebody writes to them.
+*/
+class DatasetShardReader
+{
+public:
+  DatasetShardReader() = default;
+  ~DatasetShardReader() { Close(); }
+
+  DatasetShardReader(const DatasetShardReader&) = delete;
+  DatasetShardReader& operator=(const DatasetShardReader&) = delete;
+
+  bool Open(const char* a_path); ///< false if the file is missing, truncated or has another format version
+  void Close();
+
+  const DatasetShardHeader& Header() const { return *reinterpret_cast<const DatasetShardHeader*>(m_data); }
+  float* Input()  const { return reinterpret_cast<float*>(m_data + Header().inputOffset);  }
+  float* Output() const { return reinterpret_cast<float*>(m_data + Header().outputOffset); }
+
+private:
+  uint8_t* m_data = nullptr;
+  size_t   m_size = 0;
+};
+
+DatasetShardHeader MakeDatasetShardHeader(); ///< zero header with magic and version
+std::string        DatasetShardPath(const std::string& a_dir, uint64_t a_sceneHash, uint64_t a_seed, uint64_t a_shardId);
@@ -2,6 +2,7 @@
 #include "Image2d.h"
 #include <filesystem>
 #include <iostream>
+#include <cstdio>
 
 int main(int argc, const char** argv)
 {
@@ -18,6 +19,38 @@ int main(int argc, const char** argv)
 
     pRender->SetViewport(0,0,WIDTH,HEIGHT);
 
+    std::string datasetDir;
+    std::string camerasPath;
+    uint32_t    hybridLeaves = 0;
+
+    for (int i = 2; i + 1 < argc; i++)
+    {
+        if (std::string(argv[i]) == "--cache")
+        {
+            std::filesystem::create_directories(argv[i + 1]);
+            pRender->SetCacheDir(argv[i + 1]);
+        }
+        else if (std::string(argv[i]) == "--primary")
+            pRender->SetTiledPrimaryRays(std::string(argv[i + 1]) == "tiled");
+        else if (std::string(argv[i]) == "--rays")
+            pRender->SetCompactDataset(std::string(argv[i + 1]) == "compact");
+        else if (std::string(argv[i]) == "--neural")
+            pRender->SetNeuralTiles(std::string(argv[i + 1]) == "tiled" ? 16 : 0);
+        else if (std::string(argv[i]) == "--cull")
+            pRender->SetInstanceCulling(std::string(argv[i + 1]) == "instances");
+        else if (std::string(argv[i]) == "--sampling")
+            pRender->SetActiveSampling(std::string(argv[i + 1]) == "active");
+        else if (std::string(argv[i]) == "--hybrid")
+            hybridLeaves = uint32_t(std::stoul(argv[i + 1]));
+        else if (std::string(argv[i]) == "--cameras")
+            camerasPath = argv[i + 1];
+        else if (std::string(argv[i]) == "--dataset")
+        {
+            std::filesystem::create_directories(argv[i + 1]);
+            datasetDir = argv[i + 1];
+        }
+    }
+
     std::cout << "[main]: load scene '" << scenePath << "'" << std::endl;
 
     bool loaded = pRender->LoadScene((std::string(std::filesystem::current_path()) + "/" + std::string(scenePath)).c_str());
@@ -35,12 +68,21 @@ int main(int argc, const char** argv)
     std::cout << "[main]: save image to file ..." << std::endl;
     LiteImage::SaveImage(refImage, image);
 
-    std::cout << "[main]: generate dataset ..." << std::endl;
-    std::vector<float> train_input, train_output;
-    pRender->GenRayBBoxDataset(train_input, train_output, 1'000'000);
-
-    std::cout << "[main]: do training ..." << std::endl;
-    pRender->TrainNetwork(train_input, train_output);
+    if (hybridLeaves > 0)
+    {
+        std::cout << "[main]: do training of hybrid networks ..." << std::endl;
+        pRender->TrainHybrid(hybridLeaves, 100'000);
+    }
+    else if (datasetDir.empty())
+    {
+        std::cout << "[main]: do training on generated rays ..." << std::endl;
+        pRender->TrainNetworkStreaming(1'000'000);
+    }
+    else
+    {
+        std::cout << "[main]: do training on dataset shards in '" << datasetDir.c_str() << "' ..." << std::endl;
+        pRender->TrainNetworkShards(pRender->GenRayBBoxShards(datasetDir.c_str(), 0, 16, 62'500));
+    }
 
     LiteImage::Image2D<uint32_t> test_image(WIDTH, HEIGHT);
     std::cout << "[main]: do neural rendering ..." << std::endl;
@@ -48,4 +90,17 @@ int main(int argc, const char** argv)
 
     std::cout << "[main]: save image to file ..." << std::endl;
     LiteImage::SaveImage(outImage, test_image);
+
+    if (!camerasPath.empty())
+    {
+        const auto poses = N_BVH::LoadCameraPath(camerasPath.c_str());
+        std::cout << "[main]: render " << poses.size() << " frames of '" << camerasPath.c_str() << "' ..." << std::endl;
+        pRender->RenderSequence(poses, WIDTH, HEIGHT, [&](uint32_t a_frameId, const uint32_t* a_image)
+        {
+            std::copy(a_image, a_image + WIDTH * HEIGHT, test_image.data());
+            char name[64];
+            std::snprintf(name, sizeof(name), "frame_%05u.bmp", a_frameId);
+            LiteImage::SaveImage(name, test_image);
+        });
+    }
 }
\ No newline at end of file
@@ -33,44 +33,70 @@ void N_BVH::kernel_RayTrace(uint32_t tidX, const float4* rayPosAndNear,
   
   if(m_measureOverhead == 0)
   {
-    CRT_Hit hit   = m_pAccelStruct->RayQuery_NearestHit(rayPos, rayDir);
+    CRT_Hit hit = m_pAccelStruct->RayQuery_NearestHit(rayPos, rayDir);
+    kernel_ShadeHit(tidX, rayPosAndNear, rayDirAndFar, &hit, out_color, out_depth);
+  }
+  else
+  {
+    float4 colorF = abs(rayDir);
     const uint XY = m_packedXY[tidX];
     const uint x  = (XY & 0x0000FFFF);
     const uint y  = (XY & 0xFFFF0000) >> 16;
+    out_color[y * m_width + x] = RealColorToUint32(colorF);
+    out_depth[y * m_width + x] = 0.f;
+  }
+}
+
+void N_BVH::kernel_ShadeHit(uint32_t tidX, const float4* rayPosAndNear, const float4* rayDirAndFar,
+                            const CRT_Hit* a_hit, uint32_t* out_color, float* out_depth)
+{
+  const float4  rayPos = *rayPosAndNear;
+  const float4  rayDir = *rayDirAndFar ;
+  const CRT_Hit hit    = *a_hit;
+
+  const uint XY = m_packedXY[tidX];
+  const uint x  = (XY & 0x0000FFFF);
+  const uint y  = (XY & 0xFFFF0000) >> 16;
 
-    if (hit.primId != uint32_t(-1))
+  if (hit.primId != uint32_t(-1))
+  {
+    uint32_t normalPacked = *reinterpret_cast<const uint32_t*>(&hit.coords[2]);
+    float3 normal = unpackNormal(normalPacked);
+    float4 hitPoint = rayPos + hit.t * rayDir;
+
+    //out_color[y * m_width + x] = (hit.primId == 0xFFFFFFFF) ? 0 : m_palette[(hit.primId) % palette_size];
+    uint8_t r, g, b;
+    if (m_lambertShading)
     {
-      uint32_t normalPacked = *reinterpret_cast<uint32_t*>(&hit.coords[2]);
-      float3 normal = unpackNormal(normalPacked);
-      float4 hitPoint = rayPos + hit.t * rayDir;
-      //float3 lambert = m_lightSourcePower * max(0.f, dot(normal, normalize(m_lightSourcePos - float3(hitPoint.x, hitPoint.y, hitPoint.z))));
-
-      //out_color[y * m_width + x] = (hit.primId == 0xFFFFFFFF) ? 0 : m_palette[(hit.primId) % palette_size];
-      ///uint8_t r = uint8_t(clip(0.f, 255.f, (lambert.x + 0.2f) * 255.f));
-      ///uint8_t g = uint8_t(clip(0.f, 255.f, (lambert.y + 0.2f) * 255.f));
-      ///uint8_t b = uint8_t(clip(0.f, 255.f, (lambert.z + 0.2f) * 255.f));
-      uint8_t r = uint8_t((normal.x + 1.f) * 0.5f * 255.f);
-      uint8_t g = uint8_t((normal.y + 1.f) * 0.5f * 255.f);
-      uint8_t b = uint8_t((normal.z + 1.f) * 0.5f * 255.f);
-
-      out_color[y * m_width + x] = (r << 8 | g) << 8 | b;
-      out_depth[y * m_width + x] = hit.t;
+      // normal is stored in object space of the instance
+      float3 worldNormal = normalize(matmul3x3(transpose(m_pAccelStruct->m_instMatricesInv[hit.instId]), normal));
+      if (dot(worldNormal, to_float3(rayDir)) > 0.f)
+        worldNormal = -1.f * worldNormal;
+
+      // shadow ray: direction is not normalized, so t in (0,1) covers the segment to the light
+      const float3 surfPos  = to_float3(hitPoint);
+      const float3 toLight  = m_lightSourcePos - surfPos;
+      const bool   inShadow = m_pAccelStruct->RayQuery_AnyHit(to_float4(surfPos, 1e-3f), to_float4(toLight, 1.0f));
+
+      float3 lambert = inShadow ? float3(0.f, 0.f, 0.f) : m_lightSourcePower * max(0.f, dot(worldNormal, normalize(toLight)));
+      r = uint8_t(clip(0.f, 255.f, (lambert.x + 0.2f) * 255.f));
+      g = uint8_t(clip(0.f, 255.f, (lambert.y + 0.2f) * 255.f));
+      b = uint8_t(clip(0.f, 255.f, (lambert.z + 0.2f) * 255.f));
     }
     else
     {
-      out_color[y * m_width + x] = 0u;
-      out_depth[y * m_width + x] = INF_POSITIVE;
+      r = uint8_t((normal.x + 1.f) * 0.5f * 255.f);
+      g = uint8_t((normal.y + 1.f) * 0.5f * 255.f);
+      b = uint8_t((normal.z + 1.f) * 0.5f * 255.f);
     }
 
+    out_color[y * m_width + x] = (r << 8 | g) << 8 | b;
+    out_depth[y * m_width + x] = hit.t;
   }
   else
   {
-    float4 colorF = abs(rayDir);
-    const uint XY = m_packedXY[tidX];
-    const uint x  = (XY & 0x0000FFFF);
-    const uint y  = (XY & 0xFFFF0000) >> 16;
-    out_color[y * m_width + x] = RealColorToUint32(colorF);
-    out_depth[y * m_width + x] = 0.f;
+    out_color[y * m_width + x] = 0u;
+    out_depth[y * m_width + x] = INF_POSITIVE;
   }
 }
 
@@ -1,15 +1,29 @@
 #include "bvh_tree.h"
+#include "active_sampler.h"
 #include "gltf_loader.h"
 #include "IRenderer.h"
 #include "neural_core/src/neural_network.h"
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <functional>
+
+struct DatasetShardHeader;
+
+/// camera of a rendered frame, fov is vertical in degrees; fov <= 0 keeps the projection of the scene
+struct CameraPose
+{
+  LiteMath::float3 pos;
+  LiteMath::float3 lookAt;
+  LiteMath::float3 up  = LiteMath::float3(0.f, 1.f, 0.f);
+  float            fov = 0.f;
+};
 
 class N_BVH
 {
 public:
-    N_BVH();
+    N_BVH(uint32_t a_bvhLayoutFlags = 0); ///< a_bvhLayoutFlags are BVHLayoutFlags of the classic acceleration structure
   const char* Name() const;
   
   virtual void SceneRestrictions(uint32_t a_restrictions[4]) const
@@ -31,6 +45,12 @@ public:
   virtual bool LoadScene(const char* a_scenePath);
 #endif
 
+  /// directory for acceleration structure cache files, LoadScene reads the cache from it or writes one after the build; empty disables cache
+  void SetCacheDir(const char* a_dir) { m_cacheDir = a_dir; }
+
+  /// trace primary rays of the reference render by 8x8 tiles with the common origin, see BVH2CommonRT::RayQuery_NearestHitTile
+  void SetTiledPrimaryRays(bool a_enable) { m_tiledPrimaryRays = a_enable; }
+
 #ifdef __ANDROID__
   bool LoadSingleMesh(const char* a_meshPath, const float* transform4x4ColMajor, AAssetManager* assetManager = nullptr);
 #else
@@ -39,9 +59,58 @@ public:
 
   //////////////////////////////NEURAL//PART/////////////////////////////////////
 
-  void GenRayBBoxDataset(std::vector<float>& inputData, std::vector<float>& outputData, uint32_t points);
+  /// store only the two normalized chord ends (RAY_ENDPOINT_FLOATS) per ray in datasets and in the inference input,
+  /// sample positions are computed from them right before a slice of rays goes to the network
+  void SetCompactDataset(bool a_enable) { m_compactDataset = a_enable; }
+
+  void SetCamera(const CameraPose& a_pose);
+
+  /// text file with a pose per line: "posX posY posZ lookAtX lookAtY lookAtZ [upX upY upZ [fov]]", lines starting with '#' are skipped
+  static std::vector<CameraPose> LoadCameraPath(const char* a_path);
+
+  /// neural Render of every pose into one image buffer of a_width x a_height, a_onFrame gets it after each frame;
+  /// render buffers and scene constants are kept between frames
+  void RenderSequence(const std::vector<CameraPose>& a_poses, uint32_t a_width, uint32_t a_height,
+                      const std::function<void(uint32_t a_frameId, const uint32_t* a_image)>& a_onFrame);
+
+  /// skip network evaluation of rays that miss world boxes of all instances (TLAS leaves), not only the scene box
+  void SetInstanceCulling(bool a_enable) { m_instanceCulling = a_enable; }
+
+  /// hybrid neural BVH: TLAS is cut into at most a_maxLeaves subtrees (the inner node of the cut with the largest box is split first),
+  /// every subtree box gets its own network with a_hiddenSize neurons in hidden layers trained on a_pointsPerLeaf rays clipped to the box.
+  /// Render then walks TLAS down to the cut and evaluates networks of boxes the ray enters near to far, see RenderHybrid.
+  /// a_maxLeaves is clamped to MAX_HYBRID_ENTRIES, so every box a ray enters is evaluated. The cut stops at TLAS leaves, 
+  /// so a scene with few instances (LoadSingleMesh has one) gets as many networks as instances
+  void TrainHybrid(uint32_t a_maxLeaves, uint32_t a_pointsPerLeaf, int a_hiddenSize = 32, uint64_t a_seed = 0);
+
+  /// neural Render by batches of a_tilesPerBatch pixel tiles through three reusable batch buffers: generation of batch k+1,
+  /// inference of batch k and shading of batch k-1 run together, so memory does not depend on resolution; 0 renders the whole frame at once.
+  /// The hybrid mode (TrainHybrid) ignores it and always renders the whole frame
+  void SetNeuralTiles(uint32_t a_tilesPerBatch) { m_neuralBatchTiles = a_tilesPerBatch; }
+
+  /// draw ray endpoints of GenRayBBoxDataset and TrainNetworkStreaming in proportion to network error and hit rate measured on
+  /// previous training rays over a_gridSize^3 cells of the dataset box, see ActiveRaySampler; shards are always uniform.
+  /// Statistics are recorded by TrainNetworkStreaming only, GenRayBBoxDataset samples from what previous streaming runs recorded
+  void SetActiveSampling(bool a_enable, float a_hitShare = 0.25f, float a_uniformShare = 0.25f, uint32_t a_gridSize = 8);
+
+  /// points are generated in parallel, the result depends only on a_seed (and on the active sampler state if it is enabled)
+  void GenRayBBoxDataset(std::vector<float>& inputData, std::vector<float>& outputData, uint32_t points, uint64_t a_seed = 0);
+
   void TrainNetwork(std::vector<float>& inputData, std::vector<float>& outputData);
 
+  /// write shards [a_firstShard, a_firstShard + a_shardsNum) of a_shardPoints points each of GenRayBBoxDataset with a_seed to a_dir;
+  /// shards that already exist there are kept, so several machines may fill one directory with different shard ranges.
+  /// Returns paths of all complete shards of the range
+  std::vector<std::string> GenRayBBoxShards(const char* a_dir, uint64_t a_firstShard, uint64_t a_shardsNum, uint32_t a_shardPoints, uint64_t a_seed = 0);
+
+  /// train on memory mapped shards without copying them, shards of another scene or dataset layout are skipped
+  void TrainNetworkShards(const std::vector<std::string>& a_paths);
+
+  /// train on a_totalPoints points of GenRayBBoxDataset (the same points for the same a_seed) without storing all of them:
+  /// worker threads generate chunks of a_chunkPoints into a ring of a_ringSize chunks while the network trains on ready ones in order;
+  /// every chunk is passed to the trainer with the settings of TrainNetwork; zero a_chunkPoints or a_ringSize is rejected
+  void TrainNetworkStreaming(uint64_t a_totalPoints, uint32_t a_chunkPoints = 65536, uint32_t a_ringSize = 4, uint64_t a_seed = 0);
+
   ///////////////////////////////////////////////////////////////////////////////
 
   void Clear (uint32_t a_width, uint32_t a_height, const char* a_what);
@@ -70,6 +139,84 @@ protected:
   bool LoadSceneGLTF(const std::string& a_path);
 #endif
 
+  LiteMath::BBox3f DatasetBBox() const; ///< scene box enlarged by m_BBoxBound, rays of the dataset are chords of it
+  void GenRayBBoxPoint(const LiteMath::BBox3f& BBox, uint64_t a_pointId, uint64_t a_seed, float* a_input, float* a_output,
+                       const ActiveSamplerSnapshot* a_distribution = nullptr, float* a_sampledPoints = nullptr); ///< a_sampledPoints gets RAY_ENDPOINT_FLOATS
+  void GenRayBBoxRange(const LiteMath::BBox3f& BBox, uint64_t a_firstPoint, uint32_t a_points, uint64_t a_seed, float* a_input, float* a_output,
+                       const ActiveSamplerSnapshot* a_distribution = nullptr, float* a_sampledPoints = nullptr);
+  void RecordActiveSampler(const float* a_input, const float* a_output, const float* a_sampledPoints, uint32_t a_points, bool a_compact); ///< evaluate network on a subset of trained points
+  bool ShardFitsScene(const DatasetShardHeader& a_header) const; ///< same scene file, dataset box and sample layout
+
+  uint32_t InputFloatsPerRay() const { return m_compactDataset ? RAY_ENDPOINT_FLOATS : m_samplesPerRay * 3; }
+  void     PutRayInput(float3 a_begin, float3 a_end, float* a_input) const; ///< chord ends normalized to the dataset box
+  void     ExpandRaySamples(const float* a_endpoints, size_t a_raysNum, float* a_samples) const;
+  float    TrainOnRays(nn::NeuralNetwork& a_net, float* a_input, float* a_output, size_t a_raysNum, bool a_compact, bool a_verbose); ///< returns average loss
+
+  /// per-frame constants of the neural render; eye ray directions are affine in pixel coordinates up to normalization
+  struct NeuralFrame
+  {
+    LiteMath::BBox3f box;       ///< DatasetBBox
+    float3           boxSize;
+    float            threshold; ///< rays with a shorter chord of the box are not evaluated
+    float3           rayPos;
+    float3           dir0, dirX, dirY;
+    bool             affine;    ///< dir* are invalid if false, directions are computed per pixel then
+  };
+
+  /// buffers of one batch of tiles in the tiled neural render
+  struct NeuralBatch
+  {
+    std::vector<float> input;   ///< InputFloatsPerRay per ray
+    std::vector<float> output;
+    std::vector<float> mask;
+
+    std::vector<uint32_t> activeIds;   ///< rays with non zero mask, only they go to the network
+    std::vector<float>    samples;     ///< sample positions of a slice of active rays
+    std::vector<float>    sliceOutput;
+  };
+
+  /// subtree of the TLAS cut with its own network in the hybrid mode
+  struct HybridLeaf
+  {
+    uint32_t                           nodeId; ///< TLAS node
+    LiteMath::BBox3f                   box;    ///< node box enlarged by m_BBoxBound, the domain of the network
+    std::unique_ptr<nn::NeuralNetwork> net;
+  };
+
+  /// a box of the cut entered by a ray
+  struct HybridEntry
+  {
+    uint32_t leafId;
+    float    tEnter;
+    float    tExit;
+  };
+
+  /// per pixel buffers of RenderHybrid, kept between frames and reallocated only when the resolution changes
+  struct HybridFrame
+  {
+    std::vector<float3>      rayDirs;
+    std::vector<HybridEntry> entries;      ///< MAX_HYBRID_ENTRIES per pixel
+    std::vector<uint32_t>    entriesNum;
+    std::vector<float>       bestT;        ///< nearest neural hit so far
+    std::vector<float>       normals;
+    std::vector<uint32_t>    leafRays;     ///< active pixels of a round grouped by leaf
+    std::vector<uint32_t>    leafFirst;    ///< leavesNum + 1 offsets in leafRays
+    std::vector<uint32_t>    rangeCursor;  ///< rangesNum x leavesNum, counts and then scatter cursors of pixel ranges
+  };
+
+  void     BuildNetwork(nn::NeuralNetwork& a_net, int int_size) const;
+  void     RenderHybrid(uint32_t* a_outColor, uint32_t a_width, uint32_t a_height);
+  uint32_t HybridLeavesAlongRay(float3 a_rayPos, float3 a_rayDir, HybridEntry* a_entries) const; ///< up to MAX_HYBRID_ENTRIES nearest, sorted by tEnter
+
+  const NeuralFrame& PrepareNeuralFrame(); ///< recomputes scene or camera part of m_neuralFrame if they are outdated
+  void RenderNeuralTiled(uint32_t* a_outColor, uint32_t a_width, uint32_t a_height);
+  size_t EvaluateNeuralBatch(NeuralBatch& a_batch); ///< evaluates active rays only, returns their number
+  void NeuralGenTile  (const NeuralFrame& a_frame, uint32_t a_tileId, uint32_t a_width, uint32_t a_height, float* a_input, float* a_mask);
+  void NeuralShadeTile(uint32_t a_tileId, uint32_t a_width, uint32_t a_height, const float* a_output, const float* a_mask, uint32_t* a_outColor);
+
+  bool LoadSceneCache(const std::string& a_cachePath, uint64_t a_sceneHash);
+  void SaveSceneCache(const std::string& a_cachePath, uint64_t a_sceneHash) const;
+
   virtual void PackXYBlock(uint tidX, uint tidY, uint a_passNum);
   virtual void PackXY(uint tidX, uint tidY);
   virtual void kernel_PackXY(uint tidX, uint tidY, uint* out_pakedXY);
@@ -81,9 +228,12 @@ protected:
   #endif
 
   virtual void CastRaySingleBlock(uint32_t tidX, uint32_t* out_color, float* out_depth, uint32_t a_numPasses = 1);
+  void CastRayPacketBlock(uint32_t a_firstTid, uint32_t a_tidNum, uint32_t* out_color, float* out_depth);
+  void CastRayTileBlock  (uint32_t a_firstTid, uint32_t a_tidNum, uint32_t* out_color, float* out_depth);
 
   void kernel_InitEyeRay(uint32_t tidX, LiteMath::float4* rayPosAndNear, LiteMath::float4* rayDirAndFar);
   void kernel_RayTrace(uint32_t tidX, const LiteMath::float4* rayPosAndNear, const LiteMath::float4* rayDirAndFar, uint32_t* out_color, float* out_depth);
+  void kernel_ShadeHit(uint32_t tidX, const LiteMath::float4* rayPosAndNear, const LiteMath::float4* rayDirAndFar, const CRT_Hit* a_hit, uint32_t* out_color, float* out_depth);
 
   uint32_t m_width;
   uint32_t m_height;
@@ -97,6 +247,22 @@ protected:
   float m_BBoxBound = 0.2;
   float3 m_lightSourcePos = float3(1.f, 1.f, 1.f);
   float3 m_lightSourcePower = float3(1.f, 1.f, 1.f);
+  bool m_lambertShading = false; ///< reference render with Lambert + hard shadows instead of normals, a_what = "lambert"
+  bool m_tiledPrimaryRays = false; ///< see SetTiledPrimaryRays
+  bool m_compactDataset   = false; ///< see SetCompactDataset
+  bool m_activeSampling   = false; ///< see SetActiveSampling
+  bool m_instanceCulling  = false; ///< see SetInstanceCulling
+  uint32_t m_neuralBatchTiles = 0; ///< see SetNeuralTiles
+  NeuralBatch m_neuralBatches[3];
+  NeuralBatch m_neuralWhole;               ///< whole frame buffers of the neural Render
+  NeuralBatch m_hybridBatch;               ///< rays of one leaf in one round of RenderHybrid
+  HybridFrame m_hybridFrame;
+  std::vector<HybridLeaf> m_hybridLeaves;  ///< not empty in the hybrid mode, see TrainHybrid
+  std::vector<int32_t>    m_hybridLeafByNode; ///< TLAS node -> index in m_hybridLeaves, -1 for nodes above the cut
+  NeuralFrame m_neuralFrame = {};
+  bool m_neuralSceneReady  = false;        ///< scene part of m_neuralFrame is valid, reset by scene loading
+  bool m_neuralCameraReady = false;        ///< camera part of m_neuralFrame is valid, reset by scene loading, SetCamera and SetViewport
+  ActiveRaySampler m_activeSampler;
 
   LiteMath::float3 m_camPos, m_camLookAt, m_camUp;
   int m_gltfCamId = -1;
@@ -104,6 +270,9 @@ protected:
   LiteMath::float4x4 m_worldViewInv;
 
   std::shared_ptr<BVH2CommonRT> m_pAccelStruct; 
+  std::string                   m_cacheDir;
+  uint64_t                      m_sceneHash = 0; ///< scene file content and stamps of m_geometryFiles, identifies the scene of dataset shards
+  std::vector<std::string>      m_geometryFiles; ///< meshes or glTF buffers of the loaded scene, collected by the loaders
   //std::shared_ptr<ISceneObject> m_pAccelStruct;
   std::vector<uint32_t>         m_packedXY;
 
@@ -118,6 +287,12 @@ protected:
   };
 
   static constexpr uint32_t BSIZE =8;
+  static constexpr uint32_t RAY_BLOCK_SIZE = 64; ///< one 8x8 super block of m_packedXY, traced as a ray stream
+  static constexpr uint32_t NEURAL_TILE_SIZE    = 32;    ///< pixel tile of the neural render, a unit of work of NeuralGenTile/NeuralShadeTile
+  static constexpr uint32_t RAY_ENDPOINT_FLOATS = 6;     ///< compact ray input, see SetCompactDataset
+  static constexpr size_t   EXPAND_SLICE_RAYS   = 65536; ///< rays expanded to sample positions at once
+  static constexpr size_t   ACTIVE_PROBE_RAYS   = 4096;  ///< rays of a trained chunk evaluated to update the active sampler
+  static constexpr uint32_t MAX_HYBRID_ENTRIES  = 8;     ///< boxes of the TLAS cut evaluated per ray in the hybrid mode
 
   std::unordered_map<std::string, float> timeDataByName;
   mutable std::string m_tempName;
@@ -1,10 +1,18 @@
 #include "nbvh.h"
 #include "render_common.h"
 #include "utils.h"
+#include "dataset_shard.h"
 #include "hydraxml.h"
 #include "loader_utils/gltf_loader.h"
 #include "Timer.h"
 
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+
 using LiteMath::DEG_TO_RAD;
 
 using LiteMath::BBox3f;
@@ -16,29 +24,32 @@ using LiteMath::perspectiveMatrix;
 using LiteMath::lookAt;
 using LiteMath::inverse4x4;
 
-N_BVH::N_BVH() 
+N_BVH::N_BVH(uint32_t a_bvhLayoutFlags) 
 { 
   nn::TensorProcessor::init(nn::TensorProcessor::Backend::GPU);
 
-  m_pAccelStruct = std::make_shared<BVH2CommonRT>();
+  m_pAccelStruct = std::make_shared<BVH2CommonRT>("cbvh_embree2", a_bvhLayoutFlags);
 
-  int L = 8, T = 8*8*8, F = 8, N_min = 4, N_max = 32;
-  int int_size = 64;
+  BuildNetwork(nn, 64);
+}
 
-  nn.set_batch_size_for_evaluate(2048);
-  nn.add_layer(std::make_shared<nn::StackedHashGrid3DLayer>(m_samplesPerRay, L, T, F, N_min, N_max), nn::Initializer::He);
-  nn.add_layer(std::make_shared<nn::DenseLayer>(m_samplesPerRay * L * F, int_size), nn::Initializer::Siren);
-  // nn.add_layer(std::make_shared<nn::DenseLayer>(m_samplesPerRay * 3, 256), nn::Initializer::Siren);
-  nn.add_layer(std::make_shared<nn::ReLULayer>());
-  nn.add_layer(std::make_shared<nn::DenseLayer>(int_size, int_size), nn::Initializer::Siren);
-  nn.add_layer(std::make_shared<nn::ReLULayer>());
-  nn.add_layer(std::make_shared<nn::DenseLayer>(int_size, int_size), nn::Initializer::Siren);
-  nn.add_layer(std::make_shared<nn::ReLULayer>());
-  nn.add_layer(std::make_shared<nn::DenseLayer>(int_size, int_size), nn::Initializer::Siren);
-  nn.add_layer(std::make_shared<nn::ReLULayer>());
-  nn.add_layer(std::make_shared<nn::DenseLayer>(int_size,  m_outputSize), nn::Initializer::Siren);
-  nn.add_layer(std::make_shared<nn::SigmoidLayer>());
+void N_BVH::BuildNetwork(nn::NeuralNetwork& a_net, int int_size) const
+{
+  int L = 8, T = 8*8*8, F = 8, N_min = 4, N_max = 32;
 
+  a_net.set_batch_size_for_evaluate(2048);
+  a_net.add_layer(std::make_shared<nn::StackedHashGrid3DLayer>(m_samplesPerRay, L, T, F, N_min, N_max), nn::Initializer::He);
+  a_net.add_layer(std::make_shared<nn::DenseLayer>(m_samplesPerRay * L * F, int_size), nn::Initializer::Siren);
+  // a_net.add_layer(std::make_shared<nn::DenseLayer>(m_samplesPerRay * 3, 256), nn::Initializer::Siren);
+  a_net.add_layer(std::make_shared<nn::ReLULayer>());
+  a_net.add_layer(std::make_shared<nn::DenseLayer>(int_size, int_size), nn::Initializer::Siren);
+  a_net.add_layer(std::make_shared<nn::ReLULayer>());
+  a_net.add_layer(std::make_shared<nn::DenseLayer>(int_size, int_size), nn::Initializer::Siren);
+  a_net.add_layer(std::make_shared<nn::ReLULayer>());
+  a_net.add_layer(std::make_shared<nn::DenseLayer>(int_size, int_size), nn::Initializer::Siren);
+  a_net.add_layer(std::make_shared<nn::ReLULayer>());
+  a_net.add_layer(std::make_shared<nn::DenseLayer>(int_size,  m_outputSize), nn::Initializer::Siren);
+  a_net.add_layer(std::make_shared<nn::SigmoidLayer>());
 }
 
 void N_BVH::SetViewport(int a_xStart, int a_yStart, int a_width, int a_height)
@@ -46,6 +57,165 @@ void N_BVH::SetViewport(int a_xStart, int a_yStart, int a_width, int a_height)
   m_width  = a_width;
   m_height = a_height;
   m_packedXY.resize(m_width*m_height);
+  m_neuralCameraReady = false;
+}
+
+void N_BVH::SetCamera(const CameraPose& a_pose)
+{
+  m_camPos    = a_pose.pos;
+  m_camLookAt = a_pose.lookAt;
+  m_camUp     = a_pose.up;
+  m_worldViewInv = inverse4x4(lookAt(m_camPos, m_camLookAt, m_camUp));
+  if(a_pose.fov > 0.f)
+    m_projInv = inverse4x4(perspectiveMatrix(a_pose.fov, float(m_width) / float(m_height), 0.01f, 100.0f));
+  m_neuralCameraReady = false;
+}
+
+std::vector<CameraPose> N_BVH::LoadCameraPath(const char* a_path)
+{
+  std::vector<CameraPose> poses;
+  std::ifstream fin(a_path);
+  if(!fin.is_open())
+  {
+    std::cout << "[N_BVH::LoadCameraPath]: can't open '" << a_path << "'" << std::endl;
+    return poses;
+  }
+
+  std::string line;
+  while(std::getline(fin, line))
+  {
+    if(line.empty() || line[0] == '#')
+      continue;
+    std::stringstream strin(line);
+    CameraPose pose;
+    if(!(strin >> pose.pos.x >> pose.pos.y >> pose.pos.z >> pose.lookAt.x >> pose.lookAt.y >> pose.lookAt.z))
+      continue;
+    float3 up;
+    if(strin >> up.x >> up.y >> up.z)
+    {
+      pose.up = up;
+      strin >> pose.fov;
+    }
+    poses.push_back(pose);
+  }
+  return poses;
+}
+
+// scene level data of N_BVH stored in the acceleration structure cache next to BVH data
+//
+struct SceneCacheData
+{
+  LiteMath::Box4f    sceneBBox;
+  LiteMath::float4x4 projInv;
+  LiteMath::float4x4 worldViewInv;
+  LiteMath::float3   camPos, camLookAt, camUp;
+  uint64_t           totalTris;
+  uint64_t           totalTrisVisiable;
+  int                gltfCamId;
+  uint64_t           geometryHash;      ///< stamps of geometry files, their '\0' terminated paths follow the struct
+};
+
+static bool ReadFileContent(const std::string& a_path, std::string* a_content)
+{
+  std::ifstream fin(a_path, std::ios::binary);
+  if(!fin.is_open())
+    return false;
+  a_content->assign((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+  return true;
+}
+
+// path, size and modification time of a geometry file; its content is not read, meshes and buffers may be large,
+// so a scene is identified by the content of the scene file and by stamps of the geometry files it refers to
+static uint64_t HashFileStamp(const std::string& a_path, uint64_t a_hash)
+{
+  std::error_code error;
+  const uint64_t size  = uint64_t(std::filesystem::file_size(a_path, error));
+  const int64_t  mtime = error ? 0 : int64_t(std::filesystem::last_write_time(a_path, error).time_since_epoch().count());
+  a_hash = hashFNV1a(a_path.data(), a_path.size(), a_hash);
+  a_hash = hashFNV1a(&size,  sizeof(size),  a_hash);
+  a_hash = hashFNV1a(&mtime, sizeof(mtime), a_hash);
+  return a_hash;
+}
+
+static uint64_t HashGeometryFiles(const std::vector<std::string>& a_files, uint64_t a_hash)
+{
+  for(const auto& file : a_files)
+    a_hash = HashFileStamp(file, a_hash);
+  return a_hash;
+}
+
+static bool HashSceneFile(const std::string& a_path, uint64_t* a_hash)
+{
+  std::string content;
+  if(!ReadFileContent(a_path, &content))
+    return false;
+  (*a_hash) = hashFNV1a(content.data(), content.size());
+  return true;
+}
+
+bool N_BVH::LoadSceneCache(const std::string& a_cachePath, uint64_t a_sceneHash)
+{
+  std::vector<uint8_t> userData;
+  if(!m_pAccelStruct->LoadCache(a_cachePath.c_str(), a_sceneHash, &userData) || userData.size() < sizeof(SceneCacheData))
+    return false;
+
+  SceneCacheData data;
+  std::memcpy(&data, userData.data(), sizeof(SceneCacheData));
+
+  // the key covers the scene file only, geometry files it refers to are checked by their stamps
+  //
+  std::vector<std::string> geometryFiles;
+  for(size_t pos = sizeof(SceneCacheData); pos < userData.size(); )
+  {
+    const char* begin = reinterpret_cast<const char*>(userData.data() + pos);
+    const char* end   = static_cast<const char*>(std::memchr(begin, 0, userData.size() - pos));
+    if(end == nullptr)
+      return false;
+    geometryFiles.emplace_back(begin, end);
+    pos += geometryFiles.back().size() + 1;
+  }
+  if(HashGeometryFiles(geometryFiles, 0) != data.geometryHash)
+  {
+    std::cout << "[LoadScene]: cache '" << a_cachePath.c_str() << "' is outdated, geometry files have changed" << std::endl;
+    return false;
+  }
+
+  m_geometryFiles     = std::move(geometryFiles);
+  m_sceneBBox         = data.sceneBBox;
+  m_projInv           = data.projInv;
+  m_worldViewInv      = data.worldViewInv;
+  m_camPos            = data.camPos;
+  m_camLookAt         = data.camLookAt;
+  m_camUp             = data.camUp;
+  m_totalTris         = data.totalTris;
+  m_totalTrisVisiable = data.totalTrisVisiable;
+  m_gltfCamId         = data.gltfCamId;
+
+  std::cout << "[LoadScene]: loaded from cache '" << a_cachePath.c_str() << "'" << std::endl;
+  return true;
+}
+
+void N_BVH::SaveSceneCache(const std::string& a_cachePath, uint64_t a_sceneHash) const
+{
+  SceneCacheData data;
+  data.sceneBBox         = m_sceneBBox;
+  data.projInv           = m_projInv;
+  data.worldViewInv      = m_worldViewInv;
+  data.camPos            = m_camPos;
+  data.camLookAt         = m_camLookAt;
+  data.camUp             = m_camUp;
+  data.totalTris         = m_totalTris;
+  data.totalTrisVisiable = m_totalTrisVisiable;
+  data.gltfCamId         = m_gltfCamId;
+  data.geometryHash      = HashGeometryFiles(m_geometryFiles, 0);
+
+  std::vector<uint8_t> userData(sizeof(data));
+  std::memcpy(userData.data(), &data, sizeof(data));
+  for(const auto& file : m_geometryFiles)
+    userData.insert(userData.end(), file.c_str(), file.c_str() + file.size() + 1);
+
+  if(m_pAccelStruct->SaveCache(a_cachePath.c_str(), a_sceneHash, userData.data(), userData.size()))
+    std::cout << "[LoadScene]: saved cache '" << a_cachePath.c_str() << "'" << std::endl;
 }
 
 #if defined(__ANDROID__)
@@ -55,29 +225,62 @@ bool N_BVH::LoadScene(const char* a_scenePath)
 #endif
 {
   m_pAccelStruct->ClearGeom();
+  m_neuralSceneReady  = false;
+  m_neuralCameraReady = false;
+  m_hybridLeaves.clear();
 
   const std::string& path = a_scenePath;
 
+  // (1) try built acceleration structure from cache, it is keyed by scene file content, viewport and BVH settings
+  //     and keeps stamps of the geometry files; projection matrix depends on viewport aspect, so it is a part of the key too
+  //
+  std::string cachePath;
+  uint64_t    sceneHash     = 0;
+  uint64_t    sceneFileHash = 0;
+  m_sceneHash = 0;
+  m_geometryFiles.clear();
+  if(HashSceneFile(path, &sceneFileHash) && !m_cacheDir.empty())
+  {
+    sceneHash = hashFNV1a(&m_width,  sizeof(m_width),  sceneFileHash);
+    sceneHash = hashFNV1a(&m_height, sizeof(m_height), sceneHash);
+
+    std::stringstream strout;
+    strout << m_cacheDir << "/" << std::hex << m_pAccelStruct->CacheKey(sceneHash) << ".bvhcache";
+    cachePath = strout.str();
+    if(LoadSceneCache(cachePath, sceneHash))
+    {
+      m_sceneHash = HashGeometryFiles(m_geometryFiles, sceneFileHash);
+      return true;
+    }
+  }
+
+  // (2) load and build scene
+  //
   auto isHydraScene = gltf_loader::ends_with(path, ".xml");
 
+  bool loaded = false;
   if(isHydraScene)
   {
 #if defined(__ANDROID__)
-    return LoadSceneHydra(path, assetManager);
+    loaded = LoadSceneHydra(path, assetManager);
 #else
-    return LoadSceneHydra(path);
+    loaded = LoadSceneHydra(path);
 #endif
   }
   else
   {
 #if defined(__ANDROID__)
-    return LoadSceneGLTF(path, assetManager);
+    loaded = LoadSceneGLTF(path, assetManager);
 #else
-    return LoadSceneGLTF(path);
+    loaded = LoadSceneGLTF(path);
 #endif
   }
 
-  return false;
+  m_sceneHash = HashGeometryFiles(m_geometryFiles, sceneFileHash);
+  if(loaded && !cachePath.empty())
+    SaveSceneCache(cachePath, sceneHash);
+
+  return loaded;
 }
 
 #ifdef __ANDROID__
@@ -116,21 +319,27 @@ scene.LoadState(a_path) < 0
   m_totalTris = 0;
   m_pAccelStruct->ClearGeom();
 
+  // load all meshes first, then build their BVHs in parallel
+  //
+  std::vector<cmesh4::SimpleMesh> meshes;
   for(auto meshPath : scene.MeshFiles())
   {
     std::cout << "[LoadScene]: mesh = " << meshPath.c_str() << std::endl;
+    m_geometryFiles.push_back(meshPath);
 #if defined(__ANDROID__)
-    auto currMesh = cmes4h::LoadMeshFromVSGF(assetManager, meshPath.c_str());
+    meshes.push_back(cmes4h::LoadMeshFromVSGF(assetManager, meshPath.c_str()));
 #else
-    auto currMesh = cmesh4::LoadMeshFromVSGF(meshPath.c_str());
+    meshes.push_back(cmesh4::LoadMeshFromVSGF(meshPath.c_str()));
 #endif
-    auto geomId   = m_pAccelStruct->AddGeom_Triangles3f((const float*)currMesh.vPos4f.data(), currMesh.vPos4f.size(),
-                                                        currMesh.indices.data(), currMesh.indices.size(), BUILD_HIGH, sizeof(float)*4);
-    (void)geomId; // silence "unused variable" compiler warnings
-    m_totalTris += currMesh.indices.size()/3;
-    trisPerObject.push_back(currMesh.indices.size()/3);
+    m_totalTris += meshes.back().indices.size()/3;
+    trisPerObject.push_back(meshes.back().indices.size()/3);
   }
 
+  std::vector<GeomTriangles3f> geoms(meshes.size());
+  for(size_t i = 0; i < meshes.size(); ++i)
+    geoms[i] = {(const float*)meshes[i].vPos4f.data(), meshes[i].vPos4f.size(), meshes[i].indices.data(), meshes[i].indices.size(), sizeof(float)*4};
+  m_pAccelStruct->AddGeomBatch_Triangles3f(geoms.data(), geoms.size(), BUILD_HIGH);
+
   LiteMath::Box4f BBox = {};
   for (uint32_t i = 0; i < m_pAccelStruct->GetGeomNum(); ++i)
   {
@@ -162,9 +371,11 @@ scene.LoadState(a_path) < 0
 struct DataRefs
 {
   DataRefs(std::unordered_map<int, std::pair<uint32_t, BBox3f>> &a_loadedMeshesToMeshId, std::vector<uint64_t>& a_trisPerObject, Box4f& a_sceneBBox,
-           int& a_gltfCam, float4x4& a_worldViewInv, std::shared_ptr<ISceneObject> a_pAccelStruct, uint64_t& a_totalTris) : 
+           int& a_gltfCam, float4x4& a_worldViewInv, uint64_t& a_totalTris, std::vector<cmesh4::SimpleMesh>& a_pendingMeshes, 
+           std::vector<std::pair<uint32_t, float4x4>>& a_pendingInstances, uint32_t a_firstGeomId) : 
            m_loadedMeshesToMeshId(a_loadedMeshesToMeshId), m_trisPerObject(a_trisPerObject), m_sceneBBox(a_sceneBBox),
-           m_gltfCamId(a_gltfCam), m_worldViewInv(a_worldViewInv), m_pAccelStruct(a_pAccelStruct), m_totalTris(a_totalTris) {}
+           m_gltfCamId(a_gltfCam), m_worldViewInv(a_worldViewInv), m_totalTris(a_totalTris), m_pendingMeshes(a_pendingMeshes), 
+           m_pendingInstances(a_pendingInstances), m_firstGeomId(a_firstGeomId) {}
 
   
   std::unordered_map<int, std::pair<uint32_t, BBox3f>>& m_loadedMeshesToMeshId;
@@ -173,8 +384,14 @@ struct DataRefs
 
   int&                          m_gltfCamId;
   float4x4&                     m_worldViewInv;
-  std::shared_ptr<ISceneObject> m_pAccelStruct;
   uint64_t&                     m_totalTris;
+
+  // meshes and instances are only collected during traversal of the nodes and added to the accel struct after it,
+  // so that BVHs of all meshes are built together
+  //
+  std::vector<cmesh4::SimpleMesh>&            m_pendingMeshes;
+  std::vector<std::pair<uint32_t, float4x4>>& m_pendingInstances;
+  uint32_t                                    m_firstGeomId;
 };
 
 static void LoadGLTFNodesRecursive(const tinygltf::Model &a_model, const tinygltf::Node& a_node, const LiteMath::float4x4& a_parentMatrix, 
@@ -205,15 +422,14 @@ static void LoadGLTFNodesRecursive(const tinygltf::Model &a_model, const tinyglt
 
       if(simpleMesh.VerticesNum() > 0)
       {
-        auto meshId = a_refs.m_pAccelStruct->AddGeom_Triangles3f((const float*)simpleMesh.vPos4f.data(), simpleMesh.vPos4f.size(),
-                                                                simpleMesh.indices.data(), simpleMesh.indices.size(),
-                                                                BUILD_HIGH, sizeof(float)*4);
+        auto meshId = a_refs.m_firstGeomId + uint32_t(a_refs.m_pendingMeshes.size());
         a_refs.m_loadedMeshesToMeshId[a_node.mesh] = {meshId, simpleMesh.bbox};
 
         std::cout << "Loading mesh # " << meshId << std::endl;
 
         a_refs.m_totalTris += simpleMesh.indices.size() / 3;
         a_refs.m_trisPerObject.push_back(simpleMesh.indices.size() / 3);
+        a_refs.m_pendingMeshes.push_back(std::move(simpleMesh));
       }
     }
     auto tmp_box = a_refs.m_loadedMeshesToMeshId[a_node.mesh].second;
@@ -225,7 +441,7 @@ static void LoadGLTFNodesRecursive(const tinygltf::Model &a_model, const tinyglt
     inst_box.boxMax = nodeMatrix * mesh_box.boxMax;
 
     a_refs.m_sceneBBox.include(inst_box);
-    a_refs.m_pAccelStruct->AddInstance(a_refs.m_loadedMeshesToMeshId[a_node.mesh].first, nodeMatrix);
+    a_refs.m_pendingInstances.push_back({a_refs.m_loadedMeshesToMeshId[a_node.mesh].first, nodeMatrix});
   }
 }
 
@@ -254,6 +470,14 @@ bool N_BVH::LoadSceneGLTF(const std::string& a_path)
 
   const tinygltf::Scene& scene = gltfModel.scenes[0];
 
+  // external buffers hold the geometry, embedded ones are a part of the scene file
+  const std::filesystem::path sceneDir = std::filesystem::path(a_path).parent_path();
+  for(const auto& buffer : gltfModel.buffers)
+  {
+    if(!buffer.uri.empty() && buffer.uri.compare(0, 5, "data:") != 0)
+      m_geometryFiles.push_back((sceneDir / buffer.uri).string());
+  }
+
   float aspect   = float(m_width) / float(m_height);
   for(size_t i = 0; i < gltfModel.cameras.size(); ++i)
   {
@@ -284,14 +508,26 @@ bool N_BVH::LoadSceneGLTF(const std::string& a_path)
 
   m_sceneBBox = {};
   std::unordered_map<int, std::pair<uint32_t, BBox3f>> loaded_meshes_to_meshId;
+  std::vector<cmesh4::SimpleMesh>                      pending_meshes;
+  std::vector<std::pair<uint32_t, float4x4>>           pending_instances;
   for(size_t i = 0; i < scene.nodes.size(); ++i)
   {
     const tinygltf::Node node = gltfModel.nodes[scene.nodes[i]];
     auto identity = LiteMath::float4x4();
     LoadGLTFNodesRecursive(gltfModel, node, identity, 
-                           DataRefs(loaded_meshes_to_meshId, trisPerObject, m_sceneBBox, m_gltfCamId, m_worldViewInv, m_pAccelStruct, m_totalTris));
+                           DataRefs(loaded_meshes_to_meshId, trisPerObject, m_sceneBBox, m_gltfCamId, m_worldViewInv, m_totalTris,
+                                    pending_meshes, pending_instances, m_pAccelStruct->GetGeomNum()));
   }
 
+  std::vector<GeomTriangles3f> geoms(pending_meshes.size());
+  for(size_t i = 0; i < pending_meshes.size(); ++i)
+    geoms[i] = {(const float*)pending_meshes[i].vPos4f.data(), pending_meshes[i].vPos4f.size(), 
+                pending_meshes[i].indices.data(), pending_meshes[i].indices.size(), sizeof(float)*4};
+  m_pAccelStruct->AddGeomBatch_Triangles3f(geoms.data(), geoms.size(), BUILD_HIGH);
+
+  for(const auto& inst : pending_instances)
+    m_pAccelStruct->AddInstance(inst.first, inst.second);
+
   // glTF scene can have no cameras specified
   if(m_gltfCamId == -1)
   {
@@ -319,6 +555,14 @@ bool N_BVH::LoadSingleMesh(const char* a_meshPath, const float* transform4x4ColM
 #endif
 {
   m_pAccelStruct->ClearGeom();
+  m_neuralSceneReady  = false;
+  m_neuralCameraReady = false;
+  m_hybridLeaves.clear();
+
+  // the mesh and its transform define the scene for dataset shards, the mesh is identified by its stamp as in LoadScene
+  m_geometryFiles = {a_meshPath};
+  m_sceneHash     = (transform4x4ColMajor != nullptr) ? hashFNV1a(transform4x4ColMajor, sizeof(float)*16) : 0;
+  m_sceneHash     = HashGeometryFiles(m_geometryFiles, m_sceneHash);
 
   std::cout << "[LoadScene]: mesh = " << a_meshPath << std::endl;
 #if defined(__ANDROID__)
@@ -362,107 +606,470 @@ bool N_BVH::LoadSingleMesh(const char* a_meshPath, const float* transform4x4ColM
 ////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////NEURAL//PART//////////////////////////////////////////
 
-void N_BVH::GenRayBBoxDataset(std::vector<float>& inputData, std::vector<float>& outputData, uint32_t points)
+BBox3f N_BVH::DatasetBBox() const
 {
-  inputData.resize(points * m_raysPerPoint * m_samplesPerRay * 3);
-  outputData.resize(points * m_raysPerPoint * m_outputSize);
-
   BBox3f BBox;
   BBox.boxMax = float3(m_sceneBBox.boxMax.x, m_sceneBBox.boxMax.y, m_sceneBBox.boxMax.z);
   BBox.boxMin = float3(m_sceneBBox.boxMin.x, m_sceneBBox.boxMin.y, m_sceneBBox.boxMin.z);
   float3 BBoxSize = BBox.boxMax - BBox.boxMin;
   BBox.boxMax = BBox.boxMax + BBoxSize * m_BBoxBound;
   BBox.boxMin = BBox.boxMin - BBoxSize * m_BBoxBound;
-  BBoxSize = BBox.boxMax - BBox.boxMin;
+  return BBox;
+}
 
-  for (uint32_t i = 0; i < points; ++i)
+void N_BVH::GenRayBBoxPoint(const BBox3f& BBox, uint64_t a_pointId, uint64_t a_seed, float* a_input, float* a_output,
+                            const ActiveSamplerSnapshot* a_distribution, float* a_sampledPoints)
+{
+  const float3 BBoxSize = BBox.boxMax - BBox.boxMin;
+  RandomGen gen = randomInit(a_seed, a_pointId);
+
+  float3 point1 = (a_distribution != nullptr) ? a_distribution->SamplePoint(BBox, gen) : sampleUniformBBox(BBox, gen);
+  float3 point2 = (a_distribution != nullptr) ? a_distribution->SamplePoint(BBox, gen) : sampleUniformBBox(BBox, gen);
+  float3 hitPoint;
+  bool hitFlag = false;
+
+  // the active sampler records statistics into the cells the points were drawn from, not into cells of the chord ends
+  //
+  if (a_sampledPoints != nullptr)
   {
-    float3 point1 = sampleUniformBBox(BBox);
-    float3 point2 = sampleUniformBBox(BBox);
-    float3 hitPoint;
-    bool hitFlag = false;
+    const float3 local1 = (point1 - BBox.boxMin) / BBoxSize;
+    const float3 local2 = (point2 - BBox.boxMin) / BBoxSize;
+    a_sampledPoints[0] = local1.x; a_sampledPoints[1] = local1.y; a_sampledPoints[2] = local1.z;
+    a_sampledPoints[3] = local2.x; a_sampledPoints[4] = local2.y; a_sampledPoints[5] = local2.z;
+  }
 
-    for (uint32_t r = 0; r < m_raysPerPoint; ++r)
+  for (uint32_t r = 0; r < m_raysPerPoint; ++r)
+  {
+    if (hitFlag)
     {
-      if (hitFlag)
-      {
-        point1 = point1 + sampleUnitSphere() * length(point1 - hitPoint) * 0.1;
-        point2 = hitPoint;
-      }
-      auto dir = point2 - point1;
-      auto hitBBox = BBox.Intersection(point1, 1.f / dir, -INFINITY, +INFINITY);
+      point1 = point1 + sampleUnitSphere(gen) * length(point1 - hitPoint) * 0.1;
+      point2 = hitPoint;
+    }
+    auto dir = point2 - point1;
+    auto hitBBox = BBox.Intersection(point1, 1.f / dir, -INFINITY, +INFINITY);
 
-      auto hitBBoxPoint1 = point1 + dir * hitBBox.t1;
-      auto hitBBoxPoint2 = point1 + dir * hitBBox.t2;
+    auto hitBBoxPoint1 = point1 + dir * hitBBox.t1;
+    auto hitBBoxPoint2 = point1 + dir * hitBBox.t2;
 
-      auto rayDir_   = hitBBoxPoint2 - hitBBoxPoint1;
-      float4 rayDir  = float4(rayDir_.x, rayDir_.y, rayDir_.z, MAXFLOAT);
-      float4 rayOrig = float4(hitBBoxPoint1.x, hitBBoxPoint1.y, hitBBoxPoint1.z, 0.f);
+    auto rayDir_   = hitBBoxPoint2 - hitBBoxPoint1;
+    float4 rayDir  = float4(rayDir_.x, rayDir_.y, rayDir_.z, 1.f); // only the chord, BBox may be a part of the scene
+    float4 rayOrig = float4(hitBBoxPoint1.x, hitBBoxPoint1.y, hitBBoxPoint1.z, 0.f);
 
-      auto step = rayDir_ / static_cast<float>(m_samplesPerRay + 1);
-      for (uint32_t j = 0; j < m_samplesPerRay; ++j)
-      {
-        float3 sample = hitBBoxPoint1 + step * (j + 1);
-        sample = (sample - BBox.boxMin) / BBoxSize;
+    PutRayInput((hitBBoxPoint1 - BBox.boxMin) / BBoxSize, (hitBBoxPoint2 - BBox.boxMin) / BBoxSize, a_input + r * InputFloatsPerRay());
 
-        //positional_encoding(sample, inputData.data() + (i * m_samplesPerRay + j) * 3 * (ENCODE_LENGTH * 2 + 1));
-        inputData[((i * m_raysPerPoint + r) * m_samplesPerRay + j) * 3 + 0] = sample.x;
-        inputData[((i * m_raysPerPoint + r) * m_samplesPerRay + j) * 3 + 1] = sample.y;
-        inputData[((i * m_raysPerPoint + r) * m_samplesPerRay + j) * 3 + 2] = sample.z;
-      }
+    auto hitObj   = m_pAccelStruct->RayQuery_NearestHit(rayOrig, rayDir);
 
-      auto hitObj   = m_pAccelStruct->RayQuery_NearestHit(rayOrig, rayDir);
+    if (hitObj.primId != uint32_t(-1))
+    {
+      hitPoint = (hitBBoxPoint1 + rayDir_ * hitObj.t - BBox.boxMin) / BBoxSize;
+      hitFlag = true;
+      // visibility
+      a_output[r * m_outputSize + 0] = 1.f;
 
-      if (hitObj.primId != uint32_t(-1))
-      {
-        hitPoint = (hitBBoxPoint1 + rayDir_ * hitObj.t - BBox.boxMin) / BBoxSize;
-        hitFlag = true;
-        // visibility
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 0] = 1.f;
+      // surface position (depth)
 
-        // surface position (depth)
+      // local depth approach:
+      //float k = static_cast<float>(m_samplesPerRay);
+      //a_output[r * m_outputSize + 1] = (hitObj.t * (k + 1.f) - 1.f) / (k - 1.f); // distance related to sampled points
 
-        // local depth approach:
-        //float k = static_cast<float>(m_samplesPerRay);
-        //outputData[i * m_outputSize + 1] = (hitObj.t * (k + 1.f) - 1.f) / (k - 1.f); // distance related to sampled points
+      // global coords approach:
+      a_output[r * m_outputSize + 1] = hitPoint.x;
+      a_output[r * m_outputSize + 2] = hitPoint.y;
+      a_output[r * m_outputSize + 3] = hitPoint.z;
 
-        // global coords approach:
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 1] = hitPoint.x;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 2] = hitPoint.y;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 3] = hitPoint.z;
+      // surface normal
 
-        // surface normal
+      uint32_t normalPacked = *reinterpret_cast<uint32_t*>(&hitObj.coords[2]);
+      float3 normal = (unpackNormal(normalPacked) + 1.f) * 0.5f;
 
-        uint32_t normalPacked = *reinterpret_cast<uint32_t*>(&hitObj.coords[2]);
-        float3 normal = (unpackNormal(normalPacked) + 1.f) * 0.5f;
+      //std::cout << normal.x << " " << normal.y << " " << normal.z << std::endl;
 
-        //std::cout << normal.x << " " << normal.y << " " << normal.z << std::endl;
+      a_output[r * m_outputSize + 4] = normal.x;
+      a_output[r * m_outputSize + 5] = normal.y;
+      a_output[r * m_outputSize + 6] = normal.z;
+    }
+    else
+    {
+      a_output[r * m_outputSize + 0] = 0.f;
+      a_output[r * m_outputSize + 1] = 0.f;
+      a_output[r * m_outputSize + 2] = 0.f;
+      a_output[r * m_outputSize + 3] = 0.f;
+      a_output[r * m_outputSize + 4] = 0.f;
+      a_output[r * m_outputSize + 5] = 0.f;
+      a_output[r * m_outputSize + 6] = 0.f;
+    }
+  }
+}
 
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 4] = normal.x;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 5] = normal.y;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 6] = normal.z;
-      }
-      else
-      {
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 0] = 0.f;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 1] = 0.f;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 2] = 0.f;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 3] = 0.f;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 4] = 0.f;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 5] = 0.f;
-        outputData[(i * m_raysPerPoint + r) * m_outputSize + 6] = 0.f;
-      }
+void N_BVH::PutRayInput(float3 a_begin, float3 a_end, float* a_input) const
+{
+  if (m_compactDataset)
+  {
+    a_input[0] = a_begin.x; a_input[1] = a_begin.y; a_input[2] = a_begin.z;
+    a_input[3] = a_end.x;   a_input[4] = a_end.y;   a_input[5] = a_end.z;
+    return;
+  }
+
+  const float3 step = (a_end - a_begin) / static_cast<float>(m_samplesPerRay + 1);
+  for (uint32_t j = 0; j < m_samplesPerRay; ++j)
+  {
+    const float3 sample = a_begin + step * float(j + 1);
+    //positional_encoding(sample, a_input + j * 3 * (ENCODE_LENGTH * 2 + 1));
+    a_input[j * 3 + 0] = sample.x;
+    a_input[j * 3 + 1] = sample.y;
+    a_input[j * 3 + 2] = sample.z;
+  }
+}
+
+void N_BVH::ExpandRaySamples(const float* a_endpoints, size_t a_raysNum, float* a_samples) const
+{
+  for (size_t rayId = 0; rayId < a_raysNum; rayId++)
+  {
+    const float* ends    = a_endpoints + rayId * RAY_ENDPOINT_FLOATS;
+    float*       samples = a_samples   + rayId * m_samplesPerRay * 3;
+    const float3 begin   = float3(ends[0], ends[1], ends[2]);
+    const float3 step    = (float3(ends[3], ends[4], ends[5]) - begin) / static_cast<float>(m_samplesPerRay + 1);
+    for (uint32_t j = 0; j < m_samplesPerRay; ++j)
+    {
+      const float3 sample = begin + step * float(j + 1);
+      samples[j * 3 + 0] = sample.x;
+      samples[j * 3 + 1] = sample.y;
+      samples[j * 3 + 2] = sample.z;
     }
+  }
+}
+
+float N_BVH::TrainOnRays(nn::NeuralNetwork& a_net, float* a_input, float* a_output, size_t a_raysNum, bool a_compact, bool a_verbose)
+{
+  if (!a_compact)
+  {
+    nn::TrainStatistics stats;
+    a_net.continue_train(a_input, a_output, &stats, int(a_raysNum), 5000, 2, false, nn::OptimizerAdam(0.003f), nn::Loss::NBVH, nn::Metric::Accuracy, a_verbose);
+    return stats.avg_loss;
+  }
+
+  // the trainer takes sample positions, so compact rays are expanded by slices into one scratch buffer
+  //
+  std::vector<float> samples(std::min(a_raysNum, EXPAND_SLICE_RAYS) * m_samplesPerRay * 3);
+  float  lossSum   = 0.f;
+  size_t slicesNum = 0;
+  for (size_t first = 0; first < a_raysNum; first += EXPAND_SLICE_RAYS, slicesNum++)
+  {
+    const size_t raysNum = std::min(EXPAND_SLICE_RAYS, a_raysNum - first);
+    ExpandRaySamples(a_input + first * RAY_ENDPOINT_FLOATS, raysNum, samples.data());
+    nn::TrainStatistics stats;
+    a_net.continue_train(samples.data(), a_output + first * m_outputSize, &stats, int(raysNum), 5000, 2, false, nn::OptimizerAdam(0.003f), nn::Loss::NBVH, nn::Metric::Accuracy, a_verbose);
+    lossSum += stats.avg_loss;
+  }
+  return slicesNum > 0 ? lossSum / float(slicesNum) : 0.f;
+}
+
+void N_BVH::GenRayBBoxRange(const BBox3f& BBox, uint64_t a_firstPoint, uint32_t a_points, uint64_t a_seed, float* a_input, float* a_output,
+                            const ActiveSamplerSnapshot* a_distribution, float* a_sampledPoints)
+{
+  // every point has its own random stream and output slots, so the dataset does not depend on the number of threads
+  //
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < int(a_points); ++i)
+    GenRayBBoxPoint(BBox, a_firstPoint + uint64_t(i), a_seed, a_input  + size_t(i) * m_raysPerPoint * InputFloatsPerRay(),
+                                                             a_output + size_t(i) * m_raysPerPoint * m_outputSize, a_distribution,
+                                                             a_sampledPoints != nullptr ? a_sampledPoints + size_t(i) * RAY_ENDPOINT_FLOATS : nullptr);
+}
 
+void N_BVH::GenRayBBoxDataset(std::vector<float>& inputData, std::vector<float>& outputData, uint32_t points, uint64_t a_seed)
+{
+  inputData.resize(size_t(points) * m_raysPerPoint * InputFloatsPerRay());
+  outputData.resize(points * m_raysPerPoint * m_outputSize);
+
+  if (m_activeSampling)
+  {
+    // only TrainNetworkStreaming records training rays, so without a streaming run before the distribution is uniform
+    //
+    const ActiveSamplerSnapshot distribution = m_activeSampler.MakeSnapshot();
+    if (distribution.cdf.empty())
+      std::cout << "[N_BVH::GenRayBBoxDataset]: WARNING! active sampler has no statistics yet, points are uniform; "
+                << "only TrainNetworkStreaming adapts the distribution" << std::endl;
+    GenRayBBoxRange(DatasetBBox(), 0, points, a_seed, inputData.data(), outputData.data(), &distribution);
   }
+  else
+    GenRayBBoxRange(DatasetBBox(), 0, points, a_seed, inputData.data(), outputData.data());
+}
+
+void N_BVH::SetActiveSampling(bool a_enable, float a_hitShare, float a_uniformShare, uint32_t a_gridSize)
+{
+  m_activeSampling = a_enable;
+  if (a_enable)
+    m_activeSampler.Init(a_gridSize, a_uniformShare, a_hitShare);
+}
+
+void N_BVH::RecordActiveSampler(const float* a_input, const float* a_output, const float* a_sampledPoints, uint32_t a_points, bool a_compact)
+{
+  // the first ray of a point goes through both sampled points, the others are built around its hit, so only it is probed
+  //
+  const size_t probesNum   = std::min(size_t(a_points), ACTIVE_PROBE_RAYS);
+  const size_t probeStride = (probesNum > 0) ? a_points / probesNum : 1;
+  const size_t inputFloats = a_compact ? RAY_ENDPOINT_FLOATS : size_t(m_samplesPerRay) * 3;
+  const size_t pointRays   = m_raysPerPoint;
+
+  // (1) chord ends of probe rays; expanded samples are evenly spaced, so the ends are one step outside the first and the last sample
+  //
+  std::vector<float3> ends(probesNum * 2);
+  std::vector<float>  samples(probesNum * m_samplesPerRay * 3), predicted(probesNum * m_outputSize);
+  for (size_t probeId = 0; probeId < probesNum; probeId++)
+  {
+    const float* input = a_input + probeId * probeStride * pointRays * inputFloats;
+    if (a_compact)
+    {
+      ends[probeId * 2 + 0] = float3(input[0], input[1], input[2]);
+      ends[probeId * 2 + 1] = float3(input[3], input[4], input[5]);
+    }
+    else
+    {
+      const float3 first = float3(input[0], input[1], input[2]);
+      const float3 last  = float3(input[(m_samplesPerRay - 1) * 3 + 0], input[(m_samplesPerRay - 1) * 3 + 1], input[(m_samplesPerRay - 1) * 3 + 2]);
+      const float3 step  = (m_samplesPerRay > 1) ? (last - first) / float(m_samplesPerRay - 1) : float3(0.f, 0.f, 0.f);
+      ends[probeId * 2 + 0] = first - step;
+      ends[probeId * 2 + 1] = last  + step;
+    }
+    const float ray[RAY_ENDPOINT_FLOATS] = {ends[probeId * 2].x,     ends[probeId * 2].y,     ends[probeId * 2].z,
+                                            ends[probeId * 2 + 1].x, ends[probeId * 2 + 1].y, ends[probeId * 2 + 1].z};
+    ExpandRaySamples(ray, 1, samples.data() + probeId * m_samplesPerRay * 3);
+  }
+
+  // (2) error of the current network: visibility mismatch plus distance to the true hit point in normalized box coordinates
+  //
+  nn.evaluate(samples, predicted);
+
+  m_activeSampler.Decay(0.5f);
+  for (size_t probeId = 0; probeId < probesNum; probeId++)
+  {
+    const float* truth  = a_output + probeId * probeStride * pointRays * m_outputSize;
+    const float* pred   = predicted.data() + probeId * m_outputSize;
+    const float* points = a_sampledPoints + probeId * probeStride * RAY_ENDPOINT_FLOATS;
+    const bool   hit    = truth[0] > 0.5f;
+    float error = std::fabs(pred[0] - truth[0]);
+    if (hit)
+      error += length(float3(pred[1], pred[2], pred[3]) - float3(truth[1], truth[2], truth[3]));
+    m_activeSampler.Record(float3(points[0], points[1], points[2]), float3(points[3], points[4], points[5]), hit, error);
+  }
+}
+
+bool N_BVH::ShardFitsScene(const DatasetShardHeader& a_header) const
+{
+  const BBox3f BBox = DatasetBBox();
+  return a_header.sceneHash     == m_sceneHash     && a_header.samplesPerRay == m_samplesPerRay &&
+         a_header.raysPerPoint  == m_raysPerPoint  && a_header.outputSize    == m_outputSize    &&
+         a_header.bboxMin[0] == BBox.boxMin.x && a_header.bboxMin[1] == BBox.boxMin.y && a_header.bboxMin[2] == BBox.boxMin.z &&
+         a_header.bboxMax[0] == BBox.boxMax.x && a_header.bboxMax[1] == BBox.boxMax.y && a_header.bboxMax[2] == BBox.boxMax.z;
+}
+
+std::vector<std::string> N_BVH::GenRayBBoxShards(const char* a_dir, uint64_t a_firstShard, uint64_t a_shardsNum, uint32_t a_shardPoints, uint64_t a_seed)
+{
+  const BBox3f   BBox        = DatasetBBox();
+  const uint32_t chunkPoints = std::min<uint32_t>(a_shardPoints, 65536);
+
+  DatasetShardHeader header = MakeDatasetShardHeader();
+  header.samplesPerRay = m_samplesPerRay;
+  header.raysPerPoint  = m_raysPerPoint;
+  header.outputSize    = m_outputSize;
+  header.compact       = m_compactDataset ? 1 : 0;
+  header.sceneHash     = m_sceneHash;
+  header.seed          = a_seed;
+  header.bboxMin[0] = BBox.boxMin.x; header.bboxMin[1] = BBox.boxMin.y; header.bboxMin[2] = BBox.boxMin.z;
+  header.bboxMax[0] = BBox.boxMax.x; header.bboxMax[1] = BBox.boxMax.y; header.bboxMax[2] = BBox.boxMax.z;
+
+  std::vector<float> chunkInput (size_t(chunkPoints) * m_raysPerPoint * InputFloatsPerRay());
+  std::vector<float> chunkOutput(size_t(chunkPoints) * m_raysPerPoint * m_outputSize);
+
+  std::vector<std::string> paths;
+  for (uint64_t shardId = a_firstShard; shardId < a_firstShard + a_shardsNum; shardId++)
+  {
+    const std::string path = DatasetShardPath(a_dir, m_sceneHash, a_seed, shardId);
+    header.firstPoint = shardId * a_shardPoints;
+
+    // (1) a complete shard of the same dataset is already there, e.g. from another machine
+    //
+    DatasetShardReader existing;
+    if (existing.Open(path.c_str()) && ShardFitsScene(existing.Header()) && existing.Header().seed == a_seed && existing.Header().compact == header.compact &&
+        existing.Header().firstPoint == header.firstPoint && existing.Header().pointsNum == a_shardPoints)
+    {
+      paths.push_back(path);
+      continue;
+    }
+    existing.Close();
+
+    // (2) generate shard by chunks, only one chunk is kept in memory
+    //
+    DatasetShardWriter writer;
+    bool ok = writer.Open(path.c_str(), header, a_shardPoints);
+    for (uint32_t done = 0; ok && done < a_shardPoints; done += chunkPoints)
+    {
+      const uint32_t points = std::min(chunkPoints, a_shardPoints - done);
+      GenRayBBoxRange(BBox, header.firstPoint + done, points, a_seed, chunkInput.data(), chunkOutput.data());
+      ok = writer.Append(chunkInput.data(), chunkOutput.data(), points);
+    }
+    if (ok && writer.Close())
+      paths.push_back(path);
+  }
+  return paths;
 }
 
 void N_BVH::TrainNetwork(std::vector<float>& inputData, std::vector<float>& outputData)
 {
-  nn::TrainStatistics stats;
   nn.set_trainer(5000, nn::OptimizerAdam(0.003f), nn::Loss::NBVH);
-  nn.continue_train(inputData.data(), outputData.data(), &stats, inputData.size() / (m_samplesPerRay * 3), 5000, 2, false, nn::OptimizerAdam(0.003f), nn::Loss::NBVH, nn::Metric::Accuracy, true);
-  std::cout << "Resulting loss: " << stats.avg_loss << std::endl;
+  const float loss = TrainOnRays(nn, inputData.data(), outputData.data(), inputData.size() / InputFloatsPerRay(), m_compactDataset, true);
+  std::cout << "Resulting loss: " << loss << std::endl;
+}
+
+void N_BVH::TrainNetworkShards(const std::vector<std::string>& a_paths)
+{
+  nn.set_trainer(5000, nn::OptimizerAdam(0.003f), nn::Loss::NBVH);
+
+  float    lossSum   = 0.f;
+  uint32_t shardsNum = 0;
+  for (const auto& path : a_paths)
+  {
+    DatasetShardReader shard;
+    if (!shard.Open(path.c_str()))
+      continue;
+    if (!ShardFitsScene(shard.Header()))
+    {
+      std::cout << "[N_BVH::TrainNetworkShards]: skip '" << path.c_str() << "', it is generated for another scene or network" << std::endl;
+      continue;
+    }
+
+    // mapped arrays go to the trainer as is, compact shards are expanded by slices
+    lossSum += TrainOnRays(nn, shard.Input(), shard.Output(), shard.Header().pointsNum * m_raysPerPoint, shard.Header().compact != 0, false);
+    shardsNum++;
+  }
+
+  std::cout << "Resulting loss: " << (shardsNum > 0 ? lossSum / float(shardsNum) : 0.f) << " (average over " << shardsNum << " shards)" << std::endl;
+}
+
+void N_BVH::TrainNetworkStreaming(uint64_t a_totalPoints, uint32_t a_chunkPoints, uint32_t a_ringSize, uint64_t a_seed)
+{
+  if (a_chunkPoints == 0 || a_ringSize == 0)
+  {
+    std::cout << "[N_BVH::TrainNetworkStreaming]: bad chunk size " << a_chunkPoints << " or ring size " << a_ringSize << ", both must be positive" << std::endl;
+    return;
+  }
+
+  const BBox3f   BBox        = DatasetBBox();
+  const uint64_t chunksNum   = (a_totalPoints + a_chunkPoints - 1) / a_chunkPoints;
+  const size_t   inputFloats = size_t(m_raysPerPoint) * InputFloatsPerRay();
+  const size_t   outFloats   = size_t(m_raysPerPoint) * m_outputSize;
+
+  // chunk c goes to slot c % a_ringSize; it may be generated when chunk c - a_ringSize has been trained on, 
+  // and chunks are trained on strictly in order, so the result does not depend on the number of workers
+  //
+  std::vector<std::vector<float> > ringInput (a_ringSize, std::vector<float>(a_chunkPoints * inputFloats));
+  std::vector<std::vector<float> > ringOutput(a_ringSize, std::vector<float>(a_chunkPoints * outFloats));
+  std::vector<std::vector<float> > ringPoints(a_ringSize, std::vector<float>(m_activeSampling ? a_chunkPoints * RAY_ENDPOINT_FLOATS : 0)); ///< sampled points for the active sampler
+  std::vector<uint64_t>            ringChunk (a_ringSize, uint64_t(-1)); ///< chunk that is ready in the slot
+
+  std::mutex              ringMutex;
+  std::condition_variable ringChanged;
+  uint64_t                nextChunk    = 0; ///< next chunk to generate
+  uint64_t                doneChunks   = 0; ///< chunks already trained on
+  float                   lossSum      = 0.f;
+
+  // snapshot d is the active sampler state after d trained chunks; chunk c is generated from snapshot c + 1 - a_ringSize, 
+  // which is the last one that is surely ready when the chunk may be generated. While chunk d is trained, generators 
+  // read snapshots from d + 1 - a_ringSize on and the trainer writes d + 1, so a ring of a_ringSize + 1 snapshots is enough
+  //
+  const uint32_t snapshotsNum = a_ringSize + 1;
+  std::vector<ActiveSamplerSnapshot> snapshots(m_activeSampling ? snapshotsNum : 0);
+  if (m_activeSampling)
+    snapshots[0] = m_activeSampler.MakeSnapshot();
+
+  auto chunkPoints = [&](uint64_t a_chunkId) { return uint32_t(std::min<uint64_t>(a_chunkPoints, a_totalPoints - a_chunkId * a_chunkPoints)); };
+
+  auto generateChunk = [&](uint64_t a_chunkId)
+  {
+    const uint32_t slot = uint32_t(a_chunkId % a_ringSize);
+    const ActiveSamplerSnapshot* distribution = m_activeSampling ? &snapshots[(a_chunkId + 1 >= a_ringSize ? a_chunkId + 1 - a_ringSize : 0) % snapshotsNum] : nullptr;
+    for (uint32_t i = 0; i < chunkPoints(a_chunkId); i++)
+      GenRayBBoxPoint(BBox, a_chunkId * a_chunkPoints + i, a_seed, ringInput[slot].data() + i * inputFloats, ringOutput[slot].data() + i * outFloats, distribution,
+                      m_activeSampling ? ringPoints[slot].data() + i * RAY_ENDPOINT_FLOATS : nullptr);
+  };
+
+  auto trainChunk = [&](uint64_t a_chunkId)
+  {
+    const uint32_t slot = uint32_t(a_chunkId % a_ringSize);
+    lossSum += TrainOnRays(nn, ringInput[slot].data(), ringOutput[slot].data(), size_t(chunkPoints(a_chunkId)) * m_raysPerPoint, m_compactDataset, false);
+    if (m_activeSampling)
+    {
+      RecordActiveSampler(ringInput[slot].data(), ringOutput[slot].data(), ringPoints[slot].data(), chunkPoints(a_chunkId), m_compactDataset);
+      snapshots[(a_chunkId + 1) % snapshotsNum] = m_activeSampler.MakeSnapshot();
+    }
+  };
+
+  nn.set_trainer(5000, nn::OptimizerAdam(0.003f), nn::Loss::NBVH);
+
+  // thread 0 trains, the others generate; OpenMP threads are used so that every worker has its own traversal counters
+  //
+  #pragma omp parallel default(shared)
+  {
+    #ifdef _OPENMP
+    const int threadId   = omp_get_thread_num();
+    const int threadsNum = omp_get_num_threads();
+    #else
+    const int threadId   = 0;
+    const int threadsNum = 1;
+    #endif
+
+    if (threadsNum == 1) // nothing to overlap with
+    {
+      for (uint64_t chunkId = 0; chunkId < chunksNum; chunkId++)
+      {
+        generateChunk(chunkId);
+        trainChunk(chunkId);
+      }
+    }
+    else if (threadId == 0)
+    {
+      for (uint64_t chunkId = 0; chunkId < chunksNum; chunkId++)
+      {
+        const uint32_t slot = uint32_t(chunkId % a_ringSize);
+        {
+          std::unique_lock<std::mutex> lock(ringMutex);
+          ringChanged.wait(lock, [&]() { return ringChunk[slot] == chunkId; });
+        }
+
+        trainChunk(chunkId);
+
+        {
+          std::lock_guard<std::mutex> lock(ringMutex);
+          doneChunks++;
+        }
+        ringChanged.notify_all();
+      }
+    }
+    else
+    {
+      while (true)
+      {
+        uint64_t chunkId;
+        {
+          std::unique_lock<std::mutex> lock(ringMutex);
+          if (nextChunk == chunksNum)
+            break;
+          chunkId = nextChunk++;
+          ringChanged.wait(lock, [&]() { return chunkId < doneChunks + a_ringSize; });
+        }
+
+        generateChunk(chunkId);
+
+        {
+          std::lock_guard<std::mutex> lock(ringMutex);
+          ringChunk[chunkId % a_ringSize] = chunkId;
+        }
+        ringChanged.notify_all();
+      }
+    }
+  }
+
+  std::cout << "Resulting loss: " << (chunksNum > 0 ? lossSum / float(chunksNum) : 0.f) << " (average over " << chunksNum << " chunks)" << std::endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -471,145 +1078,750 @@ void N_BVH::TrainNetwork(std::vector<float>& inputData, std::vector<float>& outp
 
 void N_BVH::Render(uint32_t* a_outColor, float* out_depth, uint32_t a_width, uint32_t a_height, const char* a_what, int a_passNum)
 {
+  m_lambertShading = (std::string(a_what) == "lambert");
   CastRaySingleBlock(a_width*a_height, a_outColor, out_depth, a_passNum);
 }
 
 void N_BVH::Render(uint32_t* a_outColor, uint32_t a_width, uint32_t a_height, const char* a_what, int a_passNum)
 {
+  if (!m_hybridLeaves.empty())
+  {
+    RenderHybrid(a_outColor, a_width, a_height);
+    return;
+  }
+  if (m_neuralBatchTiles > 0)
+  {
+    RenderNeuralTiled(a_outColor, a_width, a_height);
+    return;
+  }
+
   profiling::Timer timer;
   timer.restart();
 
-  std::vector<float> nn_input, nn_output, bboxMask;
-  nn_input.resize(a_width * a_height * m_samplesPerRay * 3);
-  nn_output.resize(a_width * a_height * m_outputSize);
-  bboxMask.resize(a_width * a_height);
+  // buffers are tile-major: tile t owns NEURAL_TILE_SIZE^2 consecutive rays, pixels outside of the frame are masked out
+  //
+  const uint32_t tilesX     = (a_width  + NEURAL_TILE_SIZE - 1) / NEURAL_TILE_SIZE;
+  const uint32_t tilesY     = (a_height + NEURAL_TILE_SIZE - 1) / NEURAL_TILE_SIZE;
+  const int      tilesNum   = int(tilesX * tilesY);
+  const size_t   tilePixels = size_t(NEURAL_TILE_SIZE) * NEURAL_TILE_SIZE;
 
-  BBox3f BBox;
-  BBox.boxMax = float3(m_sceneBBox.boxMax.x, m_sceneBBox.boxMax.y, m_sceneBBox.boxMax.z);
-  BBox.boxMin = float3(m_sceneBBox.boxMin.x, m_sceneBBox.boxMin.y, m_sceneBBox.boxMin.z);
-  float3 BBoxSize = BBox.boxMax - BBox.boxMin;
-  BBox.boxMax = BBox.boxMax + BBoxSize * m_BBoxBound;
-  BBox.boxMin = BBox.boxMin - BBoxSize * m_BBoxBound;
+  // buffers keep their size between frames of the same resolution
+  std::vector<float>& nn_input  = m_neuralWhole.input;
+  std::vector<float>& nn_output = m_neuralWhole.output;
+  std::vector<float>& bboxMask  = m_neuralWhole.mask;
+  nn_input.resize(tilesNum * tilePixels * InputFloatsPerRay());
+  nn_output.resize(tilesNum * tilePixels * m_outputSize);
+  bboxMask.resize(tilesNum * tilePixels);
 
-  float threshold = min(min(BBoxSize.x, BBoxSize.y), BBoxSize.z) * m_BBoxBound;
-  BBoxSize = BBox.boxMax - BBox.boxMin;
+  const NeuralFrame& frame = PrepareNeuralFrame();
 
-  for (int i=0; i<a_height; i++)
+  #ifndef _DEBUG
+  #pragma omp parallel for default(shared) schedule(dynamic)
+  #endif
+  for (int tileId = 0; tileId < tilesNum; tileId++)
+    NeuralGenTile(frame, uint32_t(tileId), a_width, a_height, nn_input.data() + tileId * tilePixels * InputFloatsPerRay(), bboxMask.data() + tileId * tilePixels);
+
+  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for ray generation" << std::endl;
+  timer.restart();
+
+  const size_t activeRays = EvaluateNeuralBatch(m_neuralWhole);
+
+  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for inference (" << activeRays << " of " << bboxMask.size() << " rays)" << std::endl;
+  timer.restart();
+
+  #ifndef _DEBUG
+  #pragma omp parallel for default(shared) schedule(dynamic)
+  #endif
+  for (int tileId = 0; tileId < tilesNum; tileId++)
+    NeuralShadeTile(uint32_t(tileId), a_width, a_height, nn_output.data() + tileId * tilePixels * m_outputSize, bboxMask.data() + tileId * tilePixels, a_outColor);
+
+  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for rendering" << std::endl;
+}
+
+void N_BVH::RenderNeuralTiled(uint32_t* a_outColor, uint32_t a_width, uint32_t a_height)
+{
+  profiling::Timer timer;
+  timer.restart();
+
+  const uint32_t tilesX     = (a_width  + NEURAL_TILE_SIZE - 1) / NEURAL_TILE_SIZE;
+  const uint32_t tilesY     = (a_height + NEURAL_TILE_SIZE - 1) / NEURAL_TILE_SIZE;
+  const uint32_t tilesNum   = tilesX * tilesY;
+  const uint32_t batchesNum = (tilesNum + m_neuralBatchTiles - 1) / m_neuralBatchTiles;
+  const size_t   tilePixels = size_t(NEURAL_TILE_SIZE) * NEURAL_TILE_SIZE;
+  const size_t   batchRays  = tilePixels * m_neuralBatchTiles;
+
+  for (auto& batch : m_neuralBatches)
   {
-    for (int j=0; j<a_width; j++)
+    batch.input.resize(batchRays * InputFloatsPerRay());
+    batch.output.resize(batchRays * m_outputSize);
+    batch.mask.resize(batchRays);
+  }
+
+  const NeuralFrame& frame = PrepareNeuralFrame();
+
+  auto batchTiles = [&](uint32_t a_batchId) { return std::min(m_neuralBatchTiles, tilesNum - a_batchId * m_neuralBatchTiles); };
+
+  // step s generates batch s, evaluates batch s-1 and shades batch s-2; batch b lives in buffer b % 3, 
+  // and the step ends when all three are done, so a buffer is never used by two stages at once
+  //
+  #pragma omp parallel default(shared)
+  #pragma omp single
+  for (uint32_t step = 0; step < batchesNum + 2; step++)
+  {
+    if (step >= 1 && step - 1 < batchesNum)
     {
-      float3 initRayDir = EyeRayDirNormalized((float(j)+0.5f)/float(m_width), (float(i)+0.5f)/float(m_height), m_projInv);
-      float3 initRayPos = float3(0.f, 0.f, 0.f);
+      NeuralBatch* batch = &m_neuralBatches[(step - 1) % 3];
+      #pragma omp task default(shared) firstprivate(batch)
+      EvaluateNeuralBatch(*batch);
+    }
 
-      transform_ray3f(m_worldViewInv, 
-                  &initRayPos, &initRayDir);
-      auto hitBBox = BBox.Intersection(initRayPos, 1.f / initRayDir, -INFINITY, +INFINITY);
+    if (step < batchesNum)
+    {
+      NeuralBatch* batch = &m_neuralBatches[step % 3];
+      for (uint32_t i = 0; i < batchTiles(step); i++)
+      {
+        const uint32_t tileId = step * m_neuralBatchTiles + i;
+        #pragma omp task default(shared) firstprivate(batch, i, tileId)
+        NeuralGenTile(frame, tileId, a_width, a_height, batch->input.data() + i * tilePixels * InputFloatsPerRay(), batch->mask.data() + i * tilePixels);
+      }
+      std::fill(batch->mask.begin() + batchTiles(step) * tilePixels, batch->mask.end(), 0.f); // the last batch may be partial
+    }
 
-      if (hitBBox.t1 < hitBBox.t2 && length(initRayDir * (hitBBox.t2 - hitBBox.t1)) > threshold)
+    if (step >= 2)
+    {
+      NeuralBatch* batch = &m_neuralBatches[(step - 2) % 3];
+      for (uint32_t i = 0; i < batchTiles(step - 2); i++)
       {
-        float3 hitBBoxPoint1, hitBBoxPoint2;
-        hitBBoxPoint1 = initRayPos + initRayDir * hitBBox.t1;
-        hitBBoxPoint2 = initRayPos + initRayDir * hitBBox.t2;
+        const uint32_t tileId = (step - 2) * m_neuralBatchTiles + i;
+        #pragma omp task default(shared) firstprivate(batch, i, tileId)
+        NeuralShadeTile(tileId, a_width, a_height, batch->output.data() + i * tilePixels * m_outputSize, batch->mask.data() + i * tilePixels, a_outColor);
+      }
+    }
 
-        auto step = (hitBBoxPoint2 - hitBBoxPoint1) / static_cast<float>(m_samplesPerRay + 1);
-        for (uint32_t k = 0; k < m_samplesPerRay; ++k)
-        {
-          auto sample = hitBBoxPoint1 + step * (k + 1);
-          sample = (sample - BBox.boxMin) / BBoxSize;
-          //std::cout << sample.x << " " << sample.y << " " << sample.z << std::endl;
-
-          //positional_encoding(sample, nn_input.data() + ((i * a_width + j) * m_samplesPerRay + k) * 3 * (ENCODE_LENGTH * 2 + 1));
-          nn_input[((i * a_width + j) * m_samplesPerRay + k) * 3 + 0] = sample.x;
-          nn_input[((i * a_width + j) * m_samplesPerRay + k) * 3 + 1] = sample.y;
-          nn_input[((i * a_width + j) * m_samplesPerRay + k) * 3 + 2] = sample.z;
-        }
+    #pragma omp taskwait
+  }
 
-        bboxMask[i * a_width + j] = 1.f;
-      }
+  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for tiled neural rendering (" << batchesNum << " batches)" << std::endl;
+}
+
+void N_BVH::RenderSequence(const std::vector<CameraPose>& a_poses, uint32_t a_width, uint32_t a_height,
+                           const std::function<void(uint32_t a_frameId, const uint32_t* a_image)>& a_onFrame)
+{
+  std::vector<uint32_t> image(size_t(a_width) * a_height);
+  for(uint32_t frameId = 0; frameId < uint32_t(a_poses.size()); frameId++)
+  {
+    SetCamera(a_poses[frameId]);
+    Render(image.data(), a_width, a_height, "color", 1);
+    a_onFrame(frameId, image.data());
+  }
+}
+
+size_t N_BVH::EvaluateNeuralBatch(NeuralBatch& a_batch)
+{
+  // (1) compact the list of rays inside the box (and instance boxes with SetInstanceCulling)
+  //
+  a_batch.activeIds.clear();
+  for (size_t rayId = 0; rayId < a_batch.mask.size(); rayId++)
+    if (a_batch.mask[rayId] > 0.5f)
+      a_batch.activeIds.push_back(uint32_t(rayId));
+
+  // (2) gather sample positions of active rays by slices, evaluate them and scatter results back to the ray slots;
+  //     outputs of inactive rays are left as is, shading does not read them
+  //
+  const size_t activeNum    = a_batch.activeIds.size();
+  const size_t inputFloats  = InputFloatsPerRay();
+  const size_t sampleFloats = size_t(m_samplesPerRay) * 3;
+  for (size_t first = 0; first < activeNum; first += EXPAND_SLICE_RAYS)
+  {
+    const size_t sliceRays = std::min(EXPAND_SLICE_RAYS, activeNum - first);
+    a_batch.samples.resize(sliceRays * sampleFloats);
+    a_batch.sliceOutput.resize(sliceRays * m_outputSize);
+
+    for (size_t i = 0; i < sliceRays; i++)
+    {
+      const float* input = a_batch.input.data() + a_batch.activeIds[first + i] * inputFloats;
+      if (m_compactDataset)
+        ExpandRaySamples(input, 1, a_batch.samples.data() + i * sampleFloats);
       else
+        std::copy(input, input + sampleFloats, a_batch.samples.data() + i * sampleFloats);
+    }
+
+    nn.evaluate(a_batch.samples, a_batch.sliceOutput);
+
+    for (size_t i = 0; i < sliceRays; i++)
+      std::copy(a_batch.sliceOutput.begin() + i * m_outputSize, a_batch.sliceOutput.begin() + (i + 1) * m_outputSize,
+                a_batch.output.begin() + size_t(a_batch.activeIds[first + i]) * m_outputSize);
+  }
+  return activeNum;
+}
+
+void N_BVH::TrainHybrid(uint32_t a_maxLeaves, uint32_t a_pointsPerLeaf, int a_hiddenSize, uint64_t a_seed)
+{
+  const auto& nodes = m_pAccelStruct->m_nodesTLAS;
+  m_hybridLeaves.clear();
+  if (nodes.empty())
+  {
+    std::cout << "[N_BVH::TrainHybrid]: scene has no TLAS" << std::endl;
+    return;
+  }
+
+  // a ray keeps only MAX_HYBRID_ENTRIES nearest boxes of the cut, so the cut is not larger and every box a ray enters is evaluated
+  //
+  if (a_maxLeaves > MAX_HYBRID_ENTRIES)
+  {
+    std::cout << "[N_BVH::TrainHybrid]: " << a_maxLeaves << " leaves requested, clamped to " << MAX_HYBRID_ENTRIES << std::endl;
+    a_maxLeaves = MAX_HYBRID_ENTRIES;
+  }
+
+  // (1) cut TLAS: split the inner node of the cut with the largest box until there are a_maxLeaves nodes or only TLAS leaves
+  //
+  auto halfArea = [&](uint32_t a_nodeId)
+  {
+    const float3 size = nodes[a_nodeId].boxMax - nodes[a_nodeId].boxMin;
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+  };
+
+  std::vector<uint32_t> cut = {0};
+  while (cut.size() < a_maxLeaves)
+  {
+    int   splitId   = -1;
+    float splitArea = -1.f;
+    for (size_t i = 0; i < cut.size(); i++)
+    {
+      if ((nodes[cut[i]].leftOffset & LEAF_BIT) == 0 && halfArea(cut[i]) > splitArea)
       {
-        bboxMask[i * a_width + j] = 0.f;
+        splitId   = int(i);
+        splitArea = halfArea(cut[i]);
       }
     }
+    if (splitId < 0)
+      break;
+    const BVHNode& node = nodes[cut[splitId]];
+    cut[splitId] = node.leftOffset;
+    cut.push_back(node.escapeIndex);
+  }
+  if (cut.size() < a_maxLeaves)
+    std::cout << "[N_BVH::TrainHybrid]: TLAS has only " << cut.size() << " instance boxes, the cut does not go into BLAS" << std::endl;
+
+  // (2) leaf boxes are enlarged as the dataset box, flat ones are thickened up to 1% of the scene size
+  //
+  const BBox3f sceneBox  = DatasetBBox();
+  const float3 minSize   = (sceneBox.boxMax - sceneBox.boxMin) * 0.01f;
+  m_hybridLeafByNode.assign(nodes.size(), -1);
+  for (const uint32_t nodeId : cut)
+  {
+    HybridLeaf leaf;
+    leaf.nodeId = nodeId;
+    const float3 center = (nodes[nodeId].boxMin + nodes[nodeId].boxMax) * 0.5f;
+    const float3 size   = nodes[nodeId].boxMax - nodes[nodeId].boxMin;
+    const float3 half   = float3(std::max(size.x, minSize.x), std::max(size.y, minSize.y), std::max(size.z, minSize.z)) * (0.5f + m_BBoxBound);
+    leaf.box.boxMin = center - half;
+    leaf.box.boxMax = center + half;
+    leaf.net = std::make_unique<nn::NeuralNetwork>();
+    BuildNetwork(*leaf.net, a_hiddenSize);
+    m_hybridLeafByNode[nodeId] = int32_t(m_hybridLeaves.size());
+    m_hybridLeaves.push_back(std::move(leaf));
   }
 
-  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for ray generation" << std::endl;
-  timer.restart();
+  // (3) every network learns rays clipped to its own box; the dataset buffers are shared by all leaves
+  //
+  std::vector<float> inputData (size_t(a_pointsPerLeaf) * m_raysPerPoint * InputFloatsPerRay());
+  std::vector<float> outputData(size_t(a_pointsPerLeaf) * m_raysPerPoint * m_outputSize);
+  for (uint32_t leafId = 0; leafId < uint32_t(m_hybridLeaves.size()); leafId++)
+  {
+    HybridLeaf& leaf = m_hybridLeaves[leafId];
+    GenRayBBoxRange(leaf.box, 0, a_pointsPerLeaf, hashFNV1a(&leafId, sizeof(leafId), a_seed), inputData.data(), outputData.data());
+    leaf.net->set_trainer(5000, nn::OptimizerAdam(0.003f), nn::Loss::NBVH);
+    const float loss = TrainOnRays(*leaf.net, inputData.data(), outputData.data(), size_t(a_pointsPerLeaf) * m_raysPerPoint, m_compactDataset, false);
+    std::cout << "[N_BVH::TrainHybrid]: leaf " << leafId << " (TLAS node " << leaf.nodeId << "), loss " << loss << std::endl;
+  }
+}
+
+uint32_t N_BVH::HybridLeavesAlongRay(float3 a_rayPos, float3 a_rayDir, HybridEntry* a_entries) const
+{
+  const auto&  nodes     = m_pAccelStruct->m_nodesTLAS;
+  const float3 rayDirInv = SafeInverse(a_rayDir);
+
+  uint32_t stack[STACK_SIZE];
+  uint32_t top        = 0;
+  uint32_t entriesNum = 0;
+  stack[top++] = 0;
 
-  nn.evaluate(nn_input, nn_output);
+  while (top > 0)
+  {
+    const uint32_t nodeId = stack[--top];
+    const int32_t  leafId = m_hybridLeafByNode[nodeId];
+    const float2   tm     = (leafId >= 0) ? RayBoxIntersection2(a_rayPos, rayDirInv, m_hybridLeaves[leafId].box.boxMin, m_hybridLeaves[leafId].box.boxMax) :
+                                            RayBoxIntersection2(a_rayPos, rayDirInv, nodes[nodeId].boxMin, nodes[nodeId].boxMax);
+    if (tm.x > tm.y || tm.y < 0.f)
+      continue;
+
+    if (leafId < 0)
+    {
+      stack[top++] = nodes[nodeId].leftOffset;
+      stack[top++] = nodes[nodeId].escapeIndex;
+      continue;
+    }
+
+    // insertion into the sorted list, the farthest entry is dropped when it is full
+    //
+    const float tEnter = std::max(tm.x, 0.f);
+    if (entriesNum == MAX_HYBRID_ENTRIES && a_entries[entriesNum - 1].tEnter <= tEnter)
+      continue;
+    uint32_t pos = std::min(entriesNum, MAX_HYBRID_ENTRIES - 1);
+    entriesNum   = std::min(entriesNum + 1, MAX_HYBRID_ENTRIES);
+    while (pos > 0 && a_entries[pos - 1].tEnter > tEnter)
+    {
+      a_entries[pos] = a_entries[pos - 1];
+      pos--;
+    }
+    a_entries[pos] = {uint32_t(leafId), tEnter, tm.y};
+  }
+
+  return entriesNum;
+}
+
+// color of a normal predicted by the network, it is encoded to [0,1]^3 as in the dataset
+//
+static inline uint32_t PredictedNormalColor(float a_x, float a_y, float a_z)
+{
+  const float    nx    = (a_x - 0.5f) * 2.f;
+  const float    ny    = (a_y - 0.5f) * 2.f;
+  const float    nz    = (a_z - 0.5f) * 2.f;
+  const float    scale = 1.f / std::sqrt(nx * nx + ny * ny + nz * nz);
+  const uint32_t r     = uint32_t((nx * scale + 1.f) * 0.5f * 255.f);
+  const uint32_t g     = uint32_t((ny * scale + 1.f) * 0.5f * 255.f);
+  const uint32_t b     = uint32_t((nz * scale + 1.f) * 0.5f * 255.f);
+  return (r << 8 | g) << 8 | b;
+}
 
-  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for inference" << std::endl;
+void N_BVH::RenderHybrid(uint32_t* a_outColor, uint32_t a_width, uint32_t a_height)
+{
+  profiling::Timer timer;
   timer.restart();
-    
-  float3 viewPos = m_camPos;
-  mymul4x3(m_worldViewInv, viewPos);
 
-  for (int i=0; i<a_height; i++)
+  const NeuralFrame& frame       = PrepareNeuralFrame();
+  const size_t       pixelsNum   = size_t(a_width) * a_height;
+  const size_t       inputFloats = InputFloatsPerRay();
+  const uint32_t     leavesNum   = uint32_t(m_hybridLeaves.size());
+
+  #ifdef _OPENMP
+  const uint32_t rangesNum = uint32_t(omp_get_max_threads());
+  #else
+  const uint32_t rangesNum = 1;
+  #endif
+  const size_t rangeSize = (pixelsNum + rangesNum - 1) / rangesNum;
+
+  // whole frame buffers, resize does not reallocate while the resolution and the number of leaves are the same
+  //
+  HybridFrame& hf = m_hybridFrame;
+  hf.rayDirs.resize(pixelsNum);
+  hf.entries.resize(pixelsNum * MAX_HYBRID_ENTRIES);
+  hf.entriesNum.resize(pixelsNum);
+  hf.bestT.resize(pixelsNum);
+  hf.normals.resize(pixelsNum * 3);
+  hf.leafRays.resize(pixelsNum);
+  hf.leafFirst.resize(leavesNum + 1);
+  hf.rangeCursor.resize(size_t(rangesNum) * leavesNum);
+
+  std::vector<float3>&      rayDirs    = hf.rayDirs;
+  std::vector<HybridEntry>& entries    = hf.entries;
+  std::vector<uint32_t>&    entriesNum = hf.entriesNum;
+  std::vector<float>&       bestT      = hf.bestT;
+  std::vector<float>&       normals    = hf.normals;
+  std::vector<uint32_t>&    leafFirst  = hf.leafFirst;
+  std::vector<uint32_t>&    leafRays   = hf.leafRays;
+  std::fill(bestT.begin(), bestT.end(), INFINITY);
+
+  // (1) eye rays and boxes of the TLAS cut along them
+  //
+
+  #ifndef _DEBUG
+  #pragma omp parallel for default(shared) schedule(dynamic, 256)
+  #endif
+  for (int pixelId = 0; pixelId < int(pixelsNum); pixelId++)
   {
-    for (int j=0; j<a_width; j++)
+    const float u = (float(pixelId % a_width) + 0.5f) / float(m_width);
+    const float v = (float(pixelId / a_width) + 0.5f) / float(m_height);
+    float3 rayDir;
+    if (frame.affine)
+      rayDir = normalize(frame.dir0 + frame.dirX * u + frame.dirY * v);
+    else
+    {
+      float3 rayPos = float3(0.f, 0.f, 0.f);
+      rayDir = EyeRayDirNormalized(u, v, m_projInv);
+      transform_ray3f(m_worldViewInv, &rayPos, &rayDir);
+    }
+    rayDirs[pixelId]    = rayDir;
+    entriesNum[pixelId] = HybridLeavesAlongRay(frame.rayPos, rayDir, entries.data() + size_t(pixelId) * MAX_HYBRID_ENTRIES);
+  }
+
+  // (2) wavefront rounds: in round r every ray whose r-th box starts before its nearest neural hit so far goes to the network
+  //     of that box; rays are grouped by leaf, so every network is evaluated once per round
+  //
+  uint32_t roundsNum = 0;
+  for (uint32_t round = 0; round < MAX_HYBRID_ENTRIES; round++)
+  {
+    auto entryOf = [&](size_t a_pixelId) -> const HybridEntry& { return entries[a_pixelId * MAX_HYBRID_ENTRIES + round]; };
+    auto active  = [&](size_t a_pixelId) { return round < entriesNum[a_pixelId] && entryOf(a_pixelId).tEnter < bestT[a_pixelId]; };
+
+    // counting sort by leaf over contiguous pixel ranges: every range counts its rays per leaf, then scatters them
+    // from its own cursor; cursors go range after range inside a leaf, so pixels stay in order for any number of threads
+    //
+    #ifndef _DEBUG
+    #pragma omp parallel for default(shared)
+    #endif
+    for (int rangeId = 0; rangeId < int(rangesNum); rangeId++)
+    {
+      uint32_t* counts = hf.rangeCursor.data() + size_t(rangeId) * leavesNum;
+      std::fill(counts, counts + leavesNum, 0u);
+      for (size_t pixelId = rangeId * rangeSize; pixelId < std::min(pixelsNum, (rangeId + 1) * rangeSize); pixelId++)
+        if (active(pixelId))
+          counts[entryOf(pixelId).leafId]++;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t leafId = 0; leafId < leavesNum; leafId++)
     {
-      if (bboxMask[i * a_width + j] > 0.5f)
+      leafFirst[leafId] = offset;
+      for (uint32_t rangeId = 0; rangeId < rangesNum; rangeId++)
       {
-        bool visibility = nn_output[(i * a_width + j) * m_outputSize] > 0.5f;
-        if (visibility)
+        uint32_t& cursor = hf.rangeCursor[size_t(rangeId) * leavesNum + leafId];
+        const uint32_t count = cursor;
+        cursor  = offset;
+        offset += count;
+      }
+    }
+    leafFirst[leavesNum] = offset;
+    if (offset == 0)
+      break;
+    roundsNum++;
+
+    #ifndef _DEBUG
+    #pragma omp parallel for default(shared)
+    #endif
+    for (int rangeId = 0; rangeId < int(rangesNum); rangeId++)
+    {
+      uint32_t* cursor = hf.rangeCursor.data() + size_t(rangeId) * leavesNum;
+      for (size_t pixelId = rangeId * rangeSize; pixelId < std::min(pixelsNum, (rangeId + 1) * rangeSize); pixelId++)
+        if (active(pixelId))
+          leafRays[cursor[entryOf(pixelId).leafId]++] = uint32_t(pixelId);
+    }
+
+    for (uint32_t leafId = 0; leafId < leavesNum; leafId++)
+    {
+      const uint32_t first   = leafFirst[leafId];
+      const uint32_t raysNum = leafFirst[leafId + 1] - first;
+      if (raysNum == 0)
+        continue;
+
+      const HybridLeaf& leaf    = m_hybridLeaves[leafId];
+      const float3      boxSize = leaf.box.boxMax - leaf.box.boxMin;
+      NeuralBatch&      batch   = m_hybridBatch;
+      batch.input.resize(raysNum * inputFloats);
+      batch.output.resize(raysNum * m_outputSize);
+
+      #ifndef _DEBUG
+      #pragma omp parallel for default(shared)
+      #endif
+      for (int i = 0; i < int(raysNum); i++)
+      {
+        const uint32_t     pixelId = leafRays[first + i];
+        const HybridEntry& entry   = entryOf(pixelId);
+        const float3       rayDir  = rayDirs[pixelId];
+        PutRayInput((frame.rayPos + rayDir * entry.tEnter - leaf.box.boxMin) / boxSize, (frame.rayPos + rayDir * entry.tExit - leaf.box.boxMin) / boxSize,
+                    batch.input.data() + size_t(i) * inputFloats);
+      }
+
+      if (m_compactDataset)
+      {
+        batch.samples.resize(size_t(raysNum) * m_samplesPerRay * 3);
+        ExpandRaySamples(batch.input.data(), raysNum, batch.samples.data());
+        leaf.net->evaluate(batch.samples, batch.output);
+      }
+      else
+        leaf.net->evaluate(batch.input, batch.output);
+
+      // predicted hit point gives the distance along the ray, the nearest hit over all boxes wins;
+      // a pixel has one box per round, so rays of the leaf write different pixels
+      //
+      #ifndef _DEBUG
+      #pragma omp parallel for default(shared)
+      #endif
+      for (int i = 0; i < int(raysNum); i++)
+      {
+        const float* out = batch.output.data() + size_t(i) * m_outputSize;
+        if (out[0] <= 0.5f)
+          continue;
+        const uint32_t     pixelId = leafRays[first + i];
+        const HybridEntry& entry   = entryOf(pixelId);
+        const float3       hitPos  = float3(out[1], out[2], out[3]) * boxSize + leaf.box.boxMin;
+        const float        t       = clip(entry.tEnter, entry.tExit, dot(hitPos - frame.rayPos, rayDirs[pixelId]));
+        if (t < bestT[pixelId])
         {
-          float3 hitPoint = float3(nn_output[(i * a_width + j) * m_outputSize + 1],
-                                   nn_output[(i * a_width + j) * m_outputSize + 2],
-                                   nn_output[(i * a_width + j) * m_outputSize + 3]) * BBoxSize + BBox.boxMin;
+          bestT[pixelId] = t;
+          normals[pixelId * 3 + 0] = out[4];
+          normals[pixelId * 3 + 1] = out[5];
+          normals[pixelId * 3 + 2] = out[6];
+        }
+      }
+    }
+  }
 
-          float depth = length(hitPoint - viewPos);
+  // (3) the same normal shading as NeuralShadeTile
+  //
+  #ifndef _DEBUG
+  #pragma omp parallel for default(shared)
+  #endif
+  for (int pixelId = 0; pixelId < int(pixelsNum); pixelId++)
+    a_outColor[pixelId] = (bestT[pixelId] != INFINITY) ? PredictedNormalColor(normals[pixelId * 3 + 0], normals[pixelId * 3 + 1], normals[pixelId * 3 + 2]) : 0u;
 
-          float3 normal = float3(nn_output[(i * a_width + j) * m_outputSize + 4], 
-                                           nn_output[(i * a_width + j) * m_outputSize + 5],
-                                           nn_output[(i * a_width + j) * m_outputSize + 6]);
-          
-          normal = normalize((normal - 0.5f) * 2.f);
+  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for hybrid rendering (" << leavesNum << " networks, " << roundsNum << " rounds)" << std::endl;
+}
 
-          ///uint32_t r = int32_t(255.f - (depth - 3.3f) * 400.f);
-          ///uint32_t g = int32_t(255.f - (depth - 3.3f) * 400.f);
-          ///uint32_t b = int32_t(255.f - (depth - 3.3f) * 400.f);
+const N_BVH::NeuralFrame& N_BVH::PrepareNeuralFrame()
+{
+  NeuralFrame& frame = m_neuralFrame;
+  if (!m_neuralSceneReady)
+  {
+    frame.box     = DatasetBBox();
+    frame.boxSize = frame.box.boxMax - frame.box.boxMin;
 
-          //float3 lambert = m_lightSourcePower * max(0.f, dot(normal, normalize(m_lightSourcePos - hitPoint)));
+    const float3 sceneSize = float3(m_sceneBBox.boxMax.x - m_sceneBBox.boxMin.x, m_sceneBBox.boxMax.y - m_sceneBBox.boxMin.y, m_sceneBBox.boxMax.z - m_sceneBBox.boxMin.z);
+    frame.threshold    = min(min(sceneSize.x, sceneSize.y), sceneSize.z) * m_BBoxBound;
+    m_neuralSceneReady = true;
+  }
+  if (m_neuralCameraReady)
+    return frame;
+  m_neuralCameraReady = true;
+
+  // a pinhole camera gives eye ray directions d(u,v) = normalize(d0 + u*dX + v*dY); directions at the corners of [0,1]^2 
+  // are known up to scale, and the scales follow from d(1,1) = d(1,0) + d(0,1) - d(0,0) with unit scale of d(0,0)
+  //
+  auto eyeRayDir = [this](float u, float v, float3* a_pos)
+  {
+    float3 dir = EyeRayDirNormalized(u, v, m_projInv);
+    (*a_pos)   = float3(0.f, 0.f, 0.f);
+    transform_ray3f(m_worldViewInv, a_pos, &dir);
+    return dir;
+  };
+
+  const float3 d00 = eyeRayDir(0.f, 0.f, &frame.rayPos);
+  const float3 d10 = eyeRayDir(1.f, 0.f, &frame.rayPos);
+  const float3 d01 = eyeRayDir(0.f, 1.f, &frame.rayPos);
+  const float3 d11 = eyeRayDir(1.f, 1.f, &frame.rayPos);
+
+  const float det = dot(d10, cross(d01, d11 * -1.f));
+  frame.affine = std::fabs(det) > 1e-6f;
+  if (frame.affine)
+  {
+    const float s10 = dot(d00, cross(d01, d11 * -1.f)) / det;
+    const float s01 = dot(d10, cross(d00, d11 * -1.f)) / det;
+    const float s11 = dot(d10, cross(d01, d00)) / det;
+    frame.affine = (s10 > 0.f && s01 > 0.f && s11 > 0.f);
+    frame.dir0   = d00;
+    frame.dirX   = d10 * s10 - d00;
+    frame.dirY   = d01 * s01 - d00;
+  }
+  return frame;
+}
 
-          //out_color[y * m_width + x] = (hit.primId == 0xFFFFFFFF) ? 0 : m_palette[(hit.primId) % palette_size];
-          //uint8_t r = uint8_t(clip(0.f, 255.f, (lambert.x + 0.2f) * 255.f));
-          //uint8_t g = uint8_t(clip(0.f, 255.f, (lambert.y + 0.2f) * 255.f));
-          //uint8_t b = uint8_t(clip(0.f, 255.f, (lambert.z + 0.2f) * 255.f));
+void N_BVH::NeuralGenTile(const NeuralFrame& a_frame, uint32_t a_tileId, uint32_t a_width, uint32_t a_height, float* a_input, float* a_mask)
+{
+  const uint32_t tilesX      = (a_width + NEURAL_TILE_SIZE - 1) / NEURAL_TILE_SIZE;
+  const uint32_t x0          = (a_tileId % tilesX) * NEURAL_TILE_SIZE;
+  const uint32_t y0          = (a_tileId / tilesX) * NEURAL_TILE_SIZE;
+  const uint32_t inputFloats = InputFloatsPerRay();
+  const float3   boxMin      = a_frame.box.boxMin;
+  const float3   boxMax      = a_frame.box.boxMax;
+  const float3   rayPos      = a_frame.rayPos;
+
+  alignas(32) float dirX[NEURAL_TILE_SIZE], dirY[NEURAL_TILE_SIZE], dirZ[NEURAL_TILE_SIZE];
+  alignas(32) float tEnter[NEURAL_TILE_SIZE], tExit[NEURAL_TILE_SIZE];
+
+  for (uint32_t y = 0; y < NEURAL_TILE_SIZE; y++)
+  {
+    float* maskRow = a_mask + y * NEURAL_TILE_SIZE;
+    if (y0 + y >= a_height)
+    {
+      std::fill(maskRow, maskRow + NEURAL_TILE_SIZE, 0.f);
+      continue;
+    }
+    const float v = (float(y0 + y) + 0.5f) / float(m_height);
 
-          //uint8_t r = uint8_t(normal.x * 255.f);
-          //uint8_t g = uint8_t(normal.y * 255.f);
-          //uint8_t b = uint8_t(normal.z * 255.f);
-          uint8_t r = uint8_t((normal.x + 1.f) * 0.5f * 255.f);
-          uint8_t g = uint8_t((normal.y + 1.f) * 0.5f * 255.f);
-          uint8_t b = uint8_t((normal.z + 1.f) * 0.5f * 255.f);
+    // (1) eye ray directions of the row
+    //
+    if (a_frame.affine)
+    {
+      const float3 rowDir = a_frame.dir0 + a_frame.dirY * v;
+      #pragma omp simd
+      for (uint32_t x = 0; x < NEURAL_TILE_SIZE; x++)
+      {
+        const float u     = (float(x0 + x) + 0.5f) / float(m_width);
+        const float dx    = rowDir.x + a_frame.dirX.x * u;
+        const float dy    = rowDir.y + a_frame.dirX.y * u;
+        const float dz    = rowDir.z + a_frame.dirX.z * u;
+        const float scale = 1.f / std::sqrt(dx * dx + dy * dy + dz * dz);
+        dirX[x] = dx * scale;
+        dirY[x] = dy * scale;
+        dirZ[x] = dz * scale;
+      }
+    }
+    else
+    {
+      for (uint32_t x = 0; x < NEURAL_TILE_SIZE; x++)
+      {
+        float3 initRayDir = EyeRayDirNormalized((float(x0 + x) + 0.5f) / float(m_width), v, m_projInv);
+        float3 initRayPos = float3(0.f, 0.f, 0.f);
+        transform_ray3f(m_worldViewInv, &initRayPos, &initRayDir);
+        dirX[x] = initRayDir.x;
+        dirY[x] = initRayDir.y;
+        dirZ[x] = initRayDir.z;
+      }
+    }
 
-          a_outColor[i*a_width + j] = (r << 8 | g) << 8 | b;
-        }
+    // (2) chords of the dataset box; rays with short chords or outside of the frame are not evaluated
+    //
+    #pragma omp simd
+    for (uint32_t x = 0; x < NEURAL_TILE_SIZE; x++)
+    {
+      const float tx1 = (boxMin.x - rayPos.x) / dirX[x], tx2 = (boxMax.x - rayPos.x) / dirX[x];
+      const float ty1 = (boxMin.y - rayPos.y) / dirY[x], ty2 = (boxMax.y - rayPos.y) / dirY[x];
+      const float tz1 = (boxMin.z - rayPos.z) / dirZ[x], tz2 = (boxMax.z - rayPos.z) / dirZ[x];
+      tEnter[x]  = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::min(tz1, tz2));
+      tExit [x]  = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::max(tz1, tz2));
+      maskRow[x] = (x0 + x < a_width && tEnter[x] < tExit[x] && tExit[x] - tEnter[x] > a_frame.threshold) ? 1.f : 0.f;
+    }
+
+    // (3) network input of active rays; with instance culling the chord must also cross some instance box
+    //
+    for (uint32_t x = 0; x < NEURAL_TILE_SIZE; x++)
+    {
+      if (maskRow[x] < 0.5f)
+        continue;
+      const float3 dir = float3(dirX[x], dirY[x], dirZ[x]);
+      if (m_instanceCulling && !m_pAccelStruct->RayQuery_AnyInstanceBox(float4(rayPos.x, rayPos.y, rayPos.z, tEnter[x]), float4(dir.x, dir.y, dir.z, tExit[x])))
+      {
+        maskRow[x] = 0.f;
+        continue;
       }
-      else
-        a_outColor[i*a_width + j] = uint32_t(0u);
-      //a_outColor[i*a_width + j] = nn_output[i * a_width + j] > 0.5 ? 0xff : 0u;
+      PutRayInput((rayPos + dir * tEnter[x] - boxMin) / a_frame.boxSize, (rayPos + dir * tExit[x] - boxMin) / a_frame.boxSize,
+                  a_input + size_t(y * NEURAL_TILE_SIZE + x) * inputFloats);
     }
   }
+}
 
-  std::cout << timer.getElapsedTime().asMilliseconds() << " ms for rendering" << std::endl;
+void N_BVH::NeuralShadeTile(uint32_t a_tileId, uint32_t a_width, uint32_t a_height, const float* a_output, const float* a_mask, uint32_t* a_outColor)
+{
+  const uint32_t tilesX    = (a_width + NEURAL_TILE_SIZE - 1) / NEURAL_TILE_SIZE;
+  const uint32_t x0        = (a_tileId % tilesX) * NEURAL_TILE_SIZE;
+  const uint32_t y0        = (a_tileId / tilesX) * NEURAL_TILE_SIZE;
+  const uint32_t rowPixels = std::min(NEURAL_TILE_SIZE, a_width - x0);
+  const uint32_t rowsNum   = std::min(NEURAL_TILE_SIZE, a_height - y0);
+  const uint32_t outSize   = m_outputSize;
+
+  // the network predicts visibility, hit point and normal; the image shows the decoded normal of visible hits
+  //
+  for (uint32_t y = 0; y < rowsNum; y++)
+  {
+    uint32_t*    colorRow = a_outColor + size_t(y0 + y) * a_width + x0;
+    const float* outRow   = a_output + size_t(y) * NEURAL_TILE_SIZE * outSize;
+    const float* maskRow  = a_mask + y * NEURAL_TILE_SIZE;
+
+    #pragma omp simd
+    for (uint32_t x = 0; x < rowPixels; x++)
+    {
+      const float* out     = outRow + x * outSize;
+      const bool   visible = maskRow[x] > 0.5f && out[0] > 0.5f;
+      colorRow[x] = visible ? PredictedNormalColor(out[4], out[5], out[6]) : 0u;
+    }
+  }
 }
 
 void N_BVH::CastRaySingleBlock(uint32_t tidX, uint32_t * out_color, float* out_depth, uint32_t a_numPasses)
 {
   profiling::Timer timer;
-  
-  #ifndef _DEBUG
-  #ifndef ENABLE_METRICS
-  #pragma omp parallel for default(shared)
-  #endif
+
+  #ifdef ENABLE_METRICS
+  const bool usePackets = false; // traversal metrics are gathered per single ray
+  #else
+  const bool usePackets = (m_measureOverhead == 0);
   #endif
-  for(int i=0;i<tidX;i++)
-    CastRaySingle(i, out_color, out_depth);
+
+  if(m_tiledPrimaryRays && m_measureOverhead == 0)
+  {
+    const int blocksNum = int((tidX + RAY_BLOCK_SIZE - 1) / RAY_BLOCK_SIZE);
+    #ifndef _DEBUG
+    #pragma omp parallel for default(shared) schedule(dynamic)
+    #endif
+    for(int blockId=0;blockId<blocksNum;blockId++)
+      CastRayTileBlock(blockId*RAY_BLOCK_SIZE, std::min<uint32_t>(RAY_BLOCK_SIZE, tidX - blockId*RAY_BLOCK_SIZE), out_color, out_depth);
+  }
+  else if(usePackets)
+  {
+    const int blocksNum = int((tidX + RAY_BLOCK_SIZE - 1) / RAY_BLOCK_SIZE);
+    #ifndef _DEBUG
+    #pragma omp parallel for default(shared) schedule(dynamic)
+    #endif
+    for(int blockId=0;blockId<blocksNum;blockId++)
+      CastRayPacketBlock(blockId*RAY_BLOCK_SIZE, std::min<uint32_t>(RAY_BLOCK_SIZE, tidX - blockId*RAY_BLOCK_SIZE), out_color, out_depth);
+  }
+  else
+  {
+    #ifndef _DEBUG
+    #pragma omp parallel for default(shared)
+    #endif
+    for(int i=0;i<tidX;i++)
+      CastRaySingle(i, out_color, out_depth);
+  }
 
   timeDataByName["CastRaySingleBlock"] = timer.getElapsedTime().asMilliseconds();
 }
 
+void N_BVH::CastRayPacketBlock(uint32_t a_firstTid, uint32_t a_tidNum, uint32_t* out_color, float* out_depth)
+{
+  alignas(32) float posX[RAY_BLOCK_SIZE], posY[RAY_BLOCK_SIZE], posZ[RAY_BLOCK_SIZE], tNear[RAY_BLOCK_SIZE];
+  alignas(32) float dirX[RAY_BLOCK_SIZE], dirY[RAY_BLOCK_SIZE], dirZ[RAY_BLOCK_SIZE], tFar [RAY_BLOCK_SIZE];
+  CRT_Hit hits[RAY_BLOCK_SIZE];
+
+  // consecutive tids of m_packedXY form 8x8 screen tiles, so eye rays of a block are coherent
+  //
+  for(uint32_t i=0;i<a_tidNum;i++)
+  {
+    float4 rayPosAndNear, rayDirAndFar;
+    kernel_InitEyeRay(a_firstTid + i, &rayPosAndNear, &rayDirAndFar);
+    posX[i] = rayPosAndNear.x; posY[i] = rayPosAndNear.y; posZ[i] = rayPosAndNear.z; tNear[i] = rayPosAndNear.w;
+    dirX[i] = rayDirAndFar.x;  dirY[i] = rayDirAndFar.y;  dirZ[i] = rayDirAndFar.z;  tFar[i]  = rayDirAndFar.w;
+  }
+
+  const RayStreamSoA rays = {posX, posY, posZ, tNear, dirX, dirY, dirZ, tFar};
+  m_pAccelStruct->RayQuery_NearestHitBatch(rays, a_tidNum, hits);
+
+  for(uint32_t i=0;i<a_tidNum;i++)
+  {
+    const float4 rayPosAndNear = float4(posX[i], posY[i], posZ[i], tNear[i]);
+    const float4 rayDirAndFar  = float4(dirX[i], dirY[i], dirZ[i], tFar[i]);
+    kernel_ShadeHit(a_firstTid + i, &rayPosAndNear, &rayDirAndFar, &hits[i], out_color, out_depth);
+  }
+}
+
+void N_BVH::CastRayTileBlock(uint32_t a_firstTid, uint32_t a_tidNum, uint32_t* out_color, float* out_depth)
+{
+  float4  rayPosAndNear[RAY_BLOCK_SIZE];
+  float4  rayDirAndFar [RAY_BLOCK_SIZE];
+  CRT_Hit hits[RAY_BLOCK_SIZE];
+
+  // the block is an 8x8 screen tile of m_packedXY and all eye rays start at the camera position
+  //
+  for(uint32_t i=0;i<a_tidNum;i++)
+    kernel_InitEyeRay(a_firstTid + i, &rayPosAndNear[i], &rayDirAndFar[i]);
+
+  m_pAccelStruct->RayQuery_NearestHitTile(rayPosAndNear[0], rayDirAndFar, a_tidNum, hits);
+
+  for(uint32_t i=0;i<a_tidNum;i++)
+    kernel_ShadeHit(a_firstTid + i, &rayPosAndNear[i], &rayDirAndFar[i], &hits[i], out_color, out_depth);
+}
+
 const char* N_BVH::Name() const
 {
   std::stringstream strout;
@@ -620,6 +1832,12 @@ const char* N_BVH::Name() const
 
 CustomMetrics N_BVH::GetMetrics() const 
 {
+  // counters of every query path (reference render, dataset generation, instance culling) are merged here, right before they are reported
+  //
+  #ifdef ENABLE_METRICS
+  m_pAccelStruct->MergeThreadStats();
+  #endif
+
   auto traceMetrics = m_pAccelStruct->GetStats();
   CustomMetrics res = {};
   for (int i = 0; i < TREELET_ARR_SIZE; i++) {
@@ -14,6 +14,10 @@ set(MODULE_SOURCES
         nbvh_host.cpp
         bvh_tree.cpp
         bvh_tree_host.cpp
+        bvh_tree_packet.cpp
+        bvh_tree_cache.cpp
+        dataset_shard.cpp
+        active_sampler.cpp
         utils.cpp
     ${LOADER_EXTERNAL_SRC}
 )
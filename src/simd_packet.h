@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Thin wrappers over the widest float vector available at compile time.
+// AVX2 gives 8-wide packets, SSE2 (always present on x86-64) gives 4-wide ones,
+// and other targets (Android/ARM builds) get a plain scalar emulation of 4 lanes.
+//
+namespace simd
+{
+#if defined(__AVX2__)
+
+  static constexpr uint32_t PACKET_SIZE = 8;
+
+  struct vfloat { __m256 v; };
+  struct vmask  { __m256 v; };
+
+  static inline vfloat load (const float* p)     { return {_mm256_loadu_ps(p)}; }
+  static inline void   store(float* p, vfloat a) { _mm256_storeu_ps(p, a.v); }
+  static inline vfloat set1 (float a)            { return {_mm256_set1_ps(a)}; }
+
+  static inline vfloat operator+(vfloat a, vfloat b) { return {_mm256_add_ps(a.v, b.v)}; }
+  static inline vfloat operator-(vfloat a, vfloat b) { return {_mm256_sub_ps(a.v, b.v)}; }
+  static inline vfloat operator*(vfloat a, vfloat b) { return {_mm256_mul_ps(a.v, b.v)}; }
+  static inline vfloat operator/(vfloat a, vfloat b) { return {_mm256_div_ps(a.v, b.v)}; }
+  static inline vfloat vmin(vfloat a, vfloat b)      { return {_mm256_min_ps(a.v, b.v)}; }
+  static inline vfloat vmax(vfloat a, vfloat b)      { return {_mm256_max_ps(a.v, b.v)}; }
+  static inline vfloat vsqrt(vfloat a)               { return {_mm256_sqrt_ps(a.v)}; }
+  static inline vfloat vabs (vfloat a)               { return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)}; }
+
+  static inline vmask operator< (vfloat a, vfloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+  static inline vmask operator<=(vfloat a, vfloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+  static inline vmask operator> (vfloat a, vfloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+  static inline vmask operator>=(vfloat a, vfloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+  static inline vmask operator&(vmask a, vmask b)    { return {_mm256_and_ps(a.v, b.v)}; }
+  static inline vmask operator|(vmask a, vmask b)    { return {_mm256_or_ps(a.v, b.v)}; }
+
+  static inline uint32_t bits(vmask a) { return uint32_t(_mm256_movemask_ps(a.v)); }
+  static inline vfloat   select(vmask m, vfloat a, vfloat b) { return {_mm256_blendv_ps(b.v, a.v, m.v)}; }
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+  static constexpr uint32_t PACKET_SIZE = 4;
+
+  struct vfloat { __m128 v; };
+  struct vmask  { __m128 v; };
+
+  static inline vfloat load (const float* p)     { return {_mm_loadu_ps(p)}; }
+  static inline void   store(float* p, vfloat a) { _mm_storeu_ps(p, a.v); }
+  static inline vfloat set1 (float a)            { return {_mm_set1_ps(a)}; }
+
+  static inline vfloat operator+(vfloat a, vfloat b) { return {_mm_add_ps(a.v, b.v)}; }
+  static inline vfloat operator-(vfloat a, vfloat b) { return {_mm_sub_ps(a.v, b.v)}; }
+  static inline vfloat operator*(vfloat a, vfloat b) { return {_mm_mul_ps(a.v, b.v)}; }
+  static inline vfloat operator/(vfloat a, vfloat b) { return {_mm_div_ps(a.v, b.v)}; }
+  static inline vfloat vmin(vfloat a, vfloat b)      { return {_mm_min_ps(a.v, b.v)}; }
+  static inline vfloat vmax(vfloat a, vfloat b)      { return {_mm_max_ps(a.v, b.v)}; }
+  static inline vfloat vsqrt(vfloat a)               { return {_mm_sqrt_ps(a.v)}; }
+  static inline vfloat vabs (vfloat a)               { return {_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)}; }
+
+  static inline vmask operator< (vfloat a, vfloat b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+  static inline vmask operator<=(vfloat a, vfloat b) { return {_mm_cmple_ps(a.v, b.v)}; }
+  static inline vmask operator> (vfloat a, vfloat b) { return {_mm_cmpgt_ps(a.v, b.v)}; }
+  static inline vmask operator>=(vfloat a, vfloat b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+  static inline vmask operator&(vmask a, vmask b)    { return {_mm_and_ps(a.v, b.v)}; }
+  static inline vmask operator|(vmask a, vmask b)    { return {_mm_or_ps(a.v, b.v)}; }
+
+  static inline uint32_t bits(vmask a) { return uint32_t(_mm_movemask_ps(a.v)); }
+  static inline vfloat   select(vmask m, vfloat a, vfloat b) { return {_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))}; }
+
+#else
+
+  static constexpr uint32_t PACKET_SIZE = 4;
+
+  struct vfloat { float v[PACKET_SIZE]; };
+  struct vmask  { uint32_t m; };
+
+  static inline vfloat load (const float* p)     { vfloat r; for(uint32_t i=0;i<PACKET_SIZE;i++) r.v[i] = p[i]; return r; }
+  static inline void   store(float* p, vfloat a) { for(uint32_t i=0;i<PACKET_SIZE;i++) p[i] = a.v[i]; }
+  static inline vfloat set1 (float a)            { vfloat r; for(uint32_t i=0;i<PACKET_SIZE;i++) r.v[i] = a; return r; }
+
+  #define SIMD_LANEWISE_OP(OP) { vfloat r; for(uint32_t i=0;i<PACKET_SIZE;i++) r.v[i] = OP; return r; }
+  #define SIMD_LANEWISE_CMP(OP) { vmask r = {0}; for(uint32_t i=0;i<PACKET_SIZE;i++) r.m |= (a.v[i] OP b.v[i]) ? (1u << i) : 0u; return r; }
+
+  static inline vfloat operator+(vfloat a, vfloat b) SIMD_LANEWISE_OP(a.v[i] + b.v[i])
+  static inline vfloat operator-(vfloat a, vfloat b) SIMD_LANEWISE_OP(a.v[i] - b.v[i])
+  static inline vfloat operator*(vfloat a, vfloat b) SIMD_LANEWISE_OP(a.v[i] * b.v[i])
+  static inline vfloat operator/(vfloat a, vfloat b) SIMD_LANEWISE_OP(a.v[i] / b.v[i])
+  static inline vfloat vmin(vfloat a, vfloat b)      SIMD_LANEWISE_OP(a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+  static inline vfloat vmax(vfloat a, vfloat b)      SIMD_LANEWISE_OP(a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+  static inline vfloat vsqrt(vfloat a)               SIMD_LANEWISE_OP(std::sqrt(a.v[i]))
+  static inline vfloat vabs (vfloat a)               SIMD_LANEWISE_OP(std::fabs(a.v[i]))
+
+  static inline vmask operator< (vfloat a, vfloat b) SIMD_LANEWISE_CMP(< )
+  static inline vmask operator<=(vfloat a, vfloat b) SIMD_LANEWISE_CMP(<=)
+  static inline vmask operator> (vfloat a, vfloat b) SIMD_LANEWISE_CMP(> )
+  static inline vmask operator>=(vfloat a, vfloat b) SIMD_LANEWISE_CMP(>=)
+  static inline vmask operator&(vmask a, vmask b)    { return {a.m & b.m}; }
+  static inline vmask operator|(vmask a, vmask b)    { return {a.m | b.m}; }
+
+  #undef SIMD_LANEWISE_OP
+  #undef SIMD_LANEWISE_CMP
+
+  static inline uint32_t bits(vmask a) { return a.m; }
+  static inline vfloat   select(vmask m, vfloat a, vfloat b) { vfloat r; for(uint32_t i=0;i<PACKET_SIZE;i++) r.v[i] = ((m.m >> i) & 1u) ? a.v[i] : b.v[i]; return r; }
+
+#endif
+
+  // fixed 4-wide vectors for BVH4 child tests, independent of PACKET_SIZE
+  //
+#if defined(__SSE2__) || defined(_M_X64)
+
+  struct vfloat4 { __m128 v; };
+  struct vmask4  { __m128 v; };
+
+  static inline vfloat4 load4 (const float* p)      { return {_mm_loadu_ps(p)}; }
+  static inline void    store4(float* p, vfloat4 a) { _mm_storeu_ps(p, a.v); }
+  static inline vfloat4 set4  (float a)             { return {_mm_set1_ps(a)}; }
+
+  static inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+  static inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+  static inline vfloat4 vmin(vfloat4 a, vfloat4 b)      { return {_mm_min_ps(a.v, b.v)}; }
+  static inline vfloat4 vmax(vfloat4 a, vfloat4 b)      { return {_mm_max_ps(a.v, b.v)}; }
+
+  static inline vmask4 operator<=(vfloat4 a, vfloat4 b) { return {_mm_cmple_ps(a.v, b.v)}; }
+  static inline vmask4 operator>=(vfloat4 a, vfloat4 b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+  static inline vmask4 operator&(vmask4 a, vmask4 b)    { return {_mm_and_ps(a.v, b.v)}; }
+
+  static inline uint32_t bits(vmask4 a) { return uint32_t(_mm_movemask_ps(a.v)); }
+
+#else
+
+  struct vfloat4 { float v[4]; };
+  struct vmask4  { uint32_t m; };
+
+  static inline vfloat4 load4 (const float* p)      { return {{p[0], p[1], p[2], p[3]}}; }
+  static inline void    store4(float* p, vfloat4 a) { for(int i=0;i<4;i++) p[i] = a.v[i]; }
+  static inline vfloat4 set4  (float a)             { return {{a, a, a, a}}; }
+
+  static inline vfloat4 operator-(vfloat4 a, vfloat4 b) { vfloat4 r; for(int i=0;i<4;i++) r.v[i] = a.v[i] - b.v[i]; return r; }
+  static inline vfloat4 operator*(vfloat4 a, vfloat4 b) { vfloat4 r; for(int i=0;i<4;i++) r.v[i] = a.v[i] * b.v[i]; return r; }
+  static inline vfloat4 vmin(vfloat4 a, vfloat4 b)      { vfloat4 r; for(int i=0;i<4;i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+  static inline vfloat4 vmax(vfloat4 a, vfloat4 b)      { vfloat4 r; for(int i=0;i<4;i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+
+  static inline vmask4 operator<=(vfloat4 a, vfloat4 b) { vmask4 r = {0}; for(int i=0;i<4;i++) r.m |= (a.v[i] <= b.v[i]) ? (1u << i) : 0u; return r; }
+  static inline vmask4 operator>=(vfloat4 a, vfloat4 b) { vmask4 r = {0}; for(int i=0;i<4;i++) r.m |= (a.v[i] >= b.v[i]) ? (1u << i) : 0u; return r; }
+  static inline vmask4 operator&(vmask4 a, vmask4 b)    { return {a.m & b.m}; }
+
+  static inline uint32_t bits(vmask4 a) { return a.m; }
+
+#endif
+
+  static constexpr uint32_t FULL_MASK = (1u << PACKET_SIZE) - 1u;
+
+  static inline uint32_t popcount(uint32_t a_mask) { return uint32_t(__builtin_popcount(a_mask)); }
+  static inline uint32_t lowestLane(uint32_t a_mask) { return uint32_t(__builtin_ctz(a_mask)); }
+}
+
+// Coherent packet of rays in SoA form, one lane per ray;
+// tFar holds the current closest hit of every lane and shrinks during traversal.
+//
+struct RayPacket
+{
+  alignas(32) float orgX[simd::PACKET_SIZE];
+  alignas(32) float orgY[simd::PACKET_SIZE];
+  alignas(32) float orgZ[simd::PACKET_SIZE];
+  alignas(32) float dirX[simd::PACKET_SIZE];
+  alignas(32) float dirY[simd::PACKET_SIZE];
+  alignas(32) float dirZ[simd::PACKET_SIZE];
+  alignas(32) float invX[simd::PACKET_SIZE];
+  alignas(32) float invY[simd::PACKET_SIZE];
+  alignas(32) float invZ[simd::PACKET_SIZE];
+  alignas(32) float tNear[simd::PACKET_SIZE];
+  alignas(32) float tFar [simd::PACKET_SIZE];
+};
@@ -1,26 +1,53 @@
 #include "utils.h"
 #include "LiteMath.h"
+#include "simd_packet.h"
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
 
-float3 sampleUniformBBox(LiteMath::BBox3f BBox)
+RandomGen randomInit(uint64_t a_seed, uint64_t a_streamId)
+{
+    RandomGen gen;
+    gen.state = 0u;
+    gen.inc   = (a_streamId << 1u) | 1u;
+    randomNext(gen);
+    gen.state += a_seed;
+    randomNext(gen);
+    return gen;
+}
+
+uint32_t randomNext(RandomGen& gen)
+{
+    const uint64_t oldState = gen.state;
+    gen.state = oldState * 6364136223846793005ull + gen.inc;
+    const uint32_t xorShifted = uint32_t(((oldState >> 18u) ^ oldState) >> 27u);
+    const uint32_t rot        = uint32_t(oldState >> 59u);
+    return (xorShifted >> rot) | (xorShifted << ((32u - rot) & 31u));
+}
+
+float randomFloat(RandomGen& gen)
+{
+    return float(randomNext(gen) >> 8) * (1.f / 16777216.f); // 24 bits, exact in float
+}
+
+float3 sampleUniformBBox(LiteMath::BBox3f BBox, RandomGen& gen)
 {
     float3 point;
-    point.x = BBox.boxMin.x + (BBox.boxMax.x - BBox.boxMin.x) * (std::rand() / static_cast<float>(RAND_MAX));
-    point.y = BBox.boxMin.y + (BBox.boxMax.y - BBox.boxMin.y) * (std::rand() / static_cast<float>(RAND_MAX));
-    point.z = BBox.boxMin.z + (BBox.boxMax.z - BBox.boxMin.z) * (std::rand() / static_cast<float>(RAND_MAX));
+    point.x = BBox.boxMin.x + (BBox.boxMax.x - BBox.boxMin.x) * randomFloat(gen);
+    point.y = BBox.boxMin.y + (BBox.boxMax.y - BBox.boxMin.y) * randomFloat(gen);
+    point.z = BBox.boxMin.z + (BBox.boxMax.z - BBox.boxMin.z) * randomFloat(gen);
     return point;
 }
 
-float3 sampleUnitSphere()
+float3 sampleUnitSphere(RandomGen& gen)
 {
     float3 point = {1.f, 1.f, 1.f};
     
     while (dot(point, point) >= 1.f)
     {
-        point.x = (std::rand() / static_cast<float>(RAND_MAX) - 0.5f) * 2.f;
-        point.y = (std::rand() / static_cast<float>(RAND_MAX) - 0.5f) * 2.f;
-        point.z = (std::rand() / static_cast<float>(RAND_MAX) - 0.5f) * 2.f;
+        point.x = (randomFloat(gen) - 0.5f) * 2.f;
+        point.y = (randomFloat(gen) - 0.5f) * 2.f;
+        point.z = (randomFloat(gen) - 0.5f) * 2.f;
     }
 
     return normalize(point);
@@ -66,29 +93,126 @@ LiteMath::Box4f getInstanceBBox(LiteMath::float4x4 transform, LiteMath::Box4f or
     return instanceBBox;
 }
 
-uint32_t packNormal(const float3& normal) { 
-    float3 n = normalize(normal);
+static inline float octSign(float a) { return (a >= 0.0f) ? 1.0f : -1.0f; }
+
+static inline uint32_t octQuantize(float a) { return static_cast<uint32_t>((clip(-1.0f, 1.0f, a) * 0.5f + 0.5f) * 65535.0f + 0.5f); }
+
+static inline float octDequantize(uint32_t a) { return static_cast<float>(a) / 65535.0f * 2.0f - 1.0f; }
 
-    float nx = (n.x + 1.0f) * 0.5f;
-    float ny = (n.y + 1.0f) * 0.5f;
+uint32_t packNormal(const float3& normal) 
+{
+    // project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the diagonals
+    float l1 = std::max(std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z), 1e-30f);
+    float u  = normal.x / l1;
+    float v  = normal.y / l1;
 
-    uint16_t x = static_cast<uint16_t>(std::round(nx * 65535.0f));
-    uint16_t y = static_cast<uint16_t>(std::round(ny * 65535.0f));
+    if (normal.z < 0.0f)
+    {
+        float uFolded = (1.0f - std::fabs(v)) * octSign(u);
+        float vFolded = (1.0f - std::fabs(u)) * octSign(v);
+        u = uFolded;
+        v = vFolded;
+    }
 
-    return (x & 0xFFFF) | ((y & 0xFFFF) << 16);
+    return octQuantize(u) | (octQuantize(v) << 16);
 }
 
-float3 unpackNormal(uint32_t packed) {
-    uint16_t x = packed & 0xFFFF;
-    uint16_t y = (packed >> 16) & 0xFFFF;
+float3 unpackNormal(uint32_t packed) 
+{
+    float u = octDequantize(packed & 0xFFFF);
+    float v = octDequantize((packed >> 16) & 0xFFFF);
+    float w = 1.0f - std::fabs(u) - std::fabs(v);
+
+    float t = std::max(-w, 0.0f);
+    u += (u >= 0.0f) ? -t : t;
+    v += (v >= 0.0f) ? -t : t;
 
-    float nx = static_cast<float>(x) / 65535.0f;
-    float ny = static_cast<float>(y) / 65535.0f;
+    return normalize(float3(u, v, w));
+}
 
-    nx = nx * 2.0f - 1.0f;
-    ny = ny * 2.0f - 1.0f;
+void packNormals(const float* nx, const float* ny, const float* nz, size_t count, uint32_t* packed)
+{
+    using namespace simd;
+
+    const vfloat zero = set1(0.0f);
+    const vfloat one  = set1(1.0f);
+
+    alignas(32) float uLanes[PACKET_SIZE], vLanes[PACKET_SIZE];
+
+    size_t i = 0;
+    for (; i + PACKET_SIZE <= count; i += PACKET_SIZE)
+    {
+        const vfloat x = load(nx + i);
+        const vfloat y = load(ny + i);
+        const vfloat z = load(nz + i);
 
-    float nz = std::sqrt(fabs(1.0f - nx * nx - ny * ny));
+        const vfloat l1 = vmax(vabs(x) + vabs(y) + vabs(z), set1(1e-30f));
+        const vfloat u  = x / l1;
+        const vfloat v  = y / l1;
 
-    return {nx, ny, nz};
-}
\ No newline at end of file
+        const vfloat uFolded = (one - vabs(v)) * select(u >= zero, one, set1(-1.0f));
+        const vfloat vFolded = (one - vabs(u)) * select(v >= zero, one, set1(-1.0f));
+        const vmask  lower   = z < zero;
+
+        store(uLanes, select(lower, uFolded, u));
+        store(vLanes, select(lower, vFolded, v));
+
+        for (uint32_t lane = 0; lane < PACKET_SIZE; ++lane)
+            packed[i + lane] = octQuantize(uLanes[lane]) | (octQuantize(vLanes[lane]) << 16);
+    }
+
+    for (; i < count; ++i)
+        packed[i] = packNormal(float3(nx[i], ny[i], nz[i]));
+}
+
+void unpackNormals(const uint32_t* packed, size_t count, float* nx, float* ny, float* nz)
+{
+    using namespace simd;
+
+    const vfloat zero = set1(0.0f);
+    const vfloat one  = set1(1.0f);
+
+    alignas(32) float uLanes[PACKET_SIZE], vLanes[PACKET_SIZE];
+
+    size_t i = 0;
+    for (; i + PACKET_SIZE <= count; i += PACKET_SIZE)
+    {
+        for (uint32_t lane = 0; lane < PACKET_SIZE; ++lane)
+        {
+            uLanes[lane] = octDequantize(packed[i + lane] & 0xFFFF);
+            vLanes[lane] = octDequantize((packed[i + lane] >> 16) & 0xFFFF);
+        }
+
+        vfloat u = load(uLanes);
+        vfloat v = load(vLanes);
+        const vfloat w = one - vabs(u) - vabs(v);
+
+        const vfloat t = vmax(zero - w, zero);
+        u = select(u >= zero, u - t, u + t);
+        v = select(v >= zero, v - t, v + t);
+
+        const vfloat invLen = one / vsqrt(u * u + v * v + w * w);
+        store(nx + i, u * invLen);
+        store(ny + i, v * invLen);
+        store(nz + i, w * invLen);
+    }
+
+    for (; i < count; ++i)
+    {
+        const float3 n = unpackNormal(packed[i]);
+        nx[i] = n.x;
+        ny[i] = n.y;
+        nz[i] = n.z;
+    }
+}
+
+uint64_t hashFNV1a(const void* a_data, size_t a_size, uint64_t a_hash)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(a_data);
+    for (size_t i = 0; i < a_size; ++i)
+    {
+        a_hash ^= bytes[i];
+        a_hash *= 1099511628211ull;
+    }
+    return a_hash;
+}
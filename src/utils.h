@@ -17,14 +17,38 @@ T clip(T a, T b, T value)
     return value;
 }
 
-float3 sampleUniformBBox(LiteMath::BBox3f BBox);
+// PCG32 generator; a stream is fully defined by (seed, streamId), so keying it by sample index 
+// gives the same numbers for every sample whatever thread generates it
+struct RandomGen
+{
+    uint64_t state;
+    uint64_t inc;
+};
+
+RandomGen randomInit(uint64_t a_seed, uint64_t a_streamId);
+
+uint32_t randomNext(RandomGen& gen);
+
+// uniform in [0, 1)
+float randomFloat(RandomGen& gen);
 
-float3 sampleUnitSphere();
+float3 sampleUniformBBox(LiteMath::BBox3f BBox, RandomGen& gen);
+
+float3 sampleUnitSphere(RandomGen& gen);
 
 void positional_encoding(float3 pos, float* res);
 
 LiteMath::Box4f getInstanceBBox(LiteMath::float4x4 transform, LiteMath::Box4f origBBox);
 
+// octahedral encoding of a unit vector into two 16-bit components, the sign of z is preserved
 uint32_t packNormal(const float3& normal);
 
-float3 unpackNormal(uint32_t packed);
\ No newline at end of file
+float3 unpackNormal(uint32_t packed);
+
+// batched versions over SoA arrays, produce the same codes as the scalar ones
+void packNormals(const float* nx, const float* ny, const float* nz, size_t count, uint32_t* packed);
+
+void unpackNormals(const uint32_t* packed, size_t count, float* nx, float* ny, float* nz);
+
+// FNV-1a hash, pass the previous result as a_hash to hash several pieces of data as one
+uint64_t hashFNV1a(const void* a_data, size_t a_size, uint64_t a_hash = 14695981039346656037ull);